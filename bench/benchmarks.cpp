@@ -0,0 +1,417 @@
+// Standalone benchmarks. Run `make benchmarks` with the test servers from
+// test/support/server up, or pass benchmark names to bench/benchmarks to run
+// a subset.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <map>
+#include <numeric>
+#include <string>
+#include <vector>
+#include "../simple_http.hpp"
+#if defined(__unix__) || defined(__APPLE__)
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#endif
+
+using namespace SimpleHttp;
+
+using Clock = std::chrono::steady_clock;
+
+// Benchmarks add what they read here so the work is not optimized away.
+static volatile size_t SINK = 0;
+
+static bool CURL_SUPPORTS(const std::string &protocol) {
+  const curl_version_info_data *info = curl_version_info(CURLVERSION_NOW);
+  for (const char *const *supported = info->protocols; *supported != nullptr; ++supported) {
+    if (protocol == *supported) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Runs body `iterations` times and prints the throughput.
+template<typename F>
+static void report(const std::string &name, size_t iterations, F &&body) {
+  const auto start = Clock::now();
+  for (size_t i = 0; i < iterations; ++i) {
+    body(i);
+  }
+  const std::chrono::duration<double> elapsed = Clock::now() - start;
+  std::printf("%-48s %10zu ops %12.0f ops/s %14.1f ns/op\n",
+              name.c_str(),
+              iterations,
+              iterations / elapsed.count(),
+              elapsed.count() * 1e9 / iterations);
+}
+
+static void skip(const std::string &name, const std::string &reason) {
+  std::printf("%-48s skipped: %s\n", name.c_str(), reason.c_str());
+}
+
+// Round trips small text messages through the echo server on :5001.
+static void websocket() {
+#if defined(CURLWS_TEXT)
+  if (!CURL_SUPPORTS("ws")) {
+    skip("websocket echo", "libcurl was built without WebSocket support");
+    return;
+  }
+  Client client;
+  HttpUrl url = HttpUrl()
+      .with_protocol(Protcol{"ws"})
+      .with_host(Host{"localhost:5001"});
+  auto connected = client.websocket(url);
+  if (!std::holds_alternative<WebSocket>(connected)) {
+    skip("websocket echo", std::get<HttpConnectionFailure>(connected).value());
+    return;
+  }
+  WebSocket &socket = std::get<WebSocket>(connected);
+  const std::string message(64, 'x');
+  char buffer[128];
+  report("websocket echo (64 byte text)", 20000, [&](size_t) {
+    (void) socket.send_text(message);
+    (void) socket.receive(buffer, sizeof(buffer));
+  });
+  (void) socket.close();
+#else
+  skip("websocket echo", "libcurl headers have no WebSocket API");
+#endif
+}
+
+// Hands one result to 8 consumers, as a dispatcher feeding per-consumer queues
+// would, against handing each of them its own copy of the body string.
+static void fan_out() {
+  for (size_t size : {1024, 1024 * 1024}) {
+    const std::string body(size, 'x');
+    HttpResponse response{OK, HttpResponseHeaders{Headers{}}, HttpResponseBody{body}};
+    const HttpResult result{HttpSuccess{std::move(response)}};
+    const std::string suffix = " (" + std::to_string(size / 1024) + " KiB, 8 consumers)";
+    size_t seen = 0;
+
+    std::vector<std::string> strings;
+    report("fan-out std::string" + suffix, 2000, [&](size_t) {
+      strings.clear();
+      for (int consumer = 0; consumer < 8; ++consumer) {
+        seen += strings.emplace_back(body).size();
+      }
+    });
+
+    std::vector<HttpResult> results;
+    report("fan-out HttpResult" + suffix, 2000, [&](size_t) {
+      results.clear();
+      for (int consumer = 0; consumer < 8; ++consumer) {
+        seen += std::get<HttpSuccess>(results.emplace_back(result).value()).body().value().size();
+      }
+    });
+    SINK += seen;
+  }
+}
+
+// Matches on a result through the std::function overload and through the
+// deduced one.
+static void match() {
+  HttpResponse response{OK, HttpResponseHeaders{Headers{}}, HttpResponseBody{std::string{"body"}}};
+  const HttpResult result{HttpSuccess{std::move(response)}};
+  size_t seen = 0;
+
+  report("match std::function", 10000000, [&](size_t i) {
+    seen += result.match<size_t>(
+        [i](const HttpFailure &) { return i; },
+        [i](const HttpSuccess &success) { return success.body().value().size() + i; });
+  });
+
+  report("match deduced", 10000000, [&](size_t i) {
+    seen += result.match(
+        [i](const HttpFailure &) { return i; },
+        [i](const HttpSuccess &success) { return success.body().value().size() + i; });
+  });
+  SINK += seen;
+}
+
+static HttpUrl local(const std::string &path) {
+  return HttpUrl()
+      .with_protocol(Protcol{"http"})
+      .with_host(Host{"localhost:5000"})
+      .with_path_segments(PathSegments{{PathSegment{path}}});
+}
+
+// Spreads gets of /cached over 100 keys, 20 each, so 95% of them can be
+// served from the cache once every key has been fetched.
+static void cache() {
+  auto get = [](const Client &client) {
+    return [&client](size_t i) {
+      HttpUrl url = local("cached").with_query_parameters(QueryParameters{
+          {{QueryParameterKey{"key"}, QueryParameterValue{std::to_string(i % 100)}}}});
+      SINK += client.get(url).success().has_value();
+    };
+  };
+
+  Client uncached;
+  report("get without cache", 2000, get(uncached));
+
+  auto store = std::make_shared<HttpCache>(std::make_shared<MemoryCache>(1 << 20));
+  Client cached = Client{}.with_cache(store);
+  report("get with cache (95% hits)", 2000, get(cached));
+  const CacheStatistics statistics = store->statistics();
+  std::printf("  hits %llu, misses %llu\n",
+              static_cast<unsigned long long>(statistics.hits),
+              static_cast<unsigned long long>(statistics.misses));
+}
+
+#if defined(__unix__) || defined(__APPLE__)
+// Removes the directory it created when it goes out of scope.
+struct TemporaryDirectory final {
+  TemporaryDirectory() {
+    char path_template[] = "/tmp/simple_http_bench_XXXXXX";
+    path = mkdtemp(path_template);
+  }
+  ~TemporaryDirectory() { std::filesystem::remove_all(path); }
+
+  std::string path;
+};
+
+// Restarts a worker that had fetched 100 keys, once with only a memory cache
+// and once with a DiskCache, then times lookups of 64 KiB bodies.
+static void disk_cache() {
+  TemporaryDirectory directory;
+  auto get = [](const Client &client) {
+    return [&client](size_t i) {
+      HttpUrl url = local("cached").with_query_parameters(QueryParameters{
+          {{QueryParameterKey{"key"}, QueryParameterValue{std::to_string(i)}}}});
+      SINK += client.get(url).success().has_value();
+    };
+  };
+  {
+    Client warm = Client{}.with_cache(std::make_shared<HttpCache>(
+        std::make_shared<DiskCache>(directory.path, 64 << 20)));
+    for (size_t i = 0; i < 100; ++i) {
+      get(warm)(i);
+    }
+  }
+
+  auto memory = std::make_shared<HttpCache>(std::make_shared<MemoryCache>(64 << 20));
+  Client restarted = Client{}.with_cache(memory);
+  report("restart with memory cache: get", 100, get(restarted));
+  std::printf("  misses %llu\n", static_cast<unsigned long long>(memory->statistics().misses));
+
+  auto disk = std::make_shared<HttpCache>(std::make_shared<DiskCache>(directory.path, 64 << 20));
+  Client recovered = Client{}.with_cache(disk);
+  report("restart with disk cache: get", 100, get(recovered));
+  std::printf("  misses %llu\n", static_cast<unsigned long long>(disk->statistics().misses));
+
+  DiskCache store{directory.path + "/bodies", 256 << 20};
+  CacheEntry entry{HttpResponse{OK, HttpResponseHeaders{Headers{}}, HttpResponseBody{std::string(64 * 1024, 'x')}},
+                   std::chrono::system_clock::now(),
+                   std::chrono::seconds{60}};
+  report("disk cache store (64 KiB)", 1000, [&](size_t i) {
+    store.store(std::to_string(i), entry);
+  });
+  report("disk cache lookup (64 KiB)", 100000, [&](size_t i) {
+    SINK += store.lookup(std::to_string(i % 1000))->response.body.view().size();
+  });
+}
+// A minimal HTTP server on 127.0.0.1 that answers every request with "ok"
+// after the delay latency(in_flight) returns, one connection per request.
+struct LocalServer final {
+  explicit LocalServer(std::function<std::chrono::microseconds(int)> latency)
+      : latency_(std::move(latency)) {
+    listener_ = ::socket(AF_INET, SOCK_STREAM, 0);
+    int reuse = 1;
+    ::setsockopt(listener_, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t length = sizeof(address);
+    if (::bind(listener_, reinterpret_cast<sockaddr *>(&address), length) != 0 ||
+        ::listen(listener_, 512) != 0 ||
+        ::getsockname(listener_, reinterpret_cast<sockaddr *>(&address), &length) != 0) {
+      std::perror("LocalServer");
+      std::exit(1);
+    }
+    host = Host{"127.0.0.1:" + std::to_string(ntohs(address.sin_port))};
+    acceptor_ = std::thread([this] { accept(); });
+  }
+
+  ~LocalServer() {
+    stopping_ = true;
+    acceptor_.join();
+    ::close(listener_);
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (std::thread &handler : handlers_) {
+      handler.join();
+    }
+  }
+
+  Host host{""};
+
+private:
+  std::function<std::chrono::microseconds(int)> latency_;
+  int listener_;
+  std::atomic<bool> stopping_{false};
+  std::atomic<int> in_flight_{0};
+  std::thread acceptor_;
+  std::mutex mutex_;
+  std::vector<std::thread> handlers_;
+
+  void accept() {
+    while (!stopping_) {
+      pollfd ready{listener_, POLLIN, 0};
+      if (::poll(&ready, 1, 50) <= 0) {
+        continue;
+      }
+      int connection = ::accept(listener_, nullptr, nullptr);
+      if (connection < 0) {
+        continue;
+      }
+      std::lock_guard<std::mutex> lock(mutex_);
+      handlers_.emplace_back([this, connection] { respond(connection); });
+    }
+  }
+
+  void respond(int connection) {
+    std::string request;
+    char buffer[1024];
+    while (request.find("\r\n\r\n") == std::string::npos) {
+      ssize_t received = ::recv(connection, buffer, sizeof(buffer), 0);
+      if (received <= 0) {
+        ::close(connection);
+        return;
+      }
+      request.append(buffer, static_cast<size_t>(received));
+    }
+    const int in_flight = ++in_flight_;
+    std::this_thread::sleep_for(latency_(in_flight));
+    --in_flight_;
+    const std::string response =
+        "HTTP/1.1 200 OK\r\nContent-Length: 2\r\nConnection: close\r\n\r\nok";
+    (void) ::send(connection, response.data(), response.size(), MSG_NOSIGNAL);
+    ::close(connection);
+  }
+};
+
+// Sends requests from `threads` threads at once and prints latency
+// percentiles, and how many requests failed.
+static void load(const std::string &name, const Client &client, const HttpUrl &url,
+                 size_t threads, size_t requests_per_thread) {
+  std::mutex mutex;
+  std::vector<double> latencies;
+  size_t failures = 0;
+  const auto start = Clock::now();
+  std::vector<std::thread> senders;
+  for (size_t t = 0; t < threads; ++t) {
+    senders.emplace_back([&] {
+      for (size_t i = 0; i < requests_per_thread; ++i) {
+        const auto sent = Clock::now();
+        const bool succeeded = client.get(url).success().has_value();
+        const std::chrono::duration<double, std::milli> latency = Clock::now() - sent;
+        std::lock_guard<std::mutex> lock(mutex);
+        if (succeeded) {
+          latencies.push_back(latency.count());
+        } else {
+          failures += 1;
+        }
+      }
+    });
+  }
+  for (std::thread &sender : senders) {
+    sender.join();
+  }
+  const std::chrono::duration<double> elapsed = Clock::now() - start;
+
+  std::sort(latencies.begin(), latencies.end());
+  auto percentile = [&](double p) {
+    return latencies.empty() ? 0.0 : latencies[static_cast<size_t>(p * (latencies.size() - 1))];
+  };
+  const double mean = latencies.empty()
+                          ? 0.0
+                          : std::accumulate(latencies.begin(), latencies.end(), 0.0) / latencies.size();
+  std::printf("%-40s %6.0f req/s  mean %6.2f ms  p50 %6.2f ms  p99 %6.2f ms  failed %zu\n",
+              name.c_str(),
+              latencies.size() / elapsed.count(),
+              mean,
+              percentile(0.5),
+              percentile(0.99),
+              failures);
+}
+
+// Two local backends, one 1 ms and one 10 ms away, behind an upstream group,
+// loaded by 8 threads.
+static void load_balancing() {
+  LocalServer fast([](int) { return std::chrono::milliseconds{1}; });
+  LocalServer slow([](int) { return std::chrono::milliseconds{10}; });
+  const std::vector<std::pair<std::string, LoadBalancing>> strategies = {
+      {"round robin", LoadBalancing::RoundRobin},
+      {"least outstanding", LoadBalancing::LeastOutstanding},
+      {"peak EWMA", LoadBalancing::PeakEwma},
+  };
+  for (const auto &[name, strategy] : strategies) {
+    auto group = std::make_shared<UpstreamGroup>(
+        Host{"service"}, std::vector<Host>{fast.host, slow.host}, strategy);
+    Client client = Client{}
+        .with_upstream_group(group)
+        .with_connection_pool(std::make_shared<ConnectionPool>());
+    load("upstream group, " + name, client, HttpUrl{"http://service/"}, 8, 250);
+  }
+}
+
+// A local server that handles 8 requests in 5 ms and slows down
+// quadratically beyond that, loaded by 32 threads with and without an
+// adaptive concurrency limit.
+static void concurrency_limiting() {
+  LocalServer server([](int in_flight) {
+    const double overload = std::max(1.0, in_flight / 8.0);
+    return std::chrono::microseconds{static_cast<int64_t>(5000 * overload * overload)};
+  });
+  const HttpUrl url{"http://" + server.host.value() + "/"};
+
+  load("no limit", Client{}, url, 32, 100);
+  const std::vector<std::pair<std::string, LimitAlgorithm>> algorithms = {
+      {"AIMD", LimitAlgorithm::Aimd},
+      {"gradient", LimitAlgorithm::Gradient},
+  };
+  for (const auto &[name, algorithm] : algorithms) {
+    auto limiter = std::make_shared<ConcurrencyLimiter>(algorithm);
+    limiter->with_limits(4, 1, 64)
+        .with_drop_timeout(std::chrono::milliseconds{15})
+        .with_queue_timeout(std::chrono::milliseconds{100});
+    Client client = Client{}.with_concurrency_limiter(limiter);
+    load(name + " limit, 100 ms queue", client, url, 32, 100);
+    std::printf("  final limit %u\n", limiter->limit(server.host));
+  }
+}
+#endif
+
+static const std::map<std::string, void (*)()> BENCHMARKS = {
+    {"cache", cache},
+#if defined(__unix__) || defined(__APPLE__)
+    {"concurrency_limiting", concurrency_limiting},
+    {"disk_cache", disk_cache},
+    {"load_balancing", load_balancing},
+#endif
+    {"fan_out", fan_out},
+    {"match", match},
+    {"websocket", websocket},
+};
+
+int main(int argc, char **argv) {
+  curl_global_init(CURL_GLOBAL_DEFAULT);
+  if (argc == 1) {
+    for (const auto &[name, benchmark] : BENCHMARKS) {
+      benchmark();
+    }
+  }
+  for (int i = 1; i < argc; ++i) {
+    auto found = BENCHMARKS.find(argv[i]);
+    if (found == BENCHMARKS.end()) {
+      std::fprintf(stderr, "unknown benchmark: %s\n", argv[i]);
+      return 1;
+    }
+    found->second();
+  }
+  curl_global_cleanup();
+  return 0;
+}
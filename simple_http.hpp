@@ -1,19 +1,52 @@
 #pragma once
 
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <cctype>
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
 #include <curl/curl.h>
+#include <deque>
 #include <functional>
+#include <future>
+#include <initializer_list>
+#include <limits>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <numeric>
 #include <optional>
 #include <ostream>
+#include <random>
 #include <sstream>
 #include <string>
+#include <string_view>
+#include <thread>
 #include <type_traits>
 #include <unordered_map>
+#include <unordered_set>
 #include <utility>
 #include <variant>
 #include <vector>
 
+#if defined(_WIN32)
+#include <winsock2.h>
+#else
+#include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 namespace SimpleHttp {
 
 template <class... As> struct visitor : As... {
@@ -75,8 +108,6 @@ protected:
   struct Name##Detail {};                                                      \
   using Name = Tiny<Name##Detail, int64_t>;
 
-SIMPLE_HTTP_TINY_STRING(HttpConnectionFailure)
-SIMPLE_HTTP_TINY_STRING(HttpResponseBody)
 SIMPLE_HTTP_TINY_STRING(HttpRequestBody)
 SIMPLE_HTTP_TINY_STRING(Protcol)
 SIMPLE_HTTP_TINY_STRING(Host)
@@ -89,6 +120,192 @@ SIMPLE_HTTP_TINY_int64_t(HttpStatusCode)
 #undef SIMPLE_HTTP_TINY_STRING
 #undef SIMPLE_HTTP_TINY_int64_t
 
+// Response bodies never change once received, so copies of a result share a
+// single buffer and cost a reference count increment instead of a payload
+// copy. A body may also borrow bytes owned by something else, such as a
+// memory mapped cache segment; view() reads those in place and value() only
+// copies them the first time it is asked for a std::string.
+struct HttpResponseBody final {
+  HttpResponseBody() = default;
+  explicit HttpResponseBody(const std::string &value)
+      : value_(std::make_shared<const std::string>(value)) {}
+  explicit HttpResponseBody(std::string &&value)
+      : value_(std::make_shared<const std::string>(std::move(value))) {}
+  HttpResponseBody(std::shared_ptr<const void> owner, std::string_view bytes)
+      : borrowed_(std::make_shared<const Borrowed>(std::move(owner), bytes)) {}
+
+  friend std::ostream &operator<<(std::ostream &os,
+                                  const HttpResponseBody &object) {
+    return os << object.view();
+  }
+
+  friend bool operator==(const HttpResponseBody &lhs,
+                         const HttpResponseBody &rhs) {
+    return (lhs.value_ == rhs.value_ && lhs.borrowed_ == rhs.borrowed_) ||
+           lhs.view() == rhs.view();
+  }
+
+  friend bool operator!=(const HttpResponseBody &lhs,
+                         const HttpResponseBody &rhs) {
+    return !(lhs == rhs);
+  }
+
+  [[nodiscard]] const std::string &value() const {
+    if (borrowed_) {
+      std::call_once(borrowed_->copied,
+                     [this] { borrowed_->copy.assign(borrowed_->bytes); });
+      return borrowed_->copy;
+    }
+    return value_ ? *value_ : EMPTY;
+  }
+
+  [[nodiscard]] std::string_view view() const noexcept {
+    if (borrowed_) {
+      return borrowed_->bytes;
+    }
+    return value_ ? std::string_view(*value_) : std::string_view();
+  }
+
+  [[nodiscard]] bool borrowed() const noexcept { return borrowed_ != nullptr; }
+
+  [[nodiscard]] std::string to_string() const { return std::string(view()); }
+
+private:
+  struct Borrowed final {
+    Borrowed(std::shared_ptr<const void> owner, std::string_view bytes)
+        : owner(std::move(owner)), bytes(bytes) {}
+
+    std::shared_ptr<const void> owner;
+    std::string_view bytes;
+    mutable std::once_flag copied;
+    mutable std::string copy;
+  };
+
+  inline static const std::string EMPTY;
+
+  std::shared_ptr<const std::string> value_;
+  std::shared_ptr<const Borrowed> borrowed_;
+};
+
+enum class HttpConnectionPhase { Unknown, Setup, Resolve, Connect, Tls, Transfer };
+
+// A transfer that failed below HTTP. Besides the libcurl message it keeps the
+// CURLcode, the phase the transfer had reached, the time spent and the peer
+// address, so callers can branch on failures without comparing strings.
+// Equality and printing only consider the message.
+struct HttpConnectionFailure final {
+  HttpConnectionFailure() = default;
+  explicit HttpConnectionFailure(std::string message)
+      : message_(std::move(message)) {}
+  HttpConnectionFailure(CURLcode code, HttpConnectionPhase phase,
+                        std::chrono::microseconds elapsed = {},
+                        std::string remote_address = {})
+      : message_(curl_easy_strerror(code)), code_(code), phase_(phase),
+        elapsed_(elapsed), remote_address_(std::move(remote_address)) {}
+
+  [[nodiscard]] static HttpConnectionFailure from(CURL *curl, CURLcode code) {
+    curl_off_t connect = 0;
+    curl_off_t app_connect = 0;
+    curl_off_t total = 0;
+    char *ip = nullptr;
+    long port = 0; // NOLINT
+    char *scheme = nullptr;
+    curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME_T, &connect);
+    curl_easy_getinfo(curl, CURLINFO_APPCONNECT_TIME_T, &app_connect);
+    curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME_T, &total);
+    curl_easy_getinfo(curl, CURLINFO_PRIMARY_IP, &ip);
+    curl_easy_getinfo(curl, CURLINFO_PRIMARY_PORT, &port);
+    curl_easy_getinfo(curl, CURLINFO_SCHEME, &scheme);
+
+    std::string remote_address =
+        ip != nullptr && *ip != '\0'
+            ? std::string{ip} + ":" + std::to_string(port)
+            : std::string{};
+    std::string protocol = scheme != nullptr ? scheme : "";
+    std::transform(protocol.begin(), protocol.end(), protocol.begin(),
+                   [](unsigned char c) { return std::tolower(c); });
+    const bool tls = protocol == "https" || protocol == "wss";
+
+    HttpConnectionPhase phase;
+    switch (code) {
+    case CURLE_UNSUPPORTED_PROTOCOL:
+    case CURLE_URL_MALFORMAT:
+    case CURLE_NOT_BUILT_IN:
+    case CURLE_FAILED_INIT:
+      phase = HttpConnectionPhase::Setup;
+      break;
+    case CURLE_COULDNT_RESOLVE_PROXY:
+    case CURLE_COULDNT_RESOLVE_HOST:
+      phase = HttpConnectionPhase::Resolve;
+      break;
+    case CURLE_COULDNT_CONNECT:
+      phase = HttpConnectionPhase::Connect;
+      break;
+    case CURLE_SSL_CONNECT_ERROR:
+    case CURLE_PEER_FAILED_VERIFICATION:
+    case CURLE_SSL_CERTPROBLEM:
+    case CURLE_SSL_CIPHER:
+    case CURLE_SSL_CACERT_BADFILE:
+    case CURLE_SSL_ISSUER_ERROR:
+    case CURLE_SSL_PINNEDPUBKEYNOTMATCH:
+    case CURLE_SSL_INVALIDCERTSTATUS:
+      phase = HttpConnectionPhase::Tls;
+      break;
+    default:
+      if (connect == 0) {
+        phase = remote_address.empty() ? HttpConnectionPhase::Resolve
+                                       : HttpConnectionPhase::Connect;
+      } else if (tls && app_connect == 0) {
+        phase = HttpConnectionPhase::Tls;
+      } else {
+        phase = HttpConnectionPhase::Transfer;
+      }
+    }
+
+    return HttpConnectionFailure{code, phase, std::chrono::microseconds{total},
+                                 std::move(remote_address)};
+  }
+
+  friend std::ostream &operator<<(std::ostream &os,
+                                  const HttpConnectionFailure &failure) {
+    return os << failure.message_;
+  }
+
+  friend bool operator==(const HttpConnectionFailure &lhs,
+                         const HttpConnectionFailure &rhs) {
+    return lhs.message_ == rhs.message_;
+  }
+
+  friend bool operator!=(const HttpConnectionFailure &lhs,
+                         const HttpConnectionFailure &rhs) {
+    return !(lhs == rhs);
+  }
+
+  [[nodiscard]] const std::string &value() const noexcept { return message_; }
+
+  [[nodiscard]] std::string to_string() const { return message_; }
+
+  // CURLE_OK when the failure was constructed from a message alone.
+  [[nodiscard]] CURLcode code() const noexcept { return code_; }
+
+  [[nodiscard]] HttpConnectionPhase phase() const noexcept { return phase_; }
+
+  [[nodiscard]] std::chrono::microseconds elapsed() const noexcept {
+    return elapsed_;
+  }
+
+  [[nodiscard]] const std::string &remote_address() const noexcept {
+    return remote_address_;
+  }
+
+private:
+  std::string message_;
+  CURLcode code_ = CURLE_OK;
+  HttpConnectionPhase phase_ = HttpConnectionPhase::Unknown;
+  std::chrono::microseconds elapsed_{0};
+  std::string remote_address_;
+};
+
     using CurlSetupCallback = std::function<void(CURL *curl)>;
 inline static CurlSetupCallback NoopCurlSetupCallback = [](auto) {};
 
@@ -96,6 +313,8 @@ using CurlHeaderCallback = std::function<curl_slist *(curl_slist *chunk)>;
 inline static CurlHeaderCallback NoopCurlHeaderCallback =
     [](curl_slist *chunk) { return chunk; };
 
+using HttpChunkCallback = std::function<bool(std::string_view chunk)>;
+
 using Headers = std::unordered_map<std::string, std::string>;
 
 inline static const std::string WHITESPACE = "\n\t\f\v\r ";
@@ -125,6 +344,25 @@ inline static std::vector<std::string> vec(const std::string &candidate,
   return container;
 }
 
+inline static std::string lowercase(std::string candidate) {
+  std::transform(candidate.begin(), candidate.end(), candidate.begin(),
+                 [](unsigned char c) { return std::tolower(c); });
+  return candidate;
+}
+
+// Header names are case-insensitive, so look them up without regard to case.
+inline static std::optional<std::string>
+header_value(const std::unordered_map<std::string, std::string> &headers,
+             const std::string &name) {
+  const std::string wanted = lowercase(name);
+  for (const auto &[key, value] : headers) {
+    if (lowercase(key) == wanted) {
+      return value;
+    }
+  }
+  return std::nullopt;
+}
+
 struct QueryParameters final {
   QueryParameters() = default;
 
@@ -246,10 +484,47 @@ private:
   HttpResponse value_;
 };
 
+enum class HttpAbortReason {
+  BodyTooLarge,
+  CircuitOpen,
+  Cancelled,
+  ConcurrencyLimited,
+  RateLimited
+};
+
+// A request the client gave up on by itself, as opposed to one the network
+// or the server failed.
+struct HttpRequestAborted final {
+  HttpRequestAborted(HttpAbortReason reason, std::string message)
+      : reason_(reason), message_(std::move(message)) {}
+
+  bool operator==(const HttpRequestAborted &rhs) const {
+    return reason_ == rhs.reason_ && message_ == rhs.message_;
+  }
+
+  bool operator!=(const HttpRequestAborted &rhs) const {
+    return !(rhs == *this);
+  }
+
+  friend std::ostream &operator<<(std::ostream &os,
+                                  const HttpRequestAborted &aborted) {
+    return os << aborted.message_;
+  }
+
+  [[nodiscard]] HttpAbortReason reason() const { return reason_; }
+
+  [[nodiscard]] const std::string &value() const { return message_; }
+
+private:
+  HttpAbortReason reason_;
+  std::string message_;
+};
+
 struct HttpFailure final {
   explicit HttpFailure(HttpConnectionFailure value)
       : value_(std::move(value)) {}
   explicit HttpFailure(HttpResponse value) : value_(std::move(value)) {}
+  explicit HttpFailure(HttpRequestAborted value) : value_(std::move(value)) {}
 
   bool operator==(const HttpFailure &rhs) const { return value_ == rhs.value_; }
 
@@ -257,17 +532,18 @@ struct HttpFailure final {
 
   friend std::ostream &operator<<(std::ostream &os,
                                   const HttpFailure &failure) {
-    failure.template match<void>(
-        [&os](const HttpConnectionFailure &f) { os << f; },
-        [&os](const HttpResponse &s) { os << s; });
+    std::visit([&os](const auto &f) { os << f; }, failure.value_);
     return os;
   }
 
-  [[nodiscard]] const std::variant<HttpConnectionFailure, HttpResponse> &
+  [[nodiscard]] const std::variant<HttpConnectionFailure, HttpResponse,
+                                   HttpRequestAborted> &
   value() const {
     return value_;
   }
 
+  // Aborted requests are reported to cFn as connection failures carrying the
+  // abort message; use the three function overload to tell them apart.
   template <class A>
   A match(
       const std::function<A(const HttpConnectionFailure &connectionFailure)>
@@ -275,17 +551,112 @@ struct HttpFailure final {
       const std::function<A(const HttpResponse &semanticFailure)> &sFn) const {
     return std::visit(
         visitor{[&cFn](const HttpConnectionFailure &c) { return cFn(c); },
-                [&sFn](const HttpResponse &s) { return sFn(s); }},
+                [&sFn](const HttpResponse &s) { return sFn(s); },
+                [&cFn](const HttpRequestAborted &a) {
+                  return cFn(HttpConnectionFailure{a.value()});
+                }},
+        value_);
+  }
+
+  template <class A>
+  A match(
+      const std::function<A(const HttpConnectionFailure &connectionFailure)>
+          &cFn,
+      const std::function<A(const HttpResponse &semanticFailure)> &sFn,
+      const std::function<A(const HttpRequestAborted &aborted)> &aFn) const {
+    return std::visit(
+        visitor{[&cFn](const HttpConnectionFailure &c) { return cFn(c); },
+                [&sFn](const HttpResponse &s) { return sFn(s); },
+                [&aFn](const HttpRequestAborted &a) { return aFn(a); }},
         value_);
   }
 
+  // Deduces the result type from cFn and calls the handlers directly rather
+  // than through std::function, so they can be inlined.
+  template <class F, class G>
+  auto match(F &&cFn, G &&sFn) const
+      -> std::invoke_result_t<F, const HttpConnectionFailure &> {
+    using A = std::invoke_result_t<F, const HttpConnectionFailure &>;
+    if (const auto *s = std::get_if<HttpResponse>(&value_)) {
+      return static_cast<A>(std::forward<G>(sFn)(*s));
+    }
+    if (const auto *a = std::get_if<HttpRequestAborted>(&value_)) {
+      return std::forward<F>(cFn)(HttpConnectionFailure{a->value()});
+    }
+    return std::forward<F>(cFn)(std::get<HttpConnectionFailure>(value_));
+  }
+
+  template <class F, class G, class H>
+  auto match(F &&cFn, G &&sFn, H &&aFn) const
+      -> std::invoke_result_t<F, const HttpConnectionFailure &> {
+    using A = std::invoke_result_t<F, const HttpConnectionFailure &>;
+    if (const auto *s = std::get_if<HttpResponse>(&value_)) {
+      return static_cast<A>(std::forward<G>(sFn)(*s));
+    }
+    if (const auto *a = std::get_if<HttpRequestAborted>(&value_)) {
+      return static_cast<A>(std::forward<H>(aFn)(*a));
+    }
+    return std::forward<F>(cFn)(std::get<HttpConnectionFailure>(value_));
+  }
+
 private:
-  std::variant<HttpConnectionFailure, HttpResponse> value_;
+  std::variant<HttpConnectionFailure, HttpResponse, HttpRequestAborted> value_;
+};
+
+// Where the time of a transfer went, from libcurl's timers. Each phase is
+// measured from the start of the transfer, so it includes the ones before
+// it; redirect is the time spent following redirects before the final one.
+struct HttpTiming final {
+  std::chrono::microseconds namelookup{0};
+  std::chrono::microseconds connect{0};
+  std::chrono::microseconds appconnect{0};
+  std::chrono::microseconds pretransfer{0};
+  std::chrono::microseconds starttransfer{0};
+  std::chrono::microseconds total{0};
+  std::chrono::microseconds redirect{0};
+  uint64_t bytes_uploaded = 0;
+  uint64_t bytes_downloaded = 0;
+  // Whether the transfer reused a connection rather than opening one. False
+  // for transfers that never got as far as sending.
+  bool reused_connection = false;
+
+  [[nodiscard]] static HttpTiming from(CURL *curl) {
+    auto microseconds = [curl](CURLINFO info) {
+      curl_off_t value = 0;
+      curl_easy_getinfo(curl, info, &value);
+      return std::chrono::microseconds{value};
+    };
+    auto bytes = [curl](CURLINFO info) {
+      curl_off_t value = 0;
+      curl_easy_getinfo(curl, info, &value);
+      return static_cast<uint64_t>(value);
+    };
+    long connects = 0; // NOLINT
+    curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &connects);
+    // A transfer that failed before connecting made no connections either.
+    const std::chrono::microseconds pretransfer =
+        microseconds(CURLINFO_PRETRANSFER_TIME_T);
+
+    return HttpTiming{microseconds(CURLINFO_NAMELOOKUP_TIME_T),
+                      microseconds(CURLINFO_CONNECT_TIME_T),
+                      microseconds(CURLINFO_APPCONNECT_TIME_T),
+                      pretransfer,
+                      microseconds(CURLINFO_STARTTRANSFER_TIME_T),
+                      microseconds(CURLINFO_TOTAL_TIME_T),
+                      microseconds(CURLINFO_REDIRECT_TIME_T),
+                      bytes(CURLINFO_SIZE_UPLOAD_T),
+                      bytes(CURLINFO_SIZE_DOWNLOAD_T),
+                      connects == 0 && pretransfer.count() > 0};
+  }
 };
 
+// The timing of a result is that of the transfer which produced it. Results
+// without a transfer of their own, such as cache hits or requests the client
+// refused to send, have none. Timing takes no part in equality.
 struct HttpResult final {
-  explicit HttpResult(std::variant<HttpFailure, HttpSuccess> value)
-      : value_(std::move(value)) {}
+  explicit HttpResult(std::variant<HttpFailure, HttpSuccess> value,
+                      std::optional<HttpTiming> timing = std::nullopt)
+      : value_(std::move(value)), timing_(timing) {}
 
   bool operator==(const HttpResult &rhs) const { return value_ == rhs.value_; }
 
@@ -295,6 +666,10 @@ struct HttpResult final {
     return value_;
   }
 
+  [[nodiscard]] const std::optional<HttpTiming> &timing() const {
+    return timing_;
+  }
+
   [[nodiscard]] std::optional<HttpFailure> failure() const {
     return std::holds_alternative<HttpFailure>(value_)
                ? std::get<HttpFailure>(value_)
@@ -320,8 +695,21 @@ struct HttpResult final {
                       value_);
   }
 
+  // Deduces the result type from failureFn and calls the handlers directly
+  // rather than through std::function, so they can be inlined.
+  template <class F, class G>
+  [[nodiscard]] auto match(F &&failureFn, G &&successFn) const
+      -> std::invoke_result_t<F, const HttpFailure &> {
+    using A = std::invoke_result_t<F, const HttpFailure &>;
+    if (const auto *success = std::get_if<HttpSuccess>(&value_)) {
+      return static_cast<A>(std::forward<G>(successFn)(*success));
+    }
+    return std::forward<F>(failureFn)(std::get<HttpFailure>(value_));
+  }
+
 private:
   std::variant<HttpFailure, HttpSuccess> value_;
+  std::optional<HttpTiming> timing_;
 };
 
 struct PathSegments final {
@@ -395,6 +783,21 @@ struct HttpUrl final {
     return path_segments_;
   }
 
+  // The authority (host and optional port) of the url, without userinfo.
+  [[nodiscard]] Host host() const {
+    if (!host_.value().empty()) {
+      return host_;
+    }
+
+    size_t start = value_.find("://");
+    start = start == std::string::npos ? 0 : start + 3;
+    const size_t end = value_.find_first_of("/?#", start);
+    std::string authority = value_.substr(start, end - start);
+    const size_t at = authority.rfind('@');
+    return Host{at == std::string::npos ? authority
+                                        : authority.substr(at + 1)};
+  }
+
 private:
   Protcol protocol_;
   Host host_;
@@ -433,6 +836,93 @@ template <class A> Predicate<A> logical_or(const A &a, const A &b) {
   return [a, b](const A &other) { return other == a || other == b; };
 }
 
+// An exact set of status codes held in a 1024 bit bitmap. Membership is a
+// single bit test, sets combine with | and & at compile time, and a set can
+// be used anywhere a Predicate<HttpStatusCode> is expected.
+struct StatusCodeSet final {
+  constexpr StatusCodeSet() = default;
+  constexpr StatusCodeSet(std::initializer_list<int64_t> codes) {
+    for (int64_t code : codes) {
+      insert(code);
+    }
+  }
+  StatusCodeSet(std::initializer_list<HttpStatusCode> codes) {
+    for (const HttpStatusCode &code : codes) {
+      insert(code.value());
+    }
+  }
+
+  [[nodiscard]] static constexpr StatusCodeSet range(int64_t first,
+                                                     int64_t last) {
+    StatusCodeSet set;
+    for (int64_t code = first; code <= last; ++code) {
+      set.insert(code);
+    }
+    return set;
+  }
+
+  friend constexpr StatusCodeSet operator|(const StatusCodeSet &lhs,
+                                           const StatusCodeSet &rhs) {
+    StatusCodeSet set;
+    for (size_t i = 0; i < WORDS; ++i) {
+      set.bits_[i] = lhs.bits_[i] | rhs.bits_[i];
+    }
+    return set;
+  }
+
+  friend constexpr StatusCodeSet operator&(const StatusCodeSet &lhs,
+                                           const StatusCodeSet &rhs) {
+    StatusCodeSet set;
+    for (size_t i = 0; i < WORDS; ++i) {
+      set.bits_[i] = lhs.bits_[i] & rhs.bits_[i];
+    }
+    return set;
+  }
+
+  [[nodiscard]] constexpr bool contains(int64_t code) const {
+    return code >= 0 && code < CAPACITY &&
+           ((bits_[code >> 6] >> (code & 63)) & 1) != 0;
+  }
+
+  bool operator()(const HttpStatusCode &code) const {
+    return contains(code.value());
+  }
+
+private:
+  static constexpr int64_t CAPACITY = 1024;
+  static constexpr size_t WORDS = CAPACITY / 64;
+
+  uint64_t bits_[WORDS] = {};
+
+  constexpr void insert(int64_t code) {
+    if (code >= 0 && code < CAPACITY) {
+      bits_[code >> 6] |= uint64_t{1} << (code & 63);
+    }
+  }
+};
+
+// The status predicate taken by Client. A StatusCodeSet is stored inline and
+// checked with a bit test; anything else callable is kept in a Predicate.
+struct StatusPredicate final {
+  StatusPredicate(const StatusCodeSet &codes) : value_(codes) {} // NOLINT
+  template <class F,
+            class = std::enable_if_t<
+                !std::is_same_v<std::decay_t<F>, StatusPredicate> &&
+                !std::is_same_v<std::decay_t<F>, StatusCodeSet>>>
+  StatusPredicate(F &&predicate) // NOLINT
+      : value_(Predicate<HttpStatusCode>{std::forward<F>(predicate)}) {}
+
+  bool operator()(const HttpStatusCode &code) const {
+    if (const auto *codes = std::get_if<StatusCodeSet>(&value_)) {
+      return (*codes)(code);
+    }
+    return std::get<Predicate<HttpStatusCode>>(value_)(code);
+  }
+
+private:
+  std::variant<StatusCodeSet, Predicate<HttpStatusCode>> value_;
+};
+
 // Unknown
 inline static HttpStatusCode UNKNOWN = HttpStatusCode{0};
 
@@ -511,220 +1001,5048 @@ inline static HttpStatusCode NOT_EXTENDED = HttpStatusCode{510};
 inline static HttpStatusCode NETWORK_AUTHENTICATION_REQUIRED =
     HttpStatusCode{511};
 
-inline static Predicate<HttpStatusCode> informational() {
-  return between_inclusive(CONTINUE, EARLY_HINTS);
+// Each class matches exactly the codes listed above.
+inline static constexpr StatusCodeSet informational() {
+  return StatusCodeSet::range(100, 103);
 }
 
-inline static Predicate<HttpStatusCode> successful() {
-  return between_inclusive(OK, IM_USED);
+inline static constexpr StatusCodeSet successful() {
+  return StatusCodeSet::range(200, 208) | StatusCodeSet{226};
 }
 
-inline static Predicate<HttpStatusCode> redirect() {
-  return between_inclusive(MULTIPLE_CHOICE, PERMANENT_REDIRECT);
+inline static constexpr StatusCodeSet redirect() {
+  return StatusCodeSet::range(300, 305) | StatusCodeSet{307, 308};
 }
 
-inline static Predicate<HttpStatusCode> client_error() {
-  return between_inclusive(BAD_REQUEST, UNAVAILABLE_FOR_LEGAL_REASONS);
+inline static constexpr StatusCodeSet client_error() {
+  return StatusCodeSet::range(400, 418) |
+         StatusCodeSet{422, 424, 425, 426, 428, 429, 431, 451};
 }
 
-inline static Predicate<HttpStatusCode> server_error() {
-  return between_inclusive(INTERNAL_SERVER_ERROR,
-                           NETWORK_AUTHENTICATION_REQUIRED);
+inline static constexpr StatusCodeSet server_error() {
+  return StatusCodeSet::range(500, 508) | StatusCodeSet{510, 511};
 }
 
-struct Client final {
-  Client() : debug_(false), verify_(true) {}
+// Returning false stops the stream.
+using LineCallback = std::function<bool(std::string_view line)>;
+
+// Splits a chunked byte stream into lines. Complete lines inside a chunk are
+// handed out as views into the chunk itself; only a line straddling a chunk
+// boundary is copied into the carry buffer, whose capacity is reused.
+struct LineSplitter final {
+  [[nodiscard]] bool feed(std::string_view chunk,
+                          const LineCallback &callback) {
+    const char *begin = chunk.data();
+    const char *end = begin + chunk.size();
+    while (begin != end) {
+      const auto *newline = static_cast<const char *>(
+          std::memchr(begin, '\n', static_cast<size_t>(end - begin)));
+      if (newline == nullptr) {
+        partial_.append(begin, static_cast<size_t>(end - begin));
+        break;
+      }
 
-  Client &with_tls_verification(bool verify) {
-    verify_ = verify;
-    return *this;
-  }
+      std::string_view line{begin, static_cast<size_t>(newline - begin)};
+      if (!partial_.empty()) {
+        partial_.append(line);
+        line = partial_;
+      }
 
-  Client &with_debug(bool debug) {
-    debug_ = debug;
-    return *this;
-  }
+      const bool keep_going = emit(line, callback);
+      partial_.clear();
+      begin = newline + 1;
+      if (!keep_going) {
+        return false;
+      }
+    }
 
-  [[nodiscard]] HttpResult get(const HttpUrl &url,
-                               const Headers &headers = {}) const {
-    return get(url, eq(OK), headers);
+    return true;
   }
 
-  [[nodiscard]] HttpResult
-  get(const HttpUrl &url, const Predicate<HttpStatusCode> &successPredicate,
-      const Headers &headers = {}) const {
-    return execute(url, make_header_callback(headers), NoopCurlSetupCallback,
-                   successPredicate);
-  }
+  // Flushes a final line that was not terminated by a newline.
+  [[nodiscard]] bool finish(const LineCallback &callback) {
+    if (partial_.empty()) {
+      return true;
+    }
 
-  [[nodiscard]] HttpResult post(const HttpUrl &url, const HttpRequestBody &body,
-                                const Headers &headers = {}) const {
-    return post(url, body, eq(OK), headers);
+    const bool keep_going = emit(partial_, callback);
+    partial_.clear();
+    return keep_going;
   }
 
-  [[nodiscard]] HttpResult
-  post(const HttpUrl &url, const HttpRequestBody &body,
-       const Predicate<HttpStatusCode> &successPredicate,
-       const Headers &headers = {}) const {
-    CurlSetupCallback setup = [&](CURL *curl) {
-      curl_easy_setopt(curl, CURLOPT_POSTFIELDS, body.value().c_str());
-    };
+private:
+  std::string partial_;
 
-    return execute(url, make_header_callback(headers), setup, successPredicate);
-  }
+  static bool emit(std::string_view line, const LineCallback &callback) {
+    if (!line.empty() && line.back() == '\r') {
+      line.remove_suffix(1);
+    }
 
-  [[nodiscard]] HttpResult put(const HttpUrl &url, const HttpRequestBody &body,
-                               const Headers &headers = {}) const {
-    return put(url, body, eq(OK), headers);
+    return callback(line);
   }
+};
 
-  [[nodiscard]] HttpResult
-  put(const HttpUrl &url, const HttpRequestBody &body,
-      const Predicate<HttpStatusCode> &successPredicate,
-      const Headers &headers = {}) const {
-    CurlSetupCallback setup = [&](CURL *curl) {
-      curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, "PUT");
-      curl_easy_setopt(curl, CURLOPT_POSTFIELDS, body.value().c_str());
-    };
+// Push-based JSON parser that emits SAX events as bytes arrive, so a
+// document can be consumed straight from Client::stream without buffering
+// the body. Handler follows the nlohmann::json SAX interface (null, boolean,
+// number_integer, number_unsigned, number_float, string, start_object, key,
+// end_object, start_array, end_array), and returning false from any of them
+// stops parsing. Syntax errors are reported through error() rather than
+// parse_error.
+template <class Handler> struct JsonSaxParser final {
+  explicit JsonSaxParser(Handler &handler) : handler_(handler) {}
+
+  [[nodiscard]] bool feed(std::string_view chunk) {
+    const char *data = chunk.data();
+    const size_t size = chunk.size();
+    for (size_t i = 0; i < size; ++i) {
+      if (state_ == State::String && high_surrogate_ == 0) {
+        const size_t start = i;
+        while (i < size && is_plain(data[i])) {
+          ++i;
+        }
+        token_.append(data + start, i - start);
+        position_ += i - start;
+        if (i == size) {
+          break;
+        }
+      }
 
-    return execute(url, make_header_callback(headers), setup, successPredicate);
-  }
+      if (!consume(data[i])) {
+        return false;
+      }
+      ++position_;
+    }
 
-  [[nodiscard]] HttpResult del(const HttpUrl &url,
-                               const Headers &headers = {}) const {
-    return del(url, eq(OK), headers);
+    return state_ != State::Failed && state_ != State::Stopped;
   }
 
-  [[nodiscard]] HttpResult
-  del(const HttpUrl &url, const Predicate<HttpStatusCode> &successPredicate,
-      const Headers &headers = {}) const {
-    CurlSetupCallback setup = [&](CURL *curl) {
-      curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, "DELETE");
-    };
+  // Signals the end of input. Returns true when exactly one complete
+  // document was parsed.
+  [[nodiscard]] bool finish() {
+    if (state_ == State::Number) {
+      finish_number();
+    }
 
-    return execute(url, make_header_callback(headers), setup, successPredicate);
-  }
+    if (state_ != State::Done && state_ != State::Failed &&
+        state_ != State::Stopped) {
+      fail("unexpected end of input");
+    }
 
-  [[nodiscard]] HttpResult head(const HttpUrl &url) const {
-    CurlSetupCallback setup = [&](CURL *curl) {
-      curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
-    };
+    return state_ == State::Done;
+  }
 
-    return execute(url, NoopCurlHeaderCallback, setup, eq(OK));
+  [[nodiscard]] const std::optional<std::string> &error() const {
+    return error_;
   }
 
-  [[nodiscard]] HttpResult options(const HttpUrl &url) const {
-    CurlSetupCallback setup = [&](CURL *curl) {
-      curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, "OPTIONS");
-    };
+private:
+  enum class State {
+    Value,
+    FirstValueOrEnd,
+    FirstKeyOrEnd,
+    Key,
+    Colon,
+    Separator,
+    Done,
+    String,
+    Escape,
+    Unicode,
+    Number,
+    Literal,
+    Failed,
+    Stopped
+  };
 
-    return execute(url, NoopCurlHeaderCallback, setup, eq(OK));
+  inline static const std::size_t UNKNOWN_SIZE = static_cast<std::size_t>(-1);
+
+  Handler &handler_;
+  State state_ = State::Value;
+  std::vector<char> containers_;
+  std::string token_;
+  bool string_is_key_ = false;
+  std::string_view literal_;
+  size_t literal_index_ = 0;
+  uint32_t unicode_ = 0;
+  int unicode_digits_ = 0;
+  uint32_t high_surrogate_ = 0;
+  size_t position_ = 0;
+  std::optional<std::string> error_;
+
+  static bool is_whitespace(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
   }
 
-  [[nodiscard]] HttpResult trace(const HttpUrl &url) const {
-    CurlSetupCallback setup = [&](CURL *curl) {
-      curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, "TRACE");
-    };
+  static bool is_digit(char c) { return c >= '0' && c <= '9'; }
 
-    return execute(url, NoopCurlHeaderCallback, setup, eq(OK));
+  static bool is_plain(char c) {
+    return c != '"' && c != '\\' && static_cast<unsigned char>(c) >= 0x20;
   }
 
-  [[nodiscard]] HttpResult
-  execute(const HttpUrl &url, const CurlHeaderCallback &curl_header_callback,
-          const CurlSetupCallback &curl_setup_callback,
-          const Predicate<HttpStatusCode> &successPredicate) const {
-    CurlWrapper curlWrapper{successPredicate};
+  static bool is_number_char(char c) {
+    return is_digit(c) || c == '-' || c == '+' || c == '.' || c == 'e' ||
+           c == 'E';
+  }
 
-    curlWrapper.execute_header_callback(curl_header_callback);
-    curlWrapper.add_option(CURLOPT_URL, url.value().c_str());
-    curlWrapper.add_option(CURLOPT_VERBOSE, debug_ ? 1L : 0L);
+  bool fail(const std::string &reason) {
+    state_ = State::Failed;
+    error_ = "syntax error at byte " + std::to_string(position_) + ": " +
+             reason;
+    return false;
+  }
 
-    if (url.protocol().value() == "https") {
-      verify_ ? curlWrapper.add_option(CURLOPT_SSL_VERIFYPEER, 1L)
-              : curlWrapper.add_option(CURLOPT_SSL_VERIFYPEER, 0L);
+  bool emit(bool keep_going) {
+    if (!keep_going) {
+      state_ = State::Stopped;
     }
-
-    curlWrapper.execute_setup_callback(curl_setup_callback);
-
-    return curlWrapper.execute();
+    return keep_going;
   }
 
-private:
-  bool debug_;
-  bool verify_;
+  bool value_completed(bool keep_going) {
+    if (emit(keep_going)) {
+      state_ = containers_.empty() ? State::Done : State::Separator;
+    }
+    return keep_going;
+  }
 
-  static size_t write_callback(void *contents, size_t size, size_t nmemb,
-                               void *userp) {
-    ((std::string *)userp)->append((char *)contents, size * nmemb); // NOLINT
-    return size * nmemb;
+  bool close_container(char container) {
+    containers_.pop_back();
+    return value_completed(container == '{' ? handler_.end_object()
+                                            : handler_.end_array());
   }
 
-  static CurlHeaderCallback make_header_callback(const Headers &headers) {
-    return headers.empty()
-               ? NoopCurlHeaderCallback
-               : [&headers](curl_slist *chunk) {
-                   for (const auto &[key, value] : headers) {
-                     chunk =
-                         curl_slist_append(chunk, (key + ": " + value).c_str());
-                   }
+  bool begin_value(char c) {
+    switch (c) {
+    case '{':
+      containers_.push_back('{');
+      state_ = State::FirstKeyOrEnd;
+      return emit(handler_.start_object(UNKNOWN_SIZE));
+    case '[':
+      containers_.push_back('[');
+      state_ = State::FirstValueOrEnd;
+      return emit(handler_.start_array(UNKNOWN_SIZE));
+    case '"':
+      string_is_key_ = false;
+      state_ = State::String;
+      return true;
+    case 't':
+      return begin_literal("true");
+    case 'f':
+      return begin_literal("false");
+    case 'n':
+      return begin_literal("null");
+    default:
+      if (c == '-' || is_digit(c)) {
+        token_.assign(1, c);
+        state_ = State::Number;
+        return true;
+      }
+      return fail(std::string{"unexpected character '"} + c + "'");
+    }
+  }
 
-                   return chunk;
-                 };
+  bool begin_literal(std::string_view literal) {
+    literal_ = literal;
+    literal_index_ = 1;
+    state_ = State::Literal;
+    return true;
   }
 
-  struct CurlWrapper final {
-    explicit CurlWrapper(const Predicate<HttpStatusCode> &success_predicate)
-        : curl_(curl_easy_init()), slist_(nullptr),
-          success_predicate_(success_predicate) {}
+  bool finish_literal() {
+    if (literal_ == "true") {
+      return value_completed(handler_.boolean(true));
+    }
+    if (literal_ == "false") {
+      return value_completed(handler_.boolean(false));
+    }
+    return value_completed(handler_.null());
+  }
 
-    ~CurlWrapper() {
-      curl_easy_cleanup(curl_);
-      curl_slist_free_all(slist_);
+  bool finish_string() {
+    if (high_surrogate_ != 0) {
+      return fail("unpaired surrogate");
     }
 
-    template <class A> void add_option(const CURLoption option, A value) {
-      curl_easy_setopt(curl_, option, value);
+    bool keep_going;
+    if (string_is_key_) {
+      keep_going = emit(handler_.key(token_));
+      if (keep_going) {
+        state_ = State::Colon;
+      }
+    } else {
+      keep_going = value_completed(handler_.string(token_));
     }
+    token_.clear();
+    return keep_going;
+  }
 
-    void execute_header_callback(const CurlHeaderCallback &header_callback) {
-      slist_ = header_callback(slist_);
+  bool finish_number() {
+    if (!valid_number(token_)) {
+      return fail("invalid number '" + token_ + "'");
     }
 
-    void execute_setup_callback(const CurlSetupCallback &setup_callback) {
-      setup_callback(curl_);
+    const bool integral = token_.find_first_of(".eE") == std::string::npos;
+    bool keep_going;
+    errno = 0;
+    if (integral && token_.front() == '-') {
+      const int64_t value = std::strtoll(token_.c_str(), nullptr, 10);
+      keep_going = errno == ERANGE ? handler_.number_float(
+                                         std::strtod(token_.c_str(), nullptr),
+                                         token_)
+                                   : handler_.number_integer(value);
+    } else if (integral) {
+      const uint64_t value = std::strtoull(token_.c_str(), nullptr, 10);
+      keep_going = errno == ERANGE ? handler_.number_float(
+                                         std::strtod(token_.c_str(), nullptr),
+                                         token_)
+                                   : handler_.number_unsigned(value);
+    } else {
+      keep_going =
+          handler_.number_float(std::strtod(token_.c_str(), nullptr), token_);
     }
+    token_.clear();
+    return value_completed(keep_going);
+  }
 
-    [[nodiscard]] HttpResult execute() {
-      std::string body_buffer;
+  static bool valid_number(const std::string &number) {
+    size_t i = 0;
+    const size_t size = number.size();
+    const auto digits = [&]() {
+      const size_t start = i;
+      while (i < size && is_digit(number[i])) {
+        ++i;
+      }
+      return i > start;
+    };
+
+    if (i < size && number[i] == '-') {
+      ++i;
+    }
+    if (i < size && number[i] == '0') {
+      ++i;
+    } else if (!digits()) {
+      return false;
+    }
+    if (i < size && number[i] == '.') {
+      ++i;
+      if (!digits()) {
+        return false;
+      }
+    }
+    if (i < size && (number[i] == 'e' || number[i] == 'E')) {
+      ++i;
+      if (i < size && (number[i] == '+' || number[i] == '-')) {
+        ++i;
+      }
+      if (!digits()) {
+        return false;
+      }
+    }
+    return i == size;
+  }
+
+  static void append_utf8(std::string &out, uint32_t code_point) {
+    if (code_point < 0x80) {
+      out.push_back(static_cast<char>(code_point));
+    } else if (code_point < 0x800) {
+      out.push_back(static_cast<char>(0xC0 | (code_point >> 6)));
+      out.push_back(static_cast<char>(0x80 | (code_point & 0x3F)));
+    } else if (code_point < 0x10000) {
+      out.push_back(static_cast<char>(0xE0 | (code_point >> 12)));
+      out.push_back(static_cast<char>(0x80 | ((code_point >> 6) & 0x3F)));
+      out.push_back(static_cast<char>(0x80 | (code_point & 0x3F)));
+    } else {
+      out.push_back(static_cast<char>(0xF0 | (code_point >> 18)));
+      out.push_back(static_cast<char>(0x80 | ((code_point >> 12) & 0x3F)));
+      out.push_back(static_cast<char>(0x80 | ((code_point >> 6) & 0x3F)));
+      out.push_back(static_cast<char>(0x80 | (code_point & 0x3F)));
+    }
+  }
+
+  bool finish_unicode() {
+    state_ = State::String;
+    const uint32_t code_point = unicode_;
+    if (high_surrogate_ != 0) {
+      if (code_point < 0xDC00 || code_point > 0xDFFF) {
+        return fail("unpaired surrogate");
+      }
+      append_utf8(token_, 0x10000 + ((high_surrogate_ - 0xD800) << 10) +
+                              (code_point - 0xDC00));
+      high_surrogate_ = 0;
+    } else if (code_point >= 0xD800 && code_point <= 0xDBFF) {
+      high_surrogate_ = code_point;
+    } else if (code_point >= 0xDC00 && code_point <= 0xDFFF) {
+      return fail("unpaired surrogate");
+    } else {
+      append_utf8(token_, code_point);
+    }
+    return true;
+  }
+
+  bool consume(char c) {
+    switch (state_) {
+    case State::Value:
+      return is_whitespace(c) || begin_value(c);
+    case State::FirstValueOrEnd:
+      if (is_whitespace(c)) {
+        return true;
+      }
+      return c == ']' ? close_container('[') : begin_value(c);
+    case State::FirstKeyOrEnd:
+    case State::Key:
+      if (is_whitespace(c)) {
+        return true;
+      }
+      if (c == '}' && state_ == State::FirstKeyOrEnd) {
+        return close_container('{');
+      }
+      if (c != '"') {
+        return fail("expected object key");
+      }
+      string_is_key_ = true;
+      state_ = State::String;
+      return true;
+    case State::Colon:
+      if (is_whitespace(c)) {
+        return true;
+      }
+      if (c != ':') {
+        return fail("expected ':'");
+      }
+      state_ = State::Value;
+      return true;
+    case State::Separator:
+      if (is_whitespace(c)) {
+        return true;
+      }
+      if (c == ',') {
+        state_ = containers_.back() == '{' ? State::Key : State::Value;
+        return true;
+      }
+      if ((c == '}' && containers_.back() == '{') ||
+          (c == ']' && containers_.back() == '[')) {
+        return close_container(containers_.back());
+      }
+      return fail("expected ',' or end of container");
+    case State::Done:
+      return is_whitespace(c) || fail("unexpected trailing character");
+    case State::String:
+      if (high_surrogate_ != 0 && c != '\\') {
+        return fail("unpaired surrogate");
+      }
+      if (c == '"') {
+        return finish_string();
+      }
+      if (c == '\\') {
+        state_ = State::Escape;
+        return true;
+      }
+      if (!is_plain(c)) {
+        return fail("control character in string");
+      }
+      token_.push_back(c);
+      return true;
+    case State::Escape:
+      if (high_surrogate_ != 0 && c != 'u') {
+        return fail("unpaired surrogate");
+      }
+      state_ = State::String;
+      switch (c) {
+      case '"':
+      case '\\':
+      case '/':
+        token_.push_back(c);
+        return true;
+      case 'b':
+        token_.push_back('\b');
+        return true;
+      case 'f':
+        token_.push_back('\f');
+        return true;
+      case 'n':
+        token_.push_back('\n');
+        return true;
+      case 'r':
+        token_.push_back('\r');
+        return true;
+      case 't':
+        token_.push_back('\t');
+        return true;
+      case 'u':
+        unicode_ = 0;
+        unicode_digits_ = 0;
+        state_ = State::Unicode;
+        return true;
+      default:
+        return fail("invalid escape");
+      }
+    case State::Unicode: {
+      uint32_t digit;
+      if (is_digit(c)) {
+        digit = static_cast<uint32_t>(c - '0');
+      } else if (c >= 'a' && c <= 'f') {
+        digit = static_cast<uint32_t>(c - 'a' + 10);
+      } else if (c >= 'A' && c <= 'F') {
+        digit = static_cast<uint32_t>(c - 'A' + 10);
+      } else {
+        return fail("invalid unicode escape");
+      }
+      unicode_ = (unicode_ << 4) | digit;
+      return ++unicode_digits_ < 4 || finish_unicode();
+    }
+    case State::Number:
+      if (is_number_char(c)) {
+        token_.push_back(c);
+        return true;
+      }
+      return finish_number() && consume(c);
+    case State::Literal:
+      if (c != literal_[literal_index_]) {
+        return fail("invalid literal");
+      }
+      return ++literal_index_ < literal_.size() || finish_literal();
+    case State::Failed:
+    case State::Stopped:
+      return false;
+    }
+    return false;
+  }
+};
+
+struct ServerSentEvent final {
+  std::string_view type;
+  std::string_view data;
+  std::string_view id;
+};
+
+// Views handed to the callback are only valid for the duration of the call.
+// Returning false stops the stream.
+using ServerSentEventCallback = std::function<bool(const ServerSentEvent &)>;
+
+// Incremental text/event-stream parser. Lines are assembled across chunk
+// boundaries in a reusable buffer, so memory stays bounded by the largest
+// single event rather than the length of the stream.
+struct ServerSentEventParser final {
+  [[nodiscard]] bool feed(std::string_view chunk,
+                          const ServerSentEventCallback &callback) {
+    size_t start = 0;
+    for (size_t i = 0; i < chunk.size(); ++i) {
+      const char c = chunk[i];
+      if (skip_line_feed_) {
+        skip_line_feed_ = false;
+        if (c == '\n') {
+          start = i + 1;
+          continue;
+        }
+      }
+
+      if (c != '\n' && c != '\r') {
+        continue;
+      }
+
+      skip_line_feed_ = c == '\r';
+      std::string_view line = chunk.substr(start, i - start);
+      if (!line_.empty()) {
+        line_.append(line);
+        line = line_;
+      }
+
+      const bool keep_going = process_line(line, callback);
+      line_.clear();
+      start = i + 1;
+      if (!keep_going) {
+        return false;
+      }
+    }
+
+    line_.append(chunk.substr(start));
+    return true;
+  }
+
+  [[nodiscard]] const std::string &last_event_id() const {
+    return last_event_id_;
+  }
+
+  [[nodiscard]] const std::optional<std::chrono::milliseconds> &
+  retry() const {
+    return retry_;
+  }
+
+  void reset() {
+    line_.clear();
+    data_.clear();
+    type_.clear();
+    skip_line_feed_ = false;
+  }
+
+private:
+  std::string line_;
+  std::string data_;
+  std::string type_;
+  std::string last_event_id_;
+  std::optional<std::chrono::milliseconds> retry_;
+  bool skip_line_feed_ = false;
+
+  bool process_line(std::string_view line,
+                    const ServerSentEventCallback &callback) {
+    if (line.empty()) {
+      return dispatch(callback);
+    }
+
+    if (line.front() == ':') {
+      return true;
+    }
+
+    std::string_view field = line;
+    std::string_view value;
+    size_t colon = line.find(':');
+    if (colon != std::string_view::npos) {
+      field = line.substr(0, colon);
+      value = line.substr(colon + 1);
+      if (!value.empty() && value.front() == ' ') {
+        value.remove_prefix(1);
+      }
+    }
+
+    if (field == "event") {
+      type_.assign(value);
+    } else if (field == "data") {
+      data_.append(value);
+      data_.push_back('\n');
+    } else if (field == "id") {
+      if (value.find('\0') == std::string_view::npos) {
+        last_event_id_.assign(value);
+      }
+    } else if (field == "retry") {
+      // Values that overflow are ignored like any other invalid one; this
+      // runs inside the write callback, where nothing may throw.
+      int64_t milliseconds = 0;
+      const char *end = value.data() + value.size();
+      if (!value.empty() &&
+          std::all_of(value.begin(), value.end(),
+                      [](char c) { return c >= '0' && c <= '9'; }) &&
+          std::from_chars(value.data(), end, milliseconds).ec == std::errc{}) {
+        retry_ = std::chrono::milliseconds{milliseconds};
+      }
+    }
+
+    return true;
+  }
+
+  bool dispatch(const ServerSentEventCallback &callback) {
+    if (data_.empty()) {
+      type_.clear();
+      return true;
+    }
+
+    std::string_view data = data_;
+    data.remove_suffix(1);
+    ServerSentEvent event{type_.empty() ? std::string_view{"message"}
+                                        : std::string_view{type_},
+                          data, last_event_id_};
+    const bool keep_going = callback(event);
+    data_.clear();
+    type_.clear();
+    return keep_going;
+  }
+};
+
+#if defined(CURLWS_TEXT)
+struct WebSocketFrame final {
+  size_t length;
+  uint64_t bytes_left;
+  int flags;
+
+  [[nodiscard]] bool text() const { return (flags & CURLWS_TEXT) != 0; }
+  [[nodiscard]] bool binary() const { return (flags & CURLWS_BINARY) != 0; }
+  [[nodiscard]] bool continuation() const {
+    return (flags & CURLWS_CONT) != 0;
+  }
+  [[nodiscard]] bool close() const { return (flags & CURLWS_CLOSE) != 0; }
+  [[nodiscard]] bool ping() const { return (flags & CURLWS_PING) != 0; }
+  [[nodiscard]] bool pong() const { return (flags & CURLWS_PONG) != 0; }
+};
+
+// An established WebSocket connection, created by Client::websocket. Frames
+// are received into caller provided buffers; a frame larger than the buffer
+// is delivered over several receive calls, with bytes_left counting down.
+// Incoming pings are answered by libcurl; older releases also report them to
+// the caller.
+// socket() exposes the underlying descriptor for use in an external event
+// loop.
+struct WebSocket final {
+  explicit WebSocket(CURL *curl) : curl_(curl) {}
+  WebSocket(const WebSocket &) = delete;
+  WebSocket(WebSocket &&other) noexcept
+      : curl_(std::exchange(other.curl_, nullptr)) {}
+  WebSocket &operator=(const WebSocket &) = delete;
+  WebSocket &operator=(WebSocket &&other) noexcept {
+    std::swap(curl_, other.curl_);
+    return *this;
+  }
+
+  ~WebSocket() { curl_easy_cleanup(curl_); }
+
+  [[nodiscard]] std::optional<HttpConnectionFailure>
+  send_text(std::string_view payload) {
+    return send(payload, CURLWS_TEXT);
+  }
+
+  [[nodiscard]] std::optional<HttpConnectionFailure>
+  send_binary(std::string_view payload) {
+    return send(payload, CURLWS_BINARY);
+  }
+
+  [[nodiscard]] std::optional<HttpConnectionFailure>
+  ping(std::string_view payload = {}) {
+    return send(payload, CURLWS_PING);
+  }
+
+  [[nodiscard]] std::optional<HttpConnectionFailure>
+  close(std::string_view payload = {}) {
+    return send(payload, CURLWS_CLOSE);
+  }
+
+  [[nodiscard]] std::optional<HttpConnectionFailure>
+  send(std::string_view payload, unsigned int flags) {
+    size_t offset = 0;
+    do {
+      size_t sent = 0;
+      CURLcode res = curl_ws_send(curl_, payload.data() + offset,
+                                  payload.size() - offset, &sent, 0, flags);
+      if (res == CURLE_AGAIN) {
+        if (!wait(POLLOUT, DEFAULT_TIMEOUT)) {
+          return HttpConnectionFailure{CURLE_OPERATION_TIMEDOUT,
+                                       HttpConnectionPhase::Transfer};
+        }
+        continue;
+      }
+      if (res != CURLE_OK) {
+        return HttpConnectionFailure{res, HttpConnectionPhase::Transfer};
+      }
+      offset += sent;
+    } while (offset < payload.size());
+
+    return std::nullopt;
+  }
+
+  [[nodiscard]] std::variant<HttpConnectionFailure, WebSocketFrame>
+  receive(char *buffer, size_t capacity,
+          std::chrono::milliseconds timeout = DEFAULT_TIMEOUT) {
+    const auto deadline = std::chrono::steady_clock::now() + timeout;
+    while (true) {
+      size_t received = 0;
+      const curl_ws_frame *meta = nullptr;
+      CURLcode res =
+          receive_frame(curl_ws_recv, buffer, capacity, &received, &meta);
+      if (res == CURLE_OK) {
+        return WebSocketFrame{received,
+                              static_cast<uint64_t>(meta->bytesleft),
+                              meta->flags};
+      }
+      if (res != CURLE_AGAIN) {
+        return HttpConnectionFailure{res, HttpConnectionPhase::Transfer};
+      }
+
+      const auto remaining =
+          std::chrono::duration_cast<std::chrono::milliseconds>(
+              deadline - std::chrono::steady_clock::now());
+      if (remaining.count() <= 0 || !wait(POLLIN, remaining)) {
+        return HttpConnectionFailure{CURLE_OPERATION_TIMEDOUT,
+                                     HttpConnectionPhase::Transfer};
+      }
+    }
+  }
+
+  [[nodiscard]] curl_socket_t socket() const {
+    curl_socket_t socket = CURL_SOCKET_BAD;
+    curl_easy_getinfo(curl_, CURLINFO_ACTIVESOCKET, &socket);
+    return socket;
+  }
+
+private:
+  inline static const std::chrono::milliseconds DEFAULT_TIMEOUT{30000};
+
+  CURL *curl_;
+
+  // curl_ws_recv gained a const frame pointer in later libcurl releases.
+  template <class Frame>
+  CURLcode receive_frame(CURLcode (*recv)(CURL *, void *, size_t, size_t *,
+                                          Frame **),
+                         char *buffer, size_t capacity, size_t *received,
+                         const curl_ws_frame **meta) const {
+    Frame *frame = nullptr;
+    CURLcode res = recv(curl_, buffer, capacity, received, &frame);
+    *meta = frame;
+    return res;
+  }
+
+  [[nodiscard]] bool wait(short events,
+                          std::chrono::milliseconds timeout) const {
+    pollfd descriptor{};
+    descriptor.fd = socket();
+    descriptor.events = events;
+#if defined(_WIN32)
+    return WSAPoll(&descriptor, 1, static_cast<int>(timeout.count())) > 0;
+#else
+    return ::poll(&descriptor, 1, static_cast<int>(timeout.count())) > 0;
+#endif
+  }
+};
+#endif
+
+// The Cache-Control directives the client cache acts on.
+struct CacheControl final {
+  bool no_store = false;
+  bool no_cache = false;
+  std::optional<std::chrono::seconds> max_age;
+  std::optional<std::chrono::seconds> stale_while_revalidate;
+  std::optional<std::chrono::seconds> stale_if_error;
+
+  [[nodiscard]] static CacheControl parse(const std::string &value) {
+    CacheControl directives;
+    for (const std::string &directive : vec(value, ',')) {
+      size_t equals = directive.find('=');
+      std::string name = lowercase(trim(directive.substr(0, equals)));
+      std::string argument =
+          equals == std::string::npos ? "" : trim(directive.substr(equals + 1));
+      if (argument.size() >= 2 && argument.front() == '"' &&
+          argument.back() == '"') {
+        argument = argument.substr(1, argument.size() - 2);
+      }
+
+      if (name == "no-store") {
+        directives.no_store = true;
+      } else if (name == "no-cache") {
+        directives.no_cache = true;
+      } else if (name == "max-age") {
+        directives.max_age = parse_seconds(argument);
+      } else if (name == "stale-while-revalidate") {
+        directives.stale_while_revalidate = parse_seconds(argument);
+      } else if (name == "stale-if-error") {
+        directives.stale_if_error = parse_seconds(argument);
+      }
+    }
+    return directives;
+  }
+
+private:
+  static std::optional<std::chrono::seconds>
+  parse_seconds(const std::string &argument) {
+    if (argument.empty() ||
+        !std::all_of(argument.begin(), argument.end(),
+                     [](char c) { return c >= '0' && c <= '9'; })) {
+      return std::nullopt;
+    }
+    return std::chrono::seconds{std::stoll(argument.substr(0, 18))};
+  }
+};
+
+// A stored response together with what is needed to compute its freshness
+// (RFC 9111 section 4.2) and how long it may be served stale (RFC 5861).
+// Entries whose vary list is non-empty are markers
+// recording which request headers select the variant stored under its own
+// key.
+struct CacheEntry final {
+  HttpResponse response;
+  std::chrono::system_clock::time_point response_time;
+  std::chrono::seconds freshness_lifetime{0};
+  std::chrono::seconds initial_age{0};
+  std::vector<std::string> vary;
+  std::chrono::seconds stale_while_revalidate{0};
+  std::chrono::seconds stale_if_error{0};
+
+  [[nodiscard]] std::chrono::seconds
+  age(std::chrono::system_clock::time_point now) const {
+    return initial_age + std::chrono::duration_cast<std::chrono::seconds>(
+                             std::max(now - response_time,
+                                      std::chrono::system_clock::duration{0}));
+  }
+
+  [[nodiscard]] bool fresh(std::chrono::system_clock::time_point now) const {
+    return age(now) < freshness_lifetime;
+  }
+
+  // Whether the entry is at most `window` past its freshness lifetime.
+  [[nodiscard]] bool usable_stale(std::chrono::system_clock::time_point now,
+                                  std::chrono::seconds window) const {
+    return age(now) < freshness_lifetime + window;
+  }
+
+  [[nodiscard]] size_t size() const {
+    size_t bytes = response.body.view().size();
+    for (const auto &[name, value] : response.headers.value()) {
+      bytes += name.size() + value.size();
+    }
+    return bytes;
+  }
+};
+
+// Storage behind HttpCache. Implementations must be safe to call from
+// several threads at once.
+struct CacheStore {
+  virtual ~CacheStore() = default;
+
+  [[nodiscard]] virtual std::optional<CacheEntry>
+  lookup(const std::string &key) = 0;
+
+  virtual void store(const std::string &key, const CacheEntry &entry) = 0;
+
+  virtual void remove(const std::string &key) = 0;
+};
+
+// A size bounded LRU split into independently locked shards so concurrent
+// lookups of different keys rarely contend.
+struct MemoryCache final : CacheStore {
+  explicit MemoryCache(size_t capacity_bytes, size_t shard_count = 16)
+      : shard_capacity_(capacity_bytes / std::max<size_t>(shard_count, 1)) {
+    for (size_t i = 0; i < std::max<size_t>(shard_count, 1); ++i) {
+      shards_.push_back(std::make_unique<Shard>());
+    }
+  }
+
+  [[nodiscard]] std::optional<CacheEntry>
+  lookup(const std::string &key) override {
+    Shard &shard = shard_for(key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto found = shard.index.find(key);
+    if (found == shard.index.end()) {
+      return std::nullopt;
+    }
+
+    shard.entries.splice(shard.entries.begin(), shard.entries, found->second);
+    return found->second->entry;
+  }
+
+  void store(const std::string &key, const CacheEntry &entry) override {
+    Shard &shard = shard_for(key);
+    const size_t bytes = key.size() + entry.size();
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    erase(shard, key);
+    if (bytes > shard_capacity_) {
+      return;
+    }
+
+    shard.entries.push_front(Node{key, entry, bytes});
+    shard.index.emplace(key, shard.entries.begin());
+    shard.bytes += bytes;
+    while (shard.bytes > shard_capacity_) {
+      erase(shard, shard.entries.back().key);
+    }
+  }
+
+  void remove(const std::string &key) override {
+    Shard &shard = shard_for(key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    erase(shard, key);
+  }
+
+  [[nodiscard]] size_t size_bytes() const {
+    size_t bytes = 0;
+    for (const auto &shard : shards_) {
+      std::lock_guard<std::mutex> lock(shard->mutex);
+      bytes += shard->bytes;
+    }
+    return bytes;
+  }
+
+private:
+  struct Node final {
+    std::string key;
+    CacheEntry entry;
+    size_t bytes;
+  };
+
+  struct Shard final {
+    mutable std::mutex mutex;
+    std::list<Node> entries;
+    std::unordered_map<std::string, std::list<Node>::iterator> index;
+    size_t bytes = 0;
+  };
+
+  size_t shard_capacity_;
+  std::vector<std::unique_ptr<Shard>> shards_;
+
+  Shard &shard_for(const std::string &key) {
+    return *shards_[std::hash<std::string>{}(key) % shards_.size()];
+  }
+
+  static void erase(Shard &shard, const std::string &key) {
+    auto found = shard.index.find(key);
+    if (found != shard.index.end()) {
+      shard.bytes -= found->second->bytes;
+      shard.entries.erase(found->second);
+      shard.index.erase(found);
+    }
+  }
+};
+
+// Keeps recently used entries in a fast store in front of a larger, slower
+// one. Lookups that miss the front but hit the back are promoted.
+struct TieredCache final : CacheStore {
+  TieredCache(std::shared_ptr<CacheStore> front,
+              std::shared_ptr<CacheStore> back)
+      : front_(std::move(front)), back_(std::move(back)) {}
+
+  [[nodiscard]] std::optional<CacheEntry>
+  lookup(const std::string &key) override {
+    if (std::optional<CacheEntry> entry = front_->lookup(key)) {
+      return entry;
+    }
+
+    std::optional<CacheEntry> entry = back_->lookup(key);
+    if (entry) {
+      front_->store(key, *entry);
+    }
+    return entry;
+  }
+
+  void store(const std::string &key, const CacheEntry &entry) override {
+    back_->store(key, entry);
+    front_->store(key, entry);
+  }
+
+  void remove(const std::string &key) override {
+    front_->remove(key);
+    back_->remove(key);
+  }
+
+private:
+  std::shared_ptr<CacheStore> front_;
+  std::shared_ptr<CacheStore> back_;
+};
+
+#if defined(__unix__) || defined(__APPLE__)
+// A CacheStore that survives restarts. Records are appended to segment files
+// and found through an open addressing hash index that lives in a memory
+// mapped file. A record is synced to disk before the index slot pointing at
+// it is written, and both slots and records carry checksums, the latter
+// covering the body too, so a crash or a damaged file costs at most a miss,
+// never a corrupt hit. Once the segments outgrow the capacity the oldest one
+// is deleted. Bodies returned by lookup borrow
+// the segment mapping rather than being copied, and stay valid after their
+// segment is evicted. One process per directory.
+struct DiskCache final : CacheStore {
+  DiskCache(std::string directory, uint64_t capacity_bytes,
+            uint64_t slot_count = 1 << 16)
+      : directory_(std::move(directory)), capacity_bytes_(capacity_bytes),
+        segment_bytes_(std::max<uint64_t>(capacity_bytes / 8, 1)),
+        slot_count_(std::max<uint64_t>(slot_count, 1)) {
+    open();
+  }
+
+  DiskCache(const DiskCache &) = delete;
+  DiskCache &operator=(const DiskCache &) = delete;
+
+  ~DiskCache() override {
+    if (segment_fd_ >= 0) {
+      ::close(segment_fd_);
+    }
+    if (index_ != nullptr) {
+      ::munmap(index_, index_bytes());
+    }
+  }
+
+  // False when the directory or index could not be opened; every lookup
+  // then misses and every store is dropped.
+  [[nodiscard]] bool available() const noexcept { return index_ != nullptr; }
+
+  [[nodiscard]] uint64_t size_bytes() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return total_bytes_;
+  }
+
+  [[nodiscard]] std::optional<CacheEntry>
+  lookup(const std::string &key) override {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Slot *slot = find(key);
+    if (slot == nullptr) {
+      return std::nullopt;
+    }
+
+    std::shared_ptr<const Mapping> mapping =
+        map_segment(slot->segment, slot->offset + sizeof(RecordHeader));
+    if (!mapping) {
+      return std::nullopt;
+    }
+
+    RecordHeader header;
+    std::memcpy(&header, mapping->data + slot->offset, sizeof(header));
+    const uint64_t payload =
+        uint64_t{header.key_length} + header.meta_length + header.body_length;
+    if (header.magic != RECORD_MAGIC || header.key_hash != slot->key_hash) {
+      return std::nullopt;
+    }
+    mapping = map_segment(slot->segment,
+                          slot->offset + sizeof(RecordHeader) + payload);
+    if (!mapping) {
+      return std::nullopt;
+    }
+
+    const char *start = mapping->data + slot->offset + sizeof(RecordHeader);
+    std::string_view stored_key(start, header.key_length);
+    std::string_view meta(start + header.key_length, header.meta_length);
+    std::string_view body(start + header.key_length + header.meta_length,
+                          header.body_length);
+    if (stored_key != key ||
+        header.check != record_check(header, key, meta, body)) {
+      return std::nullopt;
+    }
+    return decode(meta, HttpResponseBody(mapping, body));
+  }
+
+  void store(const std::string &key, const CacheEntry &entry) override {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!available()) {
+      return;
+    }
+
+    const std::string meta = encode(entry);
+    const std::string_view body = entry.response.body.view();
+    RecordHeader header{RECORD_MAGIC,
+                        hash(key),
+                        static_cast<uint32_t>(key.size()),
+                        static_cast<uint32_t>(meta.size()),
+                        body.size(),
+                        0};
+    header.check = record_check(header, key, meta, body);
+    const uint64_t record_bytes =
+        sizeof(RecordHeader) + key.size() + meta.size() + body.size();
+    if (record_bytes > capacity_bytes_ ||
+        key.size() > std::numeric_limits<uint32_t>::max() ||
+        meta.size() > std::numeric_limits<uint32_t>::max()) {
+      return;
+    }
+
+    if (segment_size_ > 0 && segment_size_ + record_bytes > segment_bytes_) {
+      rotate();
+    }
+
+    const uint64_t offset = segment_size_;
+    if (segment_fd_ < 0 ||
+        !write_all(offset, std::string_view(reinterpret_cast<const char *>(
+                                                &header),
+                                            sizeof(header))) ||
+        !write_all(offset + sizeof(header), key) ||
+        !write_all(offset + sizeof(header) + key.size(), meta) ||
+        !write_all(offset + sizeof(header) + key.size() + meta.size(), body) ||
+        ::fsync(segment_fd_) != 0) {
+      return;
+    }
+    segment_size_ += record_bytes;
+    total_bytes_ += record_bytes;
+
+    publish(claim(header.key_hash), header.key_hash, index_->active_segment,
+            offset);
+    while (total_bytes_ > capacity_bytes_ &&
+           index_->oldest_segment < index_->active_segment) {
+      evict_oldest();
+    }
+  }
+
+  void remove(const std::string &key) override {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (Slot *slot = find(key)) {
+      slot->check = 0;
+    }
+  }
+
+private:
+  static constexpr uint64_t INDEX_MAGIC = 0x53484458'494e4431; // "SHDXIND1"
+  static constexpr uint64_t RECORD_MAGIC = 0x53484458'52454333;
+  static constexpr uint64_t MAX_PROBES = 16;
+
+  struct IndexHeader final {
+    uint64_t magic;
+    uint64_t slot_count;
+    uint64_t oldest_segment;
+    uint64_t active_segment;
+  };
+
+  struct Slot final {
+    uint64_t key_hash;
+    uint64_t segment;
+    uint64_t offset;
+    uint64_t check;
+  };
+
+  struct RecordHeader final {
+    uint64_t magic;
+    uint64_t key_hash;
+    uint32_t key_length;
+    uint32_t meta_length;
+    uint64_t body_length;
+    uint64_t check;
+  };
+
+  struct Mapping final {
+    Mapping(const char *data, size_t size) : data(data), size(size) {}
+    Mapping(const Mapping &) = delete;
+    Mapping &operator=(const Mapping &) = delete;
+    ~Mapping() { ::munmap(const_cast<char *>(data), size); }
+
+    const char *data;
+    size_t size;
+  };
+
+  std::string directory_;
+  uint64_t capacity_bytes_;
+  uint64_t segment_bytes_;
+  uint64_t slot_count_;
+  mutable std::mutex mutex_;
+  IndexHeader *index_ = nullptr;
+  int segment_fd_ = -1;
+  uint64_t segment_size_ = 0;
+  uint64_t total_bytes_ = 0;
+  std::unordered_map<uint64_t, std::shared_ptr<const Mapping>> mappings_;
+
+  static uint64_t hash(std::string_view bytes, uint64_t seed = 0) {
+    uint64_t value = 0xcbf29ce484222325ULL ^ seed;
+    for (unsigned char c : bytes) {
+      value = (value ^ c) * 0x100000001b3ULL;
+    }
+    return value == 0 ? 1 : value;
+  }
+
+  // FNV-1a over 8 byte words, so checking a large body stays cheap next to
+  // reading it.
+  static uint64_t body_hash(std::string_view bytes, uint64_t seed) {
+    uint64_t value = seed;
+    while (bytes.size() >= sizeof(uint64_t)) {
+      uint64_t word;
+      std::memcpy(&word, bytes.data(), sizeof(word));
+      value = (value ^ word) * 0x100000001b3ULL;
+      value ^= value >> 29;
+      bytes.remove_prefix(sizeof(word));
+    }
+    return hash(bytes, value);
+  }
+
+  static uint64_t slot_check(uint64_t key_hash, uint64_t segment,
+                             uint64_t offset) {
+    uint64_t fields[] = {key_hash, segment, offset};
+    return hash(std::string_view(reinterpret_cast<const char *>(fields),
+                                 sizeof(fields)));
+  }
+
+  static uint64_t record_check(const RecordHeader &header,
+                               std::string_view key, std::string_view meta,
+                               std::string_view body) {
+    uint64_t lengths[] = {header.key_length, header.meta_length,
+                          header.body_length};
+    const uint64_t prefix = hash(std::string_view(
+        reinterpret_cast<const char *>(lengths), sizeof(lengths)));
+    return body_hash(body, hash(meta, hash(key, prefix)));
+  }
+
+  [[nodiscard]] size_t index_bytes() const {
+    return sizeof(IndexHeader) + slot_count_ * sizeof(Slot);
+  }
+
+  [[nodiscard]] Slot *slots() const {
+    return reinterpret_cast<Slot *>(index_ + 1);
+  }
+
+  [[nodiscard]] std::string segment_path(uint64_t segment) const {
+    return directory_ + "/segment-" + std::to_string(segment);
+  }
+
+  void open() {
+    if (::mkdir(directory_.c_str(), 0700) != 0 && errno != EEXIST) {
+      return;
+    }
+
+    const std::string path = directory_ + "/index";
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0600);
+    if (fd < 0) {
+      return;
+    }
+    struct stat info {};
+    if (::fstat(fd, &info) != 0 ||
+        (static_cast<uint64_t>(info.st_size) != index_bytes() &&
+         ::ftruncate(fd, static_cast<off_t>(index_bytes())) != 0)) {
+      ::close(fd);
+      return;
+    }
+    void *address = ::mmap(nullptr, index_bytes(), PROT_READ | PROT_WRITE,
+                           MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (address == MAP_FAILED) {
+      return;
+    }
+
+    index_ = static_cast<IndexHeader *>(address);
+    const bool reset = index_->magic != INDEX_MAGIC ||
+                       index_->slot_count != slot_count_ ||
+                       index_->oldest_segment > index_->active_segment;
+    if (reset) {
+      std::memset(address, 0, index_bytes());
+      *index_ = IndexHeader{INDEX_MAGIC, slot_count_, 0, 0};
+    }
+    remove_stray_segments(reset);
+
+    for (uint64_t segment = index_->oldest_segment;
+         segment <= index_->active_segment; ++segment) {
+      struct stat segment_info {};
+      if (::stat(segment_path(segment).c_str(), &segment_info) == 0) {
+        total_bytes_ += static_cast<uint64_t>(segment_info.st_size);
+      }
+    }
+    open_active_segment();
+  }
+
+  // Deletes segments no slot can point into: all of them when the index was
+  // reset, else those outside its range, left by a crash between advancing
+  // the oldest segment and unlinking it.
+  void remove_stray_segments(bool all) {
+    DIR *directory = ::opendir(directory_.c_str());
+    if (directory == nullptr) {
+      return;
+    }
+    const std::string_view prefix = "segment-";
+    while (const dirent *entry = ::readdir(directory)) {
+      std::string_view name = entry->d_name;
+      uint64_t segment = 0;
+      if (name.substr(0, prefix.size()) != prefix) {
+        continue;
+      }
+      name.remove_prefix(prefix.size());
+      const auto [end, error] =
+          std::from_chars(name.data(), name.data() + name.size(), segment);
+      if (error == std::errc{} && end == name.data() + name.size() &&
+          (all || segment < index_->oldest_segment ||
+           segment > index_->active_segment)) {
+        ::unlink(segment_path(segment).c_str());
+      }
+    }
+    ::closedir(directory);
+  }
+
+  void open_active_segment() {
+    if (segment_fd_ >= 0) {
+      ::close(segment_fd_);
+    }
+    segment_fd_ = ::open(segment_path(index_->active_segment).c_str(),
+                         O_RDWR | O_CREAT, 0600);
+    struct stat info {};
+    segment_size_ = segment_fd_ >= 0 && ::fstat(segment_fd_, &info) == 0
+                        ? static_cast<uint64_t>(info.st_size)
+                        : 0;
+  }
+
+  void rotate() {
+    index_->active_segment += 1;
+    open_active_segment();
+  }
+
+  void evict_oldest() {
+    const uint64_t segment = index_->oldest_segment;
+    struct stat info {};
+    if (::stat(segment_path(segment).c_str(), &info) == 0) {
+      total_bytes_ -= std::min<uint64_t>(total_bytes_, info.st_size);
+    }
+    // Advance the boundary first so a crash never leaves slots that point
+    // into a missing file; open mappings keep the data readable.
+    index_->oldest_segment = segment + 1;
+    ::unlink(segment_path(segment).c_str());
+    mappings_.erase(segment);
+  }
+
+  bool write_all(uint64_t offset, std::string_view bytes) {
+    while (!bytes.empty()) {
+      ssize_t written = ::pwrite(segment_fd_, bytes.data(), bytes.size(),
+                                 static_cast<off_t>(offset));
+      if (written < 0 && errno == EINTR) {
+        continue;
+      }
+      if (written <= 0) {
+        return false;
+      }
+      bytes.remove_prefix(static_cast<size_t>(written));
+      offset += static_cast<uint64_t>(written);
+    }
+    return true;
+  }
+
+  [[nodiscard]] bool live(const Slot &slot) const {
+    return slot.check != 0 &&
+           slot.check == slot_check(slot.key_hash, slot.segment, slot.offset) &&
+           slot.segment >= index_->oldest_segment &&
+           slot.segment <= index_->active_segment;
+  }
+
+  Slot *find(const std::string &key) {
+    if (!available()) {
+      return nullptr;
+    }
+    const uint64_t key_hash = hash(key);
+    for (uint64_t probe = 0; probe < std::min(MAX_PROBES, slot_count_);
+         ++probe) {
+      Slot &slot = slots()[(key_hash + probe) % slot_count_];
+      if (live(slot) && slot.key_hash == key_hash) {
+        return &slot;
+      }
+    }
+    return nullptr;
+  }
+
+  // The slot already holding this key, else the first free one, else the
+  // home slot, whose entry is dropped.
+  Slot &claim(uint64_t key_hash) {
+    Slot *free = nullptr;
+    for (uint64_t probe = 0; probe < std::min(MAX_PROBES, slot_count_);
+         ++probe) {
+      Slot &slot = slots()[(key_hash + probe) % slot_count_];
+      if (live(slot) && slot.key_hash == key_hash) {
+        return slot;
+      }
+      if (free == nullptr && !live(slot)) {
+        free = &slot;
+      }
+    }
+    return free != nullptr ? *free : slots()[key_hash % slot_count_];
+  }
+
+  // The checksum is cleared first and written last, so an interrupted
+  // update leaves a slot that reads as empty.
+  static void publish(Slot &slot, uint64_t key_hash, uint64_t segment,
+                      uint64_t offset) {
+    slot.check = 0;
+    slot.key_hash = key_hash;
+    slot.segment = segment;
+    slot.offset = offset;
+    slot.check = slot_check(key_hash, segment, offset);
+  }
+
+  // Returns a read only mapping of the segment covering at least the first
+  // `bytes` bytes, remapping when the segment has grown since it was mapped.
+  std::shared_ptr<const Mapping> map_segment(uint64_t segment,
+                                             uint64_t bytes) {
+    auto found = mappings_.find(segment);
+    if (found != mappings_.end() && found->second->size >= bytes) {
+      return found->second;
+    }
+
+    int fd = ::open(segment_path(segment).c_str(), O_RDONLY);
+    if (fd < 0) {
+      return nullptr;
+    }
+    struct stat info {};
+    if (::fstat(fd, &info) != 0 || static_cast<uint64_t>(info.st_size) < bytes ||
+        info.st_size == 0) {
+      ::close(fd);
+      return nullptr;
+    }
+    const size_t size = static_cast<size_t>(info.st_size);
+    void *address = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (address == MAP_FAILED) {
+      return nullptr;
+    }
+
+    auto mapping =
+        std::make_shared<const Mapping>(static_cast<const char *>(address), size);
+    mappings_[segment] = mapping;
+    return mapping;
+  }
+
+  static void put(std::string &out, uint64_t value) {
+    out.append(reinterpret_cast<const char *>(&value), sizeof(value));
+  }
+
+  static void put(std::string &out, std::string_view value) {
+    put(out, static_cast<uint64_t>(value.size()));
+    out.append(value);
+  }
+
+  static bool get(std::string_view &in, uint64_t &value) {
+    if (in.size() < sizeof(value)) {
+      return false;
+    }
+    std::memcpy(&value, in.data(), sizeof(value));
+    in.remove_prefix(sizeof(value));
+    return true;
+  }
+
+  static bool get(std::string_view &in, std::string &value) {
+    uint64_t size = 0;
+    if (!get(in, size) || in.size() < size) {
+      return false;
+    }
+    value.assign(in.data(), size);
+    in.remove_prefix(size);
+    return true;
+  }
+
+  static std::string encode(const CacheEntry &entry) {
+    std::string out;
+    put(out, static_cast<uint64_t>(entry.response.status.value()));
+    put(out, static_cast<uint64_t>(
+                 std::chrono::duration_cast<std::chrono::microseconds>(
+                     entry.response_time.time_since_epoch())
+                     .count()));
+    put(out, static_cast<uint64_t>(entry.freshness_lifetime.count()));
+    put(out, static_cast<uint64_t>(entry.initial_age.count()));
+    put(out, static_cast<uint64_t>(entry.stale_while_revalidate.count()));
+    put(out, static_cast<uint64_t>(entry.stale_if_error.count()));
+    put(out, static_cast<uint64_t>(entry.vary.size()));
+    for (const std::string &name : entry.vary) {
+      put(out, name);
+    }
+    put(out, static_cast<uint64_t>(entry.response.headers.value().size()));
+    for (const auto &[name, value] : entry.response.headers.value()) {
+      put(out, name);
+      put(out, value);
+    }
+    return out;
+  }
+
+  static std::optional<CacheEntry> decode(std::string_view meta,
+                                          HttpResponseBody body) {
+    uint64_t status = 0, time = 0, lifetime = 0, age = 0, revalidate = 0,
+             error = 0, count = 0;
+    if (!get(meta, status) || !get(meta, time) || !get(meta, lifetime) ||
+        !get(meta, age) || !get(meta, revalidate) || !get(meta, error) ||
+        !get(meta, count)) {
+      return std::nullopt;
+    }
+
+    std::vector<std::string> vary(count);
+    for (std::string &name : vary) {
+      if (!get(meta, name)) {
+        return std::nullopt;
+      }
+    }
+
+    Headers headers;
+    if (!get(meta, count)) {
+      return std::nullopt;
+    }
+    for (uint64_t i = 0; i < count; ++i) {
+      std::string name, value;
+      if (!get(meta, name) || !get(meta, value)) {
+        return std::nullopt;
+      }
+      headers.emplace(std::move(name), std::move(value));
+    }
+
+    return CacheEntry{
+        HttpResponse{HttpStatusCode{static_cast<int64_t>(status)},
+                     HttpResponseHeaders{std::move(headers)}, std::move(body)},
+        std::chrono::system_clock::time_point(
+            std::chrono::duration_cast<std::chrono::system_clock::duration>(
+                std::chrono::microseconds(static_cast<int64_t>(time)))),
+        std::chrono::seconds(static_cast<int64_t>(lifetime)),
+        std::chrono::seconds(static_cast<int64_t>(age)), std::move(vary),
+        std::chrono::seconds(static_cast<int64_t>(revalidate)),
+        std::chrono::seconds(static_cast<int64_t>(error))};
+  }
+};
+#endif
+
+struct CacheStatistics final {
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t revalidations;
+  uint64_t stale;
+};
+
+// A private HTTP cache (RFC 9111) for Client::get. Responses are stored
+// when they carry explicit freshness or a validator and no no-store
+// directive; stale entries are revalidated with If-None-Match and
+// If-Modified-Since, and a 304 refreshes the stored entry.
+struct HttpCache final {
+  explicit HttpCache(std::shared_ptr<CacheStore> store)
+      : store_(std::move(store)) {}
+
+  [[nodiscard]] CacheStatistics statistics() const {
+    return CacheStatistics{hits_.load(std::memory_order_relaxed),
+                           misses_.load(std::memory_order_relaxed),
+                           revalidations_.load(std::memory_order_relaxed),
+                           stale_.load(std::memory_order_relaxed)};
+  }
+
+  [[nodiscard]] std::optional<CacheEntry> lookup(const std::string &url,
+                                                 const Headers &headers) {
+    std::optional<CacheEntry> entry = store_->lookup(url);
+    if (entry && !entry->vary.empty()) {
+      entry = store_->lookup(variant_key(url, entry->vary, headers));
+    }
+    return entry;
+  }
+
+  // Stores the response if it is cacheable and returns the entry it became.
+  std::optional<CacheEntry> store(const std::string &url,
+                                  const Headers &headers,
+                                  const HttpResponse &response) {
+    const Headers &response_headers = response.headers.value();
+    if (!CACHEABLE_STATUS_CODES(response.status) ||
+        CacheControl::parse(header_value(headers, "Cache-Control")
+                                .value_or(""))
+            .no_store) {
+      return std::nullopt;
+    }
+
+    CacheControl directives = CacheControl::parse(
+        header_value(response_headers, "Cache-Control").value_or(""));
+    std::vector<std::string> vary;
+    for (const std::string &name :
+         vec(header_value(response_headers, "Vary").value_or(""), ',')) {
+      if (!name.empty()) {
+        vary.push_back(lowercase(name));
+      }
+    }
+
+    const bool has_validator =
+        header_value(response_headers, "ETag").has_value() ||
+        header_value(response_headers, "Last-Modified").has_value();
+    std::optional<std::chrono::seconds> lifetime =
+        freshness_lifetime(directives, response_headers);
+    if (directives.no_store ||
+        std::find(vary.begin(), vary.end(), "*") != vary.end() ||
+        (!lifetime && !has_validator)) {
+      store_->remove(url);
+      return std::nullopt;
+    }
+
+    CacheEntry entry{response, std::chrono::system_clock::now(),
+                     directives.no_cache ? std::chrono::seconds{0}
+                                         : lifetime.value_or(
+                                               std::chrono::seconds{0}),
+                     initial_age(response_headers), {}};
+    if (!directives.no_cache) {
+      entry.stale_while_revalidate =
+          directives.stale_while_revalidate.value_or(std::chrono::seconds{0});
+      entry.stale_if_error =
+          directives.stale_if_error.value_or(std::chrono::seconds{0});
+    }
+    if (vary.empty()) {
+      store_->store(url, entry);
+    } else {
+      store_->store(url, CacheEntry{HttpResponse{response.status,
+                                                 HttpResponseHeaders{Headers{}},
+                                                 HttpResponseBody{}},
+                                    entry.response_time,
+                                    std::chrono::seconds{0},
+                                    std::chrono::seconds{0},
+                                    vary});
+      store_->store(variant_key(url, vary, headers), entry);
+    }
+    return entry;
+  }
+
+  // Applies a 304 to a stored entry: its headers are merged in and the
+  // freshness clock restarts.
+  CacheEntry refresh(const std::string &url, const Headers &headers,
+                     const CacheEntry &entry,
+                     const HttpResponse &not_modified) {
+    Headers merged = entry.response.headers.value();
+    for (const auto &[name, value] : not_modified.headers.value()) {
+      if (lowercase(name) != "content-length") {
+        merged.insert_or_assign(name, value);
+      }
+    }
+
+    HttpResponse response{entry.response.status,
+                          HttpResponseHeaders{std::move(merged)},
+                          entry.response.body};
+    std::optional<CacheEntry> refreshed = store(url, headers, response);
+    return refreshed ? *refreshed
+                     : CacheEntry{response, std::chrono::system_clock::now(),
+                                  std::chrono::seconds{0},
+                                  std::chrono::seconds{0},
+                                  {}};
+  }
+
+  void record_hit() { hits_.fetch_add(1, std::memory_order_relaxed); }
+
+  void record_miss() { misses_.fetch_add(1, std::memory_order_relaxed); }
+
+  void record_revalidation() {
+    revalidations_.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  void record_stale() { stale_.fetch_add(1, std::memory_order_relaxed); }
+
+private:
+  inline static const StatusCodeSet CACHEABLE_STATUS_CODES{
+      200, 203, 204, 300, 301, 308, 404, 405, 410, 414, 501};
+
+  std::shared_ptr<CacheStore> store_;
+  std::atomic<uint64_t> hits_{0};
+  std::atomic<uint64_t> misses_{0};
+  std::atomic<uint64_t> revalidations_{0};
+  std::atomic<uint64_t> stale_{0};
+
+  static std::string variant_key(const std::string &url,
+                                 const std::vector<std::string> &vary,
+                                 const Headers &headers) {
+    std::string key = url;
+    for (const std::string &name : vary) {
+      key += '\n' + name + ':' + header_value(headers, name).value_or("");
+    }
+    return key;
+  }
+
+  static std::optional<std::chrono::seconds>
+  freshness_lifetime(const CacheControl &directives, const Headers &headers) {
+    if (directives.max_age) {
+      return directives.max_age;
+    }
+
+    std::optional<std::string> expires = header_value(headers, "Expires");
+    if (!expires) {
+      return std::nullopt;
+    }
+
+    std::optional<std::string> date = header_value(headers, "Date");
+    const time_t expires_at = curl_getdate(expires->c_str(), nullptr);
+    const time_t date_at =
+        date ? curl_getdate(date->c_str(), nullptr)
+             : std::chrono::system_clock::to_time_t(
+                   std::chrono::system_clock::now());
+    if (expires_at < 0 || date_at < 0 || expires_at <= date_at) {
+      return std::chrono::seconds{0};
+    }
+    return std::chrono::seconds{expires_at - date_at};
+  }
+
+  static std::chrono::seconds initial_age(const Headers &headers) {
+    std::optional<std::string> age = header_value(headers, "Age");
+    if (!age || age->empty() ||
+        !std::all_of(age->begin(), age->end(),
+                     [](char c) { return c >= '0' && c <= '9'; })) {
+      return std::chrono::seconds{0};
+    }
+    return std::chrono::seconds{std::stoll(age->substr(0, 18))};
+  }
+};
+
+// Millisecond limits on the phases of a transfer. Unset limits do not apply.
+// A request that exceeds one fails with CURLE_OPERATION_TIMEDOUT.
+struct Timeouts final {
+  // Resolving, connecting and the TLS handshake.
+  std::optional<std::chrono::milliseconds> connect;
+  // Until the first response byte, counted from the start of the transfer
+  // or the last request byte sent.
+  std::optional<std::chrono::milliseconds> first_byte;
+  // Between two bytes of the response once it has started.
+  std::optional<std::chrono::milliseconds> idle;
+  // The whole request, including retries and the waits between them.
+  std::optional<std::chrono::milliseconds> total;
+
+  // These limits, taking unset ones from the fallback.
+  [[nodiscard]] Timeouts or_else(const Timeouts &fallback) const {
+    return Timeouts{connect ? connect : fallback.connect,
+                    first_byte ? first_byte : fallback.first_byte,
+                    idle ? idle : fallback.idle,
+                    total ? total : fallback.total};
+  }
+};
+
+// Cancels the requests it is passed to, from any thread. Copies share their
+// state, so the token that is cancelled can be a copy of the one passed.
+struct CancellationToken final {
+  CancellationToken() : state_(std::make_shared<State>()) {}
+
+  void cancel() const {
+    std::lock_guard<std::mutex> lock(state_->mutex);
+    state_->cancelled.store(true, std::memory_order_relaxed);
+    state_->cancel.notify_all();
+  }
+
+  [[nodiscard]] bool cancelled() const {
+    return state_->cancelled.load(std::memory_order_relaxed);
+  }
+
+  // Sleeps for the duration unless cancelled first. Returns whether the
+  // token is cancelled.
+  template <class Rep, class Period>
+  bool wait_for(const std::chrono::duration<Rep, Period> &duration) const {
+    std::unique_lock<std::mutex> lock(state_->mutex);
+    return state_->cancel.wait_for(lock, duration, [this] {
+      return state_->cancelled.load(std::memory_order_relaxed);
+    });
+  }
+
+private:
+  friend struct Client;
+
+  struct State final {
+    std::atomic<bool> cancelled{false};
+    std::mutex mutex;
+    std::condition_variable cancel;
+  };
+
+  std::shared_ptr<State> state_;
+};
+
+// The W3C trace context of a span (https://www.w3.org/TR/trace-context/),
+// sent with requests in the traceparent and tracestate headers.
+struct TraceContext final {
+  // 32 lowercase hex digits, not all zero.
+  std::string trace_id;
+  // 16 lowercase hex digits, not all zero.
+  std::string span_id;
+  bool sampled = true;
+  std::string trace_state;
+
+  // A new trace with random ids.
+  [[nodiscard]] static TraceContext root() {
+    return TraceContext{random_id(32), random_id(16), true, {}};
+  }
+
+  // A span of the same trace under this one.
+  [[nodiscard]] TraceContext child() const {
+    return TraceContext{trace_id, random_id(16), sampled, trace_state};
+  }
+
+  [[nodiscard]] std::string traceparent() const {
+    return "00-" + trace_id + "-" + span_id + (sampled ? "-01" : "-00");
+  }
+
+  // Reads a traceparent header, as received with an incoming request.
+  // Versions other than 00 are read by their 00 fields as the
+  // specification requires.
+  [[nodiscard]] static std::optional<TraceContext>
+  parse(std::string_view traceparent, std::string trace_state = {}) {
+    if (traceparent.size() < 55 || traceparent[2] != '-' ||
+        traceparent[35] != '-' || traceparent[52] != '-' ||
+        (traceparent.size() > 55 && traceparent[55] != '-') ||
+        traceparent.substr(0, 2) == "ff") {
+      return std::nullopt;
+    }
+    const std::string_view version = traceparent.substr(0, 2);
+    const std::string_view trace_id = traceparent.substr(3, 32);
+    const std::string_view span_id = traceparent.substr(36, 16);
+    const std::string_view flags = traceparent.substr(53, 2);
+    if (!hex(version) || !hex(trace_id) || !hex(span_id) || !hex(flags) ||
+        (version == "00" && traceparent.size() != 55) ||
+        trace_id.find_first_not_of('0') == std::string_view::npos ||
+        span_id.find_first_not_of('0') == std::string_view::npos) {
+      return std::nullopt;
+    }
+    const bool sampled =
+        (std::stoi(std::string{flags}, nullptr, 16) & 0x01) != 0;
+    return TraceContext{std::string{trace_id}, std::string{span_id}, sampled,
+                        std::move(trace_state)};
+  }
+
+private:
+  static bool hex(std::string_view value) {
+    return std::all_of(value.begin(), value.end(), [](char c) {
+      return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f');
+    });
+  }
+
+  static std::string random_id(size_t digits) {
+    static constexpr char HEX[] = "0123456789abcdef";
+    thread_local std::mt19937_64 generator{std::random_device{}()};
+    std::string id(digits, '0');
+    while (id.find_first_not_of('0') == std::string::npos) {
+      for (size_t i = 0; i < digits; i += 16) {
+        uint64_t bits = generator();
+        for (size_t j = i; j < std::min(digits, i + 16); ++j, bits >>= 4) {
+          id[j] = HEX[bits & 0x0f];
+        }
+      }
+    }
+    return id;
+  }
+};
+
+// Per-request overrides of the corresponding Client settings.
+struct RequestOptions final {
+  RequestOptions &with_max_body_size(size_t bytes) {
+    max_body_size_ = bytes;
+    return *this;
+  }
+
+  // Overrides the stale-while-revalidate window of cached responses.
+  RequestOptions &with_stale_while_revalidate(std::chrono::seconds window) {
+    stale_while_revalidate_ = window;
+    return *this;
+  }
+
+  // Overrides the stale-if-error window of cached responses.
+  RequestOptions &with_stale_if_error(std::chrono::seconds window) {
+    stale_if_error_ = window;
+    return *this;
+  }
+
+  RequestOptions &with_connect_timeout(std::chrono::milliseconds timeout) {
+    timeouts_.connect = timeout;
+    return *this;
+  }
+
+  RequestOptions &with_first_byte_timeout(std::chrono::milliseconds timeout) {
+    timeouts_.first_byte = timeout;
+    return *this;
+  }
+
+  RequestOptions &with_idle_timeout(std::chrono::milliseconds timeout) {
+    timeouts_.idle = timeout;
+    return *this;
+  }
+
+  RequestOptions &with_total_timeout(std::chrono::milliseconds timeout) {
+    timeouts_.total = timeout;
+    return *this;
+  }
+
+  // An absolute deadline for the request, retries included. When a total
+  // timeout also applies the earlier of the two wins.
+  RequestOptions &
+  with_deadline(std::chrono::steady_clock::time_point deadline) {
+    deadline_ = deadline;
+    return *this;
+  }
+
+  // A cancelled request fails with HttpAbortReason::Cancelled, whether it
+  // had not started yet, was transferring or was waiting to retry.
+  RequestOptions &with_cancellation(CancellationToken token) {
+    cancellation_ = std::move(token);
+    return *this;
+  }
+
+  // The span the request is made on behalf of, such as the one of an
+  // incoming request. The tracer starts the request's spans under it.
+  RequestOptions &with_trace_parent(TraceContext parent) {
+    trace_parent_ = std::move(parent);
+    return *this;
+  }
+
+  [[nodiscard]] const std::optional<size_t> &max_body_size() const {
+    return max_body_size_;
+  }
+
+  [[nodiscard]] const Timeouts &timeouts() const { return timeouts_; }
+
+  [[nodiscard]] const std::optional<std::chrono::steady_clock::time_point> &
+  deadline() const {
+    return deadline_;
+  }
+
+  [[nodiscard]] const std::optional<CancellationToken> &cancellation() const {
+    return cancellation_;
+  }
+
+  [[nodiscard]] const std::optional<TraceContext> &trace_parent() const {
+    return trace_parent_;
+  }
+
+  [[nodiscard]] const std::optional<std::chrono::seconds> &
+  stale_while_revalidate() const {
+    return stale_while_revalidate_;
+  }
+
+  [[nodiscard]] const std::optional<std::chrono::seconds> &
+  stale_if_error() const {
+    return stale_if_error_;
+  }
+
+private:
+  friend struct Client;
+
+  std::optional<size_t> max_body_size_;
+  std::optional<std::chrono::seconds> stale_while_revalidate_;
+  std::optional<std::chrono::seconds> stale_if_error_;
+  Timeouts timeouts_;
+  std::optional<std::chrono::steady_clock::time_point> deadline_;
+  std::optional<CancellationToken> cancellation_;
+  std::optional<TraceContext> trace_parent_;
+  // The context of the request, shared by the spans of its attempts.
+  std::optional<TraceContext> trace_request_;
+  std::shared_ptr<const std::atomic<bool>> superseded_;
+};
+
+struct CoalescingStatistics final {
+  uint64_t transfers;
+  uint64_t coalesced;
+};
+
+// Lets concurrent identical requests share a single transfer. Requests are
+// identical when their method, url, credentials (Authorization,
+// Proxy-Authorization and Cookie), the configured key headers, maximum body
+// size, stale policies and connect, first byte and idle timeouts match;
+// other headers are taken from whichever request started the transfer.
+// Every caller receives its own copy of the shared result, whose body is not
+// copied. Requests that shareable() rejects must not be run through it.
+struct RequestCoalescer final {
+  explicit RequestCoalescer(std::vector<std::string> key_headers = {})
+      : key_headers_(std::move(key_headers)) {}
+
+  [[nodiscard]] CoalescingStatistics statistics() const {
+    return CoalescingStatistics{transfers_.load(std::memory_order_relaxed),
+                                coalesced_.load(std::memory_order_relaxed)};
+  }
+
+  // Whether the request may share a transfer. One with a cancellation token,
+  // a deadline or a total timeout would impose its limits on the others, or
+  // be held past its own, and one with a trace parent would lose its span.
+  [[nodiscard]] static bool shareable(const RequestOptions &options) {
+    return !options.cancellation() && !options.deadline() &&
+           !options.timeouts().total && !options.trace_parent();
+  }
+
+  [[nodiscard]] std::string key(std::string_view method, const HttpUrl &url,
+                                const Headers &headers,
+                                const RequestOptions &options) const {
+    std::string key = std::string(method) + ' ' + url.value();
+    for (const char *name : CREDENTIAL_HEADERS) {
+      if (auto value = header_value(headers, name)) {
+        key += std::string{'\n'} + name + ": " + *value;
+      }
+    }
+    for (const std::string &name : key_headers_) {
+      key += '\n' + lowercase(name) + ": " +
+             header_value(headers, name).value_or("");
+    }
+    if (options.max_body_size()) {
+      key += "\nmax-body-size: " + std::to_string(*options.max_body_size());
+    }
+    auto add = [&key](std::string_view name, const auto &duration) {
+      if (duration) {
+        key += '\n' + std::string{name} + ": " +
+               std::to_string(duration->count());
+      }
+    };
+    add("stale-while-revalidate", options.stale_while_revalidate());
+    add("stale-if-error", options.stale_if_error());
+    add("connect-timeout", options.timeouts().connect);
+    add("first-byte-timeout", options.timeouts().first_byte);
+    add("idle-timeout", options.timeouts().idle);
+    return key;
+  }
+
+  // Runs the transfer unless one with the same key is already in flight, in
+  // which case its result is awaited instead.
+  [[nodiscard]] HttpResult run(const std::string &key,
+                               const std::function<HttpResult()> &transfer) {
+    std::promise<HttpResult> promise;
+    std::shared_future<HttpResult> in_flight;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto found = in_flight_.find(key);
+      if (found != in_flight_.end()) {
+        in_flight = found->second;
+      } else {
+        in_flight_.emplace(key, promise.get_future().share());
+      }
+    }
+    if (in_flight.valid()) {
+      coalesced_.fetch_add(1, std::memory_order_relaxed);
+      return in_flight.get();
+    }
+
+    transfers_.fetch_add(1, std::memory_order_relaxed);
+
+    try {
+      HttpResult result = transfer();
+      finish(key);
+      promise.set_value(result);
+      return result;
+    } catch (...) {
+      finish(key);
+      promise.set_exception(std::current_exception());
+      throw;
+    }
+  }
+
+private:
+  static constexpr const char *CREDENTIAL_HEADERS[] = {
+      "authorization", "proxy-authorization", "cookie"};
+
+  std::vector<std::string> key_headers_;
+  std::mutex mutex_;
+  std::unordered_map<std::string, std::shared_future<HttpResult>> in_flight_;
+  std::atomic<uint64_t> transfers_{0};
+  std::atomic<uint64_t> coalesced_{0};
+
+  void finish(const std::string &key) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    in_flight_.erase(key);
+  }
+};
+
+struct RefreshStatistics final {
+  uint64_t scheduled;
+  uint64_t deduplicated;
+  uint64_t completed;
+};
+
+// Runs cache refreshes on a worker thread, off the request path. A refresh
+// whose key is already queued or running is dropped, as is anything a
+// refresh throws. Refreshes still queued when the refresher is destroyed are
+// discarded.
+struct BackgroundRefresher final {
+  BackgroundRefresher() : worker_([this] { run(); }) {}
+
+  BackgroundRefresher(const BackgroundRefresher &) = delete;
+  BackgroundRefresher &operator=(const BackgroundRefresher &) = delete;
+
+  ~BackgroundRefresher() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+    }
+    wake_.notify_all();
+    worker_.join();
+  }
+
+  bool schedule(const std::string &key, std::function<void()> refresh) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (stopping_ || !keys_.insert(key).second) {
+      deduplicated_ += 1;
+      return false;
+    }
+
+    queue_.emplace_back(key, std::move(refresh));
+    scheduled_ += 1;
+    wake_.notify_one();
+    return true;
+  }
+
+  // Blocks until no refresh is queued or running.
+  void wait_idle() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    idle_.wait(lock, [this] { return keys_.empty(); });
+  }
+
+  [[nodiscard]] RefreshStatistics statistics() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return RefreshStatistics{scheduled_, deduplicated_, completed_};
+  }
+
+private:
+  mutable std::mutex mutex_;
+  std::condition_variable wake_;
+  std::condition_variable idle_;
+  std::deque<std::pair<std::string, std::function<void()>>> queue_;
+  std::unordered_set<std::string> keys_;
+  bool stopping_ = false;
+  uint64_t scheduled_ = 0;
+  uint64_t deduplicated_ = 0;
+  uint64_t completed_ = 0;
+  std::thread worker_;
+
+  void run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (;;) {
+      wake_.wait(lock, [this] { return stopping_ || !queue_.empty(); });
+      if (stopping_) {
+        return;
+      }
+
+      auto [key, refresh] = std::move(queue_.front());
+      queue_.pop_front();
+      lock.unlock();
+      try {
+        refresh();
+      } catch (...) {
+        // Nobody is waiting on a refresh; the entry stays stale and the next
+        // request schedules another.
+      }
+      lock.lock();
+      keys_.erase(key);
+      completed_ += 1;
+      if (keys_.empty()) {
+        idle_.notify_all();
+      }
+    }
+  }
+};
+
+// How long a Retry-After header asks to wait. The value is either
+// delay-seconds or an HTTP-date.
+inline static std::optional<std::chrono::milliseconds>
+retry_after(const Headers &headers) {
+  std::optional<std::string> value = header_value(headers, "Retry-After");
+  if (!value || value->empty()) {
+    return std::nullopt;
+  }
+  if (std::all_of(value->begin(), value->end(),
+                  [](char c) { return c >= '0' && c <= '9'; })) {
+    return std::chrono::seconds{std::stoll(value->substr(0, 9))};
+  }
+
+  const time_t at = curl_getdate(value->c_str(), nullptr);
+  if (at < 0) {
+    return std::nullopt;
+  }
+  return std::max(std::chrono::milliseconds{0},
+                  std::chrono::duration_cast<std::chrono::milliseconds>(
+                      std::chrono::system_clock::from_time_t(at) -
+                      std::chrono::system_clock::now()));
+}
+
+struct RetryStatistics final {
+  uint64_t requests;
+  uint64_t retries;
+  uint64_t budget_exhausted;
+};
+
+// What the attempt callback of a RetryPolicy learns about each attempt.
+// delay is how long the policy waits before the next attempt and is only
+// set when it is going to retry.
+struct RetryAttempt final {
+  uint32_t attempt;
+  std::chrono::microseconds elapsed;
+  const HttpResult &result;
+  std::optional<std::chrono::milliseconds> delay;
+};
+
+// Decides which failed requests a Client retries and how long it waits in
+// between. Waits follow decorrelated jitter backoff, or Retry-After when
+// the server sends one. Retries draw on a token bucket refilled by a share
+// of every request, so that during an outage retries add at most that
+// share to the load. Copies of a policy share its budget and statistics.
+struct RetryPolicy final {
+  RetryPolicy() : state_(std::make_shared<State>()) {}
+
+  // Total attempts including the first.
+  RetryPolicy &with_max_attempts(uint32_t attempts) {
+    max_attempts_ = std::max<uint32_t>(attempts, 1);
+    return *this;
+  }
+
+  // Response statuses that are retried, whatever the request's success
+  // predicate makes of them.
+  RetryPolicy &with_retryable_status(StatusCodeSet statuses) {
+    retryable_status_ = statuses;
+    return *this;
+  }
+
+  RetryPolicy &
+  with_retryable_failure(Predicate<HttpConnectionFailure> retryable) {
+    retryable_failure_ = std::move(retryable);
+    return *this;
+  }
+
+  RetryPolicy &with_backoff(std::chrono::milliseconds base,
+                            std::chrono::milliseconds cap) {
+    base_delay_ = base;
+    max_delay_ = std::max(base, cap);
+    return *this;
+  }
+
+  // Every request deposits `ratio` tokens, up to `max_tokens`, and every
+  // retry spends one.
+  RetryPolicy &with_budget(double ratio, double max_tokens) {
+    state_->deposit = static_cast<int64_t>(ratio * TOKEN);
+    state_->capacity = static_cast<int64_t>(max_tokens * TOKEN);
+    state_->tokens.store(state_->capacity, std::memory_order_relaxed);
+    return *this;
+  }
+
+  // A Retry-After asking for a longer wait than this ends the retries.
+  RetryPolicy &with_max_retry_after(std::chrono::milliseconds wait) {
+    max_retry_after_ = wait;
+    return *this;
+  }
+
+  // POST is only retried when enabled here.
+  RetryPolicy &with_non_idempotent_retries(bool enabled) {
+    non_idempotent_ = enabled;
+    return *this;
+  }
+
+  RetryPolicy &
+  with_attempt_callback(std::function<void(const RetryAttempt &)> callback) {
+    attempt_callback_ = std::move(callback);
+    return *this;
+  }
+
+  [[nodiscard]] bool retries(bool idempotent) const {
+    return idempotent || non_idempotent_;
+  }
+
+  [[nodiscard]] RetryStatistics statistics() const {
+    return RetryStatistics{
+        state_->requests.load(std::memory_order_relaxed),
+        state_->retries.load(std::memory_order_relaxed),
+        state_->budget_exhausted.load(std::memory_order_relaxed)};
+  }
+
+  // Makes attempts until one is not retryable, attempts or budget run out.
+  // No retry is made whose wait would end past the deadline, and cancelling
+  // the token ends the wait before the next attempt.
+  [[nodiscard]] HttpResult
+  run(const std::function<HttpResult()> &attempt,
+      const std::optional<std::chrono::steady_clock::time_point> &deadline =
+          std::nullopt,
+      const std::optional<CancellationToken> &cancellation =
+          std::nullopt) const {
+    state_->requests.fetch_add(1, std::memory_order_relaxed);
+    deposit();
+
+    std::chrono::milliseconds delay = base_delay_;
+    for (uint32_t number = 1;; ++number) {
+      const auto started = std::chrono::steady_clock::now();
+      HttpResult result = attempt();
+      const auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+          std::chrono::steady_clock::now() - started);
+
+      std::optional<std::chrono::milliseconds> wait;
+      if (number < max_attempts_) {
+        std::optional<std::chrono::milliseconds> backoff =
+            next_delay(result, delay);
+        if (backoff && deadline &&
+            std::chrono::steady_clock::now() + *backoff >= *deadline) {
+          backoff.reset();
+        }
+        if (backoff) {
+          if (withdraw()) {
+            wait = backoff;
+            delay = std::max(*backoff, base_delay_);
+          } else {
+            state_->budget_exhausted.fetch_add(1, std::memory_order_relaxed);
+          }
+        }
+      }
+
+      if (attempt_callback_) {
+        attempt_callback_(RetryAttempt{number, elapsed, result, wait});
+      }
+      if (!wait) {
+        return result;
+      }
+
+      state_->retries.fetch_add(1, std::memory_order_relaxed);
+      if (!cancellation) {
+        std::this_thread::sleep_for(*wait);
+      } else if (cancellation->wait_for(*wait)) {
+        return HttpResult{HttpFailure{HttpRequestAborted{
+            HttpAbortReason::Cancelled, "Request cancelled"}}};
+      }
+    }
+  }
+
+private:
+  static constexpr int64_t TOKEN = 1000;
+
+  struct State final {
+    std::atomic<int64_t> tokens{10 * TOKEN};
+    int64_t deposit = TOKEN / 10;
+    int64_t capacity = 10 * TOKEN;
+    std::atomic<uint64_t> requests{0};
+    std::atomic<uint64_t> retries{0};
+    std::atomic<uint64_t> budget_exhausted{0};
+  };
+
+  uint32_t max_attempts_ = 3;
+  StatusCodeSet retryable_status_{429, 502, 503, 504};
+  Predicate<HttpConnectionFailure> retryable_failure_ =
+      [](const HttpConnectionFailure &failure) {
+        return failure.phase() != HttpConnectionPhase::Setup &&
+               failure.phase() != HttpConnectionPhase::Tls;
+      };
+  std::chrono::milliseconds base_delay_{50};
+  std::chrono::milliseconds max_delay_{2000};
+  std::chrono::milliseconds max_retry_after_{30000};
+  bool non_idempotent_ = false;
+  std::function<void(const RetryAttempt &)> attempt_callback_;
+  std::shared_ptr<State> state_;
+
+  void deposit() const {
+    int64_t tokens = state_->tokens.load(std::memory_order_relaxed);
+    while (tokens < state_->capacity &&
+           !state_->tokens.compare_exchange_weak(
+               tokens, std::min(state_->capacity, tokens + state_->deposit),
+               std::memory_order_relaxed)) {
+    }
+  }
+
+  bool withdraw() const {
+    int64_t tokens = state_->tokens.load(std::memory_order_relaxed);
+    while (tokens >= TOKEN) {
+      if (state_->tokens.compare_exchange_weak(tokens, tokens - TOKEN,
+                                               std::memory_order_relaxed)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // The wait before retrying the result, or nothing when it must not be
+  // retried. Backoff is min(cap, random(base, previous * 3)).
+  [[nodiscard]] std::optional<std::chrono::milliseconds>
+  next_delay(const HttpResult &result,
+             std::chrono::milliseconds previous) const {
+    std::optional<HttpFailure> failure = result.failure();
+    std::optional<HttpSuccess> success = result.success();
+    const HttpResponse *response =
+        success ? &success->value()
+                : std::get_if<HttpResponse>(&failure->value());
+    const auto *connection =
+        failure ? std::get_if<HttpConnectionFailure>(&failure->value())
+                : nullptr;
+    if (!(response && retryable_status_(response->status)) &&
+        !(connection && retryable_failure_(*connection))) {
+      return std::nullopt;
+    }
+
+    thread_local std::mt19937_64 engine{std::random_device{}()};
+    std::uniform_int_distribution<int64_t> jitter(
+        base_delay_.count(), std::max(base_delay_, previous * 3).count());
+    std::chrono::milliseconds backoff =
+        std::min(max_delay_, std::chrono::milliseconds{jitter(engine)});
+    if (response) {
+      if (std::optional<std::chrono::milliseconds> wait =
+              retry_after(response->headers.value())) {
+        if (*wait > max_retry_after_) {
+          return std::nullopt;
+        }
+        backoff = std::max(backoff, *wait);
+      }
+    }
+    return backoff;
+  }
+};
+
+struct HedgingStatistics final {
+  uint64_t requests;
+  uint64_t hedges;
+  uint64_t hedge_wins;
+};
+
+// When to send a second, identical request while the first is still
+// outstanding. The hedge goes out after a fixed delay, or after the given
+// quantile of recently observed latencies for the endpoint once enough
+// have been seen. Copies of a policy share observations and statistics.
+struct HedgingPolicy final {
+  HedgingPolicy() : state_(std::make_shared<State>()) {}
+
+  HedgingPolicy &with_delay(std::chrono::milliseconds delay) {
+    delay_ = delay;
+    return *this;
+  }
+
+  // Bounds the threads a client runs hedged transfers on. While all of them
+  // are busy, requests are sent from the calling thread without a hedge.
+  HedgingPolicy &with_max_threads(size_t threads) {
+    max_threads_ = std::max<size_t>(threads, 1);
+    return *this;
+  }
+
+  [[nodiscard]] size_t max_threads() const { return max_threads_; }
+
+  // Uses the quantile (e.g. 0.95) of the last `window` latencies of an
+  // endpoint once at least a tenth of the window has been observed.
+  HedgingPolicy &with_quantile_delay(double quantile, size_t window = 100) {
+    quantile_ = std::clamp(quantile, 0.0, 1.0);
+    window_ = std::max<size_t>(window, 1);
+    return *this;
+  }
+
+  [[nodiscard]] HedgingStatistics statistics() const {
+    return HedgingStatistics{
+        state_->requests.load(std::memory_order_relaxed),
+        state_->hedges.load(std::memory_order_relaxed),
+        state_->hedge_wins.load(std::memory_order_relaxed)};
+  }
+
+  [[nodiscard]] std::chrono::microseconds
+  delay(const std::string &endpoint) const {
+    if (quantile_) {
+      std::lock_guard<std::mutex> lock(state_->mutex);
+      auto found = state_->latencies.find(endpoint);
+      if (found != state_->latencies.end() &&
+          found->second.size() >= std::max<size_t>(window_ / 10, 1)) {
+        std::vector<std::chrono::microseconds> sorted(found->second.begin(),
+                                                      found->second.end());
+        auto nth = sorted.begin() +
+                   static_cast<std::ptrdiff_t>(*quantile_ * (sorted.size() - 1));
+        std::nth_element(sorted.begin(), nth, sorted.end());
+        return *nth;
+      }
+    }
+    return delay_;
+  }
+
+  void observe(const std::string &endpoint, std::chrono::microseconds latency,
+               bool hedge_won) const {
+    if (hedge_won) {
+      state_->hedge_wins.fetch_add(1, std::memory_order_relaxed);
+    }
+    if (quantile_) {
+      std::lock_guard<std::mutex> lock(state_->mutex);
+      std::deque<std::chrono::microseconds> &latencies =
+          state_->latencies[endpoint];
+      latencies.push_back(latency);
+      if (latencies.size() > window_) {
+        latencies.pop_front();
+      }
+    }
+  }
+
+  void record_request(bool hedged) const {
+    state_->requests.fetch_add(1, std::memory_order_relaxed);
+    if (hedged) {
+      state_->hedges.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+
+private:
+  struct State final {
+    std::mutex mutex;
+    std::unordered_map<std::string, std::deque<std::chrono::microseconds>>
+        latencies;
+    std::atomic<uint64_t> requests{0};
+    std::atomic<uint64_t> hedges{0};
+    std::atomic<uint64_t> hedge_wins{0};
+  };
+
+  std::chrono::milliseconds delay_{50};
+  std::optional<double> quantile_;
+  size_t window_ = 100;
+  size_t max_threads_ = 32;
+  std::shared_ptr<State> state_;
+};
+
+// Runs tasks on at most max_threads joinable threads, started as needed and
+// kept for reuse. A task is refused rather than queued when every thread is
+// busy. Destruction waits for running tasks to finish.
+struct WorkerPool final {
+  explicit WorkerPool(size_t max_threads)
+      : max_threads_(std::max<size_t>(max_threads, 1)) {}
+
+  WorkerPool(const WorkerPool &) = delete;
+  WorkerPool &operator=(const WorkerPool &) = delete;
+
+  ~WorkerPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+    }
+    wake_.notify_all();
+    for (std::thread &thread : threads_) {
+      thread.join();
+    }
+  }
+
+  // False when the task could not be given a thread of its own.
+  [[nodiscard]] bool try_run(std::function<void()> task) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (stopping_ || (idle_ == 0 && threads_.size() >= max_threads_)) {
+      return false;
+    }
+    if (idle_ == 0) {
+      threads_.emplace_back([this] { run(); });
+      idle_ += 1;
+    }
+    idle_ -= 1;
+    tasks_.push_back(std::move(task));
+    wake_.notify_one();
+    return true;
+  }
+
+private:
+  const size_t max_threads_;
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  std::deque<std::function<void()>> tasks_;
+  std::vector<std::thread> threads_;
+  size_t idle_ = 0;
+  bool stopping_ = false;
+
+  void run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (;;) {
+      wake_.wait(lock, [this] { return stopping_ || !tasks_.empty(); });
+      if (tasks_.empty()) {
+        return;
+      }
+
+      std::function<void()> task = std::move(tasks_.front());
+      tasks_.pop_front();
+      lock.unlock();
+      task();
+      task = nullptr;
+      lock.lock();
+      idle_ += 1;
+    }
+  }
+};
+
+// A fixed capacity map from host to T that is read and grown without
+// locks: open addressing over atomic pointers, with entries only ever
+// added. Once full, hosts that are not yet present are not found.
+template <class T> struct HostTable final {
+  explicit HostTable(size_t capacity)
+      : capacity_(round_up_to_power_of_two(capacity)),
+        slots_(new std::atomic<Entry *>[capacity_]) {
+    for (size_t i = 0; i < capacity_; ++i) {
+      slots_[i].store(nullptr, std::memory_order_relaxed);
+    }
+  }
+
+  HostTable(const HostTable &) = delete;
+  HostTable &operator=(const HostTable &) = delete;
+
+  ~HostTable() {
+    for (size_t i = 0; i < capacity_; ++i) {
+      delete slots_[i].load(std::memory_order_relaxed);
+    }
+  }
+
+  [[nodiscard]] T *find(const std::string &host) const {
+    return lookup(host, [] { return std::unique_ptr<Entry>(); });
+  }
+
+  // Finds the host's entry, constructing it from args when missing.
+  template <class... Args>
+  [[nodiscard]] T *find_or_emplace(const std::string &host, Args &&...args) {
+    return lookup(host, [&] {
+      return std::make_unique<Entry>(host, std::forward<Args>(args)...);
+    });
+  }
+
+private:
+  struct Entry final {
+    template <class... Args>
+    explicit Entry(std::string host, Args &&...args)
+        : host(std::move(host)), value(std::forward<Args>(args)...) {}
+
+    const std::string host;
+    T value;
+  };
+
+  size_t capacity_;
+  std::unique_ptr<std::atomic<Entry *>[]> slots_;
+
+  static size_t round_up_to_power_of_two(size_t value) {
+    size_t power = 1;
+    while (power < value) {
+      power <<= 1;
+    }
+    return power;
+  }
+
+  template <class Make> T *lookup(const std::string &host, Make make) const {
+    const size_t start = std::hash<std::string>{}(host) & (capacity_ - 1);
+    for (size_t probe = 0; probe < capacity_; ++probe) {
+      std::atomic<Entry *> &slot = slots_[(start + probe) & (capacity_ - 1)];
+      Entry *entry = slot.load(std::memory_order_acquire);
+      if (entry == nullptr) {
+        std::unique_ptr<Entry> created = make();
+        if (!created) {
+          return nullptr;
+        }
+        if (slot.compare_exchange_strong(entry, created.get(),
+                                         std::memory_order_acq_rel)) {
+          return &created.release()->value;
+        }
+      }
+      if (entry->host == host) {
+        return &entry->value;
+      }
+    }
+    return nullptr;
+  }
+};
+
+enum class CircuitState { Closed, Open, HalfOpen };
+
+// Stops sending requests to a host whose recent failure rate crossed a
+// threshold. Outcomes are counted in a rolling window of one second
+// buckets. Once at least the minimum number of requests in the window
+// failed at the threshold rate, the circuit opens and requests fail fast
+// with HttpAbortReason::CircuitOpen. After the open duration a limited
+// number of probes are let through, and the circuit closes once they all
+// succeed or opens again on the first failure. Hosts live in a HostTable
+// and their state in atomics, so admitting a request never takes a lock;
+// hosts beyond the table's capacity are not tracked.
+struct CircuitBreaker final {
+  using TransitionCallback =
+      std::function<void(const Host &host, CircuitState from, CircuitState to)>;
+
+  // Whether a request was admitted, and whether it is a half-open probe.
+  enum class Permit { Rejected, Allowed, Probe };
+
+  explicit CircuitBreaker(size_t max_hosts = 1024) : circuits_(max_hosts) {}
+
+  CircuitBreaker &with_failure_rate_threshold(double rate) {
+    failure_rate_threshold_ = rate;
+    return *this;
+  }
+
+  CircuitBreaker &with_minimum_requests(uint32_t requests) {
+    minimum_requests_ = requests;
+    return *this;
+  }
+
+  // The rolling window, in whole seconds up to WINDOW_BUCKETS.
+  CircuitBreaker &with_window(std::chrono::seconds window) {
+    window_buckets_ = static_cast<int64_t>(
+        std::clamp<int64_t>(window.count(), 1, WINDOW_BUCKETS));
+    return *this;
+  }
+
+  CircuitBreaker &with_open_duration(std::chrono::milliseconds duration) {
+    open_duration_ = duration;
+    return *this;
+  }
+
+  CircuitBreaker &with_half_open_probes(uint32_t probes) {
+    half_open_probes_ = std::max<uint32_t>(probes, 1);
+    return *this;
+  }
+
+  // Responses with these statuses count as failures; connection failures
+  // always do.
+  CircuitBreaker &with_failure_status(StatusCodeSet statuses) {
+    failure_status_ = statuses;
+    return *this;
+  }
+
+  // Called on the thread that caused each transition.
+  CircuitBreaker &with_transition_callback(TransitionCallback callback) {
+    transition_callback_ = std::move(callback);
+    return *this;
+  }
+
+  [[nodiscard]] CircuitState state(const Host &host) const {
+    const Circuit *circuit = circuits_.find(host.value());
+    return circuit ? circuit->state.load(std::memory_order_acquire)
+                   : CircuitState::Closed;
+  }
+
+  [[nodiscard]] Permit admit(const Host &host) {
+    Circuit *circuit = circuits_.find_or_emplace(host.value(), host.value());
+    if (circuit == nullptr) {
+      return Permit::Allowed;
+    }
+
+    CircuitState state = circuit->state.load(std::memory_order_acquire);
+    if (state == CircuitState::Closed) {
+      return Permit::Allowed;
+    }
+    if (state == CircuitState::Open) {
+      // Restarting the open period claims the move to half-open, so the
+      // probe counters are reset by one thread and before any probe is
+      // admitted; others are rejected until the state is published.
+      int64_t opened_at = circuit->opened_at.load(std::memory_order_acquire);
+      const int64_t at = now();
+      if (at - opened_at < open_duration_.count() ||
+          !circuit->opened_at.compare_exchange_strong(
+              opened_at, at, std::memory_order_acq_rel)) {
+        return Permit::Rejected;
+      }
+      circuit->probes.store(0, std::memory_order_relaxed);
+      circuit->probe_successes.store(0, std::memory_order_relaxed);
+      (void)transition(*circuit, CircuitState::Open, CircuitState::HalfOpen);
+    }
+
+    if (circuit->probes.fetch_add(1, std::memory_order_acq_rel) <
+        half_open_probes_) {
+      return Permit::Probe;
+    }
+    return Permit::Rejected;
+  }
+
+  // Records the outcome of an admitted request. Requests the client gave up
+  // on, including hedges cancelled once the other leg won, say nothing
+  // about the host: they are not counted and an aborted probe frees its
+  // slot.
+  void record(const Host &host, Permit permit, const HttpResult &result) {
+    Circuit *circuit = circuits_.find(host.value());
+    if (circuit == nullptr || permit == Permit::Rejected) {
+      return;
+    }
+    if (aborted(result)) {
+      // A probe admitted before the circuit last reopened may find the
+      // count already reset.
+      uint32_t probes = circuit->probes.load(std::memory_order_acquire);
+      while (permit == Permit::Probe && probes > 0 &&
+             !circuit->probes.compare_exchange_weak(
+                 probes, probes - 1, std::memory_order_acq_rel)) {
+      }
+      return;
+    }
+
+    const bool failed = failure(result);
+    if (permit == Permit::Probe) {
+      if (failed) {
+        circuit->opened_at.store(now(), std::memory_order_release);
+        (void)transition(*circuit, CircuitState::HalfOpen, CircuitState::Open);
+      } else if (circuit->probe_successes.fetch_add(
+                     1, std::memory_order_acq_rel) +
+                     1 ==
+                 half_open_probes_) {
+        reset(*circuit);
+        (void)transition(*circuit, CircuitState::HalfOpen,
+                         CircuitState::Closed);
+      }
+      return;
+    }
+
+    const int64_t second = now() / 1000;
+    Bucket &bucket = circuit->buckets[second % WINDOW_BUCKETS];
+    int64_t epoch = bucket.epoch.load(std::memory_order_acquire);
+    if (epoch != second &&
+        bucket.epoch.compare_exchange_strong(epoch, second,
+                                             std::memory_order_acq_rel)) {
+      bucket.successes.store(0, std::memory_order_relaxed);
+      bucket.failures.store(0, std::memory_order_relaxed);
+    }
+    (failed ? bucket.failures : bucket.successes)
+        .fetch_add(1, std::memory_order_relaxed);
+    if (!failed) {
+      return;
+    }
+
+    uint64_t successes = 0;
+    uint64_t failures = 0;
+    for (const Bucket &b : circuit->buckets) {
+      if (second - b.epoch.load(std::memory_order_acquire) < window_buckets_) {
+        successes += b.successes.load(std::memory_order_relaxed);
+        failures += b.failures.load(std::memory_order_relaxed);
+      }
+    }
+    if (successes + failures >= minimum_requests_ &&
+        static_cast<double>(failures) >=
+            failure_rate_threshold_ *
+                static_cast<double>(successes + failures) &&
+        circuit->state.load(std::memory_order_acquire) ==
+            CircuitState::Closed) {
+      circuit->opened_at.store(now(), std::memory_order_release);
+      (void)transition(*circuit, CircuitState::Closed, CircuitState::Open);
+    }
+  }
+
+private:
+  static constexpr int64_t WINDOW_BUCKETS = 60;
+
+  struct Bucket final {
+    std::atomic<int64_t> epoch{std::numeric_limits<int64_t>::min() / 2};
+    std::atomic<uint32_t> successes{0};
+    std::atomic<uint32_t> failures{0};
+  };
+
+  struct Circuit final {
+    explicit Circuit(std::string host) : host(std::move(host)) {}
+
+    const std::string host;
+    std::atomic<CircuitState> state{CircuitState::Closed};
+    std::atomic<int64_t> opened_at{0};
+    std::atomic<uint32_t> probes{0};
+    std::atomic<uint32_t> probe_successes{0};
+    Bucket buckets[WINDOW_BUCKETS];
+  };
+
+  HostTable<Circuit> circuits_;
+  double failure_rate_threshold_ = 0.5;
+  uint32_t minimum_requests_ = 20;
+  int64_t window_buckets_ = 10;
+  std::chrono::milliseconds open_duration_{5000};
+  uint32_t half_open_probes_ = 3;
+  StatusCodeSet failure_status_ = StatusCodeSet::range(500, 599);
+  TransitionCallback transition_callback_;
+
+  static int64_t now() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+  }
+
+  bool failure(const HttpResult &result) const {
+    std::optional<HttpFailure> failure = result.failure();
+    std::optional<HttpSuccess> success = result.success();
+    const HttpResponse *response =
+        success ? &success->value()
+                : std::get_if<HttpResponse>(&failure->value());
+    return response ? failure_status_(response->status)
+                    : std::holds_alternative<HttpConnectionFailure>(
+                          failure->value());
+  }
+
+  static bool aborted(const HttpResult &result) {
+    std::optional<HttpFailure> failure = result.failure();
+    if (!failure) {
+      return false;
+    }
+    if (const auto *connection =
+            std::get_if<HttpConnectionFailure>(&failure->value())) {
+      return connection->code() == CURLE_ABORTED_BY_CALLBACK;
+    }
+    return std::holds_alternative<HttpRequestAborted>(failure->value());
+  }
+
+  static void reset(Circuit &circuit) {
+    for (Bucket &bucket : circuit.buckets) {
+      bucket.successes.store(0, std::memory_order_relaxed);
+      bucket.failures.store(0, std::memory_order_relaxed);
+    }
+  }
+
+  bool transition(Circuit &circuit, CircuitState from, CircuitState to) {
+    if (!circuit.state.compare_exchange_strong(from, to,
+                                               std::memory_order_acq_rel)) {
+      return false;
+    }
+    if (transition_callback_) {
+      transition_callback_(Host{circuit.host}, from, to);
+    }
+    return true;
+  }
+};
+
+// Keeps warm connections, DNS results and TLS sessions for transfers on any
+// thread. libcurl does not allow a connection cache to be used by concurrent
+// threads, so the pool holds a set of share handles and each transfer has
+// one to itself; a later transfer reuses what an earlier one left behind.
+// The most recently returned handle is handed out first, and the set grows
+// to the peak number of concurrent transfers.
+struct ConnectionPool final {
+  ConnectionPool() = default;
+
+  ConnectionPool(const ConnectionPool &) = delete;
+  ConnectionPool &operator=(const ConnectionPool &) = delete;
+
+  ~ConnectionPool() {
+    for (CURLSH *share : idle_) {
+      curl_share_cleanup(share);
+    }
+  }
+
+  // A share handle for the caller alone. It goes back to the pool when the
+  // last reference is dropped, which must be after the easy handles using
+  // it have been cleaned up.
+  [[nodiscard]] std::shared_ptr<CURLSH> acquire() {
+    CURLSH *share = nullptr;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (!idle_.empty()) {
+        share = idle_.back();
+        idle_.pop_back();
+      }
+    }
+    if (share == nullptr) {
+      share = curl_share_init();
+      curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+      curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+#if LIBCURL_VERSION_NUM >= 0x073900
+      curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+#endif
+    }
+    return std::shared_ptr<CURLSH>(share, [this](CURLSH *released) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      idle_.push_back(released);
+    });
+  }
+
+  // Share handles not currently used by a transfer.
+  [[nodiscard]] size_t idle() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return idle_.size();
+  }
+
+private:
+  mutable std::mutex mutex_;
+  std::vector<CURLSH *> idle_;
+};
+
+enum class LoadBalancing { RoundRobin, LeastOutstanding, PeakEwma };
+
+struct UpstreamStatistics final {
+  Host host;
+  uint64_t requests;
+  uint64_t outstanding;
+  std::chrono::microseconds latency;
+};
+
+// Several interchangeable backends behind one logical service name. Client
+// sends requests for the service to one backend chosen per attempt: with
+// the least outstanding requests, or the lowest peak latency EWMA weighted
+// by outstanding requests, between two picked at random (power of two
+// choices). A sample slower than the EWMA replaces it at once, and faster
+// ones then decay it. Failed connections count as a slow response so a
+// backend that refuses quickly does not attract traffic.
+struct UpstreamGroup final {
+  UpstreamGroup(Host service, std::vector<Host> backends,
+                LoadBalancing strategy = LoadBalancing::LeastOutstanding)
+      : service_(std::move(service)), strategy_(strategy) {
+    for (Host &host : backends) {
+      backends_.push_back(std::make_unique<Backend>(std::move(host)));
+    }
+  }
+
+  // The weight of each sample faster than the latency EWMA.
+  UpstreamGroup &with_ewma_weight(double weight) {
+    ewma_weight_ = std::clamp(weight, 0.0, 1.0);
+    return *this;
+  }
+
+  UpstreamGroup &with_failure_penalty(std::chrono::microseconds penalty) {
+    failure_penalty_ = penalty;
+    return *this;
+  }
+
+  [[nodiscard]] const Host &service() const { return service_; }
+
+  [[nodiscard]] size_t size() const { return backends_.size(); }
+
+  [[nodiscard]] const Host &host(size_t backend) const {
+    return backends_[backend]->host;
+  }
+
+  // The backend for the next attempt, or none when the group is empty.
+  [[nodiscard]] std::optional<size_t> choose() {
+    const size_t count = backends_.size();
+    if (count == 0) {
+      return std::nullopt;
+    }
+    if (count == 1) {
+      return 0;
+    }
+    if (strategy_ == LoadBalancing::RoundRobin) {
+      return next_.fetch_add(1, std::memory_order_relaxed) % count;
+    }
+
+    thread_local std::mt19937_64 engine{std::random_device{}()};
+    const size_t first = std::uniform_int_distribution<size_t>(0, count - 1)(engine);
+    size_t second = std::uniform_int_distribution<size_t>(0, count - 2)(engine);
+    second += second >= first ? 1 : 0;
+    return load(second) < load(first) ? second : first;
+  }
+
+  void start(size_t backend) {
+    backends_[backend]->outstanding.fetch_add(1, std::memory_order_relaxed);
+    backends_[backend]->requests.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  void finish(size_t backend, std::chrono::microseconds latency, bool failed) {
+    Backend &b = *backends_[backend];
+    b.outstanding.fetch_sub(1, std::memory_order_relaxed);
+
+    const double sample = static_cast<double>(
+        (failed ? std::max(latency, failure_penalty_) : latency).count());
+    double ewma = b.ewma.load(std::memory_order_relaxed);
+    while (!b.ewma.compare_exchange_weak(
+        ewma, std::max(sample, ewma + ewma_weight_ * (sample - ewma)),
+        std::memory_order_relaxed)) {
+    }
+  }
+
+  [[nodiscard]] std::vector<UpstreamStatistics> statistics() const {
+    std::vector<UpstreamStatistics> statistics;
+    for (const auto &b : backends_) {
+      statistics.push_back(UpstreamStatistics{
+          b->host, b->requests.load(std::memory_order_relaxed),
+          b->outstanding.load(std::memory_order_relaxed),
+          std::chrono::microseconds{static_cast<int64_t>(
+              b->ewma.load(std::memory_order_relaxed))}});
+    }
+    return statistics;
+  }
+
+private:
+  struct Backend final {
+    explicit Backend(Host host) : host(std::move(host)) {}
+
+    const Host host;
+    std::atomic<uint64_t> outstanding{0};
+    std::atomic<uint64_t> requests{0};
+    std::atomic<double> ewma{0};
+  };
+
+  Host service_;
+  LoadBalancing strategy_;
+  std::vector<std::unique_ptr<Backend>> backends_;
+  std::atomic<uint64_t> next_{0};
+  double ewma_weight_ = 0.3;
+  std::chrono::microseconds failure_penalty_{1000000};
+
+  [[nodiscard]] double load(size_t backend) const {
+    const Backend &b = *backends_[backend];
+    const auto outstanding =
+        static_cast<double>(b.outstanding.load(std::memory_order_relaxed));
+    if (strategy_ == LoadBalancing::PeakEwma) {
+      return b.ewma.load(std::memory_order_relaxed) * (outstanding + 1);
+    }
+    return outstanding;
+  }
+};
+
+// The wait, shortened to the time left before the deadline.
+inline static std::chrono::nanoseconds
+within_deadline(std::chrono::nanoseconds wait,
+                const std::optional<std::chrono::steady_clock::time_point> &deadline) {
+  if (!deadline) {
+    return wait;
+  }
+  return std::clamp<std::chrono::nanoseconds>(
+      *deadline - std::chrono::steady_clock::now(),
+      std::chrono::nanoseconds{0}, wait);
+}
+
+enum class LimitAlgorithm { Aimd, Gradient };
+
+// Caps the requests in flight to each host at a limit that adapts to how
+// the host responds, in the manner of Netflix's concurrency-limits.
+//
+// Aimd adds one to the limit for every success while the limit is in use
+// and multiplies it by the backoff ratio on a drop: a connection failure,
+// a 429 or 503, or a round trip slower than the drop timeout.
+//
+// Gradient compares every round trip with a slowly moving average of past
+// ones. As latency rises above the average times the tolerance, the limit
+// shrinks proportionally; otherwise it grows by its square root, which
+// leaves room for a small queue at the host.
+//
+// Requests over the limit wait up to the queue timeout for a slot, and
+// then fail with HttpAbortReason::ConcurrencyLimited.
+struct ConcurrencyLimiter final {
+  explicit ConcurrencyLimiter(LimitAlgorithm algorithm = LimitAlgorithm::Gradient)
+      : algorithm_(algorithm) {}
+
+  ConcurrencyLimiter &with_limits(uint32_t initial, uint32_t minimum,
+                                  uint32_t maximum) {
+    minimum_ = std::max<uint32_t>(minimum, 1);
+    maximum_ = std::max(maximum, minimum_);
+    initial_ = std::clamp(initial, minimum_, maximum_);
+    return *this;
+  }
+
+  // How long a request over the limit may wait for a slot. Zero rejects it
+  // at once.
+  ConcurrencyLimiter &with_queue_timeout(std::chrono::milliseconds timeout) {
+    queue_timeout_ = timeout;
+    return *this;
+  }
+
+  ConcurrencyLimiter &with_backoff_ratio(double ratio) {
+    backoff_ratio_ = std::clamp(ratio, 0.1, 1.0);
+    return *this;
+  }
+
+  ConcurrencyLimiter &with_drop_timeout(std::chrono::milliseconds timeout) {
+    drop_timeout_ = timeout;
+    return *this;
+  }
+
+  // How far round trips may rise above their average before the gradient
+  // limit shrinks.
+  ConcurrencyLimiter &with_tolerance(double tolerance) {
+    tolerance_ = std::max(tolerance, 1.0);
+    return *this;
+  }
+
+  [[nodiscard]] uint32_t limit(const Host &host) {
+    HostLimit &state = host_limit(host);
+    std::lock_guard<std::mutex> lock(state.mutex);
+    return static_cast<uint32_t>(state.limit);
+  }
+
+  [[nodiscard]] uint32_t in_flight(const Host &host) {
+    HostLimit &state = host_limit(host);
+    std::lock_guard<std::mutex> lock(state.mutex);
+    return state.in_flight;
+  }
+
+  // Takes a slot for a request to the host, waiting for one when allowed,
+  // but not past the deadline or once the token is cancelled. Every
+  // successful acquire must be followed by a release.
+  [[nodiscard]] bool
+  acquire(const Host &host,
+          const std::optional<std::chrono::steady_clock::time_point> &deadline =
+              std::nullopt,
+          const std::optional<CancellationToken> &cancellation =
+              std::nullopt) {
+    HostLimit &state = host_limit(host);
+    std::unique_lock<std::mutex> lock(state.mutex);
+    auto available = [&] {
+      return state.in_flight < static_cast<uint32_t>(state.limit);
+    };
+    const auto until = std::chrono::steady_clock::now() +
+                       within_deadline(queue_timeout_, deadline);
+    // Cancelling does not signal the limiter, so a cancellable wait checks
+    // the token every few milliseconds.
+    while (!available()) {
+      const auto now = std::chrono::steady_clock::now();
+      if (now >= until || (cancellation && cancellation->cancelled())) {
+        return false;
+      }
+      state.released.wait_until(
+          lock, cancellation ? std::min(until, now + CANCELLATION_POLL) : until);
+    }
+    state.in_flight += 1;
+    return true;
+  }
+
+  void release(const Host &host, std::chrono::microseconds rtt,
+               const HttpResult &result) {
+    HostLimit &state = host_limit(host);
+    std::lock_guard<std::mutex> lock(state.mutex);
+    const uint32_t in_flight = state.in_flight;
+    state.in_flight -= 1;
+    const bool limited = 2 * in_flight >= static_cast<uint32_t>(state.limit);
+
+    if (algorithm_ == LimitAlgorithm::Aimd) {
+      if (dropped(result) || rtt > drop_timeout_) {
+        state.limit = state.limit * backoff_ratio_;
+      } else if (limited) {
+        state.limit += 1;
+      }
+    } else if (!dropped(result)) {
+      const auto sample = static_cast<double>(std::max<int64_t>(rtt.count(), 1));
+      state.average_rtt = state.average_rtt == 0
+                              ? sample
+                              : state.average_rtt +
+                                    (sample - state.average_rtt) / 100;
+      const double gradient =
+          std::clamp(tolerance_ * state.average_rtt / sample, 0.5, 1.0);
+      const double target = state.limit * gradient + std::sqrt(state.limit);
+      if (target < state.limit || limited) {
+        state.limit = state.limit * 0.8 + target * 0.2;
+      }
+    } else {
+      state.limit = state.limit * 0.5;
+    }
+    state.limit = std::clamp(state.limit, static_cast<double>(minimum_),
+                             static_cast<double>(maximum_));
+    state.released.notify_one();
+  }
+
+private:
+  static constexpr std::chrono::milliseconds CANCELLATION_POLL{10};
+
+  struct HostLimit final {
+    explicit HostLimit(double limit) : limit(limit) {}
+
+    std::mutex mutex;
+    std::condition_variable released;
+    double limit;
+    uint32_t in_flight = 0;
+    double average_rtt = 0;
+  };
+
+  LimitAlgorithm algorithm_;
+  uint32_t initial_ = 20;
+  uint32_t minimum_ = 1;
+  uint32_t maximum_ = 1000;
+  std::chrono::milliseconds queue_timeout_{0};
+  double backoff_ratio_ = 0.9;
+  std::chrono::milliseconds drop_timeout_{5000};
+  double tolerance_ = 1.5;
+  std::mutex mutex_;
+  std::unordered_map<std::string, std::unique_ptr<HostLimit>> hosts_;
+
+  HostLimit &host_limit(const Host &host) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::unique_ptr<HostLimit> &state = hosts_[host.value()];
+    if (!state) {
+      state = std::make_unique<HostLimit>(initial_);
+    }
+    return *state;
+  }
+
+  static bool dropped(const HttpResult &result) {
+    std::optional<HttpFailure> failure = result.failure();
+    if (!failure) {
+      return false;
+    }
+    const auto *response = std::get_if<HttpResponse>(&failure->value());
+    return response ? response->status == TOO_MANY_REQUESTS ||
+                          response->status == SERVICE_UNAVAILABLE
+                    : std::holds_alternative<HttpConnectionFailure>(
+                          failure->value());
+  }
+};
+
+// A token bucket kept as a single atomic "theoretical arrival time" (the
+// generic cell rate algorithm): taking a token advances it by one
+// interval, and a token is available while it is at most a burst ahead of
+// now.
+struct TokenBucket final {
+  TokenBucket(double per_second, double burst)
+      : interval_(static_cast<int64_t>(1e9 / std::max(per_second, 1e-9))),
+        burst_(static_cast<int64_t>(std::max(burst, 1.0) *
+                                    static_cast<double>(interval_))) {}
+
+  // Takes a token if one is available within max_wait and returns how long
+  // to wait before using it.
+  [[nodiscard]] std::optional<std::chrono::nanoseconds>
+  reserve(std::chrono::nanoseconds max_wait) {
+    const int64_t now = clock();
+    int64_t tat = tat_.load(std::memory_order_relaxed);
+    for (;;) {
+      const int64_t next = std::max(tat, now) + interval_;
+      const int64_t wait = next - burst_ - now;
+      if (wait > max_wait.count()) {
+        return std::nullopt;
+      }
+      if (tat_.compare_exchange_weak(tat, next, std::memory_order_relaxed)) {
+        return std::chrono::nanoseconds{std::max<int64_t>(wait, 0)};
+      }
+    }
+  }
+
+  // Gives back a token taken by reserve.
+  void refund() { tat_.fetch_sub(interval_, std::memory_order_relaxed); }
+
+  // Hands out no tokens before the given time.
+  void pause_until(std::chrono::steady_clock::time_point until) {
+    const int64_t tat =
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+            until.time_since_epoch())
+            .count() +
+        burst_ - interval_;
+    int64_t current = tat_.load(std::memory_order_relaxed);
+    while (current < tat && !tat_.compare_exchange_weak(
+                                current, tat, std::memory_order_relaxed)) {
+    }
+  }
+
+  // Empties the bucket so that tokens arrive at the steady rate from now.
+  void drain() {
+    pause_until(std::chrono::steady_clock::now());
+  }
+
+private:
+  int64_t interval_;
+  int64_t burst_;
+  std::atomic<int64_t> tat_{0};
+
+  static int64_t clock() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+  }
+};
+
+// Keeps the request rate to each host, and optionally of the whole client,
+// within token bucket quotas. A request that cannot get a token within the
+// maximum wait fails with HttpAbortReason::RateLimited; with no wait it is
+// rejected at once. A 429 pauses the host's bucket until its Retry-After,
+// or empties it when there is none, so traffic settles at the quota rather
+// than bursting into penalties. Configure the limiter before sharing it.
+struct RateLimiter final {
+  explicit RateLimiter(size_t max_hosts = 1024) : buckets_(max_hosts) {}
+
+  RateLimiter &with_global_rate(double per_second, double burst) {
+    global_.emplace(per_second, burst);
+    return *this;
+  }
+
+  // The quota of every host without one of its own.
+  RateLimiter &with_host_rate(double per_second, double burst) {
+    default_rate_ = Rate{per_second, burst};
+    return *this;
+  }
+
+  RateLimiter &with_host_rate(const Host &host, double per_second,
+                              double burst) {
+    rates_.insert_or_assign(host.value(), Rate{per_second, burst});
+    return *this;
+  }
+
+  RateLimiter &with_max_wait(std::chrono::milliseconds wait) {
+    max_wait_ = wait;
+    return *this;
+  }
+
+  // Takes a token for the host and from the global bucket, sleeping until
+  // they are due. False when either is not available within the maximum
+  // wait or before the deadline, or when the token is cancelled during the
+  // sleep; the tokens are given back then.
+  [[nodiscard]] bool
+  acquire(const Host &host,
+          const std::optional<std::chrono::steady_clock::time_point> &deadline =
+              std::nullopt,
+          const std::optional<CancellationToken> &cancellation =
+              std::nullopt) {
+    TokenBucket *bucket = host_bucket(host);
+    const std::chrono::nanoseconds max_wait =
+        within_deadline(max_wait_, deadline);
+    std::chrono::nanoseconds wait{0};
+    if (bucket) {
+      std::optional<std::chrono::nanoseconds> reserved =
+          bucket->reserve(max_wait);
+      if (!reserved) {
+        return false;
+      }
+      wait = *reserved;
+    }
+    if (global_) {
+      std::optional<std::chrono::nanoseconds> reserved =
+          global_->reserve(max_wait);
+      if (!reserved) {
+        if (bucket) {
+          bucket->refund();
+        }
+        return false;
+      }
+      wait = std::max(wait, *reserved);
+    }
+
+    if (wait.count() > 0) {
+      if (!cancellation) {
+        std::this_thread::sleep_for(wait);
+      } else if (cancellation->wait_for(wait)) {
+        if (bucket) {
+          bucket->refund();
+        }
+        if (global_) {
+          global_->refund();
+        }
+        return false;
+      }
+    }
+    return true;
+  }
+
+  void observe(const Host &host, const HttpResult &result) {
+    std::optional<HttpFailure> failure = result.failure();
+    std::optional<HttpSuccess> success = result.success();
+    const HttpResponse *response =
+        success ? &success->value()
+        : failure ? std::get_if<HttpResponse>(&failure->value())
+                  : nullptr;
+    TokenBucket *bucket = host_bucket(host);
+    if (!response || !(response->status == TOO_MANY_REQUESTS) || !bucket) {
+      return;
+    }
+
+    if (std::optional<std::chrono::milliseconds> wait =
+            retry_after(response->headers.value())) {
+      bucket->pause_until(std::chrono::steady_clock::now() + *wait);
+    } else {
+      bucket->drain();
+    }
+  }
+
+private:
+  struct Rate final {
+    double per_second;
+    double burst;
+  };
+
+  HostTable<TokenBucket> buckets_;
+  std::optional<TokenBucket> global_;
+  std::optional<Rate> default_rate_;
+  std::unordered_map<std::string, Rate> rates_;
+  std::chrono::milliseconds max_wait_{0};
+
+  TokenBucket *host_bucket(const Host &host) {
+    auto rate = rates_.find(host.value());
+    if (rate == rates_.end() && !default_rate_) {
+      return nullptr;
+    }
+    const Rate &quota = rate != rates_.end() ? rate->second : *default_rate_;
+    return buckets_.find_or_emplace(host.value(), quota.per_second,
+                                    quota.burst);
+  }
+};
+
+// The latency phases the metrics registry keeps a histogram of. Total is
+// the whole transfer; the others are its parts from HttpTiming. Name lookup
+// and connect are only recorded for new connections and TLS only for
+// connections that made a handshake. FirstByte runs from the request being
+// sent to the first response byte, Transfer from there to the end.
+enum class LatencyPhase { Total, NameLookup, Connect, Tls, FirstByte, Transfer };
+
+inline static constexpr size_t LATENCY_PHASES = 6;
+
+struct LatencyPercentiles final {
+  std::chrono::microseconds p50;
+  std::chrono::microseconds p90;
+  std::chrono::microseconds p99;
+  std::chrono::microseconds p999;
+};
+
+// A log-linear histogram of microsecond latencies, in the style of
+// HdrHistogram: each power of two is split into 16 linear buckets, so a
+// value is known to within 1/16 of itself. Values from about 38 hours up
+// share the last bucket.
+struct LatencyHistogram final {
+  static constexpr size_t SUB_BUCKETS = 16;
+  static constexpr size_t BUCKETS = 544;
+
+  LatencyHistogram() : counts_(BUCKETS, 0) {}
+
+  [[nodiscard]] static size_t bucket(std::chrono::microseconds value) {
+    const uint64_t micros =
+        value.count() > 0 ? static_cast<uint64_t>(value.count()) : 0;
+    size_t shift = 0;
+    while ((micros >> shift) >= 2 * SUB_BUCKETS) {
+      ++shift;
+    }
+    return std::min<size_t>((shift + 1) * SUB_BUCKETS + (micros >> shift) -
+                                SUB_BUCKETS,
+                            BUCKETS - 1);
+  }
+
+  // The smallest value that falls into the bucket.
+  [[nodiscard]] static std::chrono::microseconds lower_bound(size_t bucket) {
+    if (bucket < 2 * SUB_BUCKETS) {
+      return std::chrono::microseconds{bucket};
+    }
+    const size_t shift = bucket / SUB_BUCKETS - 1;
+    return std::chrono::microseconds{
+        static_cast<int64_t>((bucket % SUB_BUCKETS + SUB_BUCKETS) << shift)};
+  }
+
+  // The largest value that falls into the bucket.
+  [[nodiscard]] static std::chrono::microseconds upper_bound(size_t bucket) {
+    return bucket + 1 < BUCKETS
+               ? lower_bound(bucket + 1) - std::chrono::microseconds{1}
+               : std::chrono::microseconds::max();
+  }
+
+  void record(std::chrono::microseconds value, uint64_t count = 1) {
+    counts_[bucket(value)] += count;
+    count_ += count;
+    sum_ += std::max<int64_t>(value.count(), 0) * count;
+  }
+
+  void add(size_t bucket, uint64_t count) {
+    counts_[bucket] += count;
+    count_ += count;
+  }
+
+  void add_sum(std::chrono::microseconds sum) { sum_ += sum.count(); }
+
+  void merge(const LatencyHistogram &other) {
+    for (size_t i = 0; i < BUCKETS; ++i) {
+      counts_[i] += other.counts_[i];
+    }
+    count_ += other.count_;
+    sum_ += other.sum_;
+  }
+
+  [[nodiscard]] uint64_t count() const { return count_; }
+
+  [[nodiscard]] uint64_t count(size_t bucket) const { return counts_[bucket]; }
+
+  [[nodiscard]] std::chrono::microseconds sum() const {
+    return std::chrono::microseconds{sum_};
+  }
+
+  // How many values are at most the bound. Exact when the bound is the
+  // upper bound of a bucket, otherwise its bucket is left out.
+  [[nodiscard]] uint64_t count_at_most(std::chrono::microseconds bound) const {
+    uint64_t total = 0;
+    for (size_t i = 0; i < BUCKETS && upper_bound(i) <= bound; ++i) {
+      total += counts_[i];
+    }
+    return total;
+  }
+
+  // The upper bound of the bucket holding the value at the quantile, or zero
+  // when nothing was recorded.
+  [[nodiscard]] std::chrono::microseconds percentile(double quantile) const {
+    if (count_ == 0) {
+      return std::chrono::microseconds{0};
+    }
+    const auto rank = std::max<uint64_t>(
+        1, static_cast<uint64_t>(std::ceil(quantile * count_)));
+    uint64_t seen = 0;
+    for (size_t i = 0; i < BUCKETS; ++i) {
+      seen += counts_[i];
+      if (seen >= rank) {
+        return upper_bound(i);
+      }
+    }
+    return upper_bound(BUCKETS - 1);
+  }
+
+  [[nodiscard]] LatencyPercentiles percentiles() const {
+    return LatencyPercentiles{percentile(0.5), percentile(0.9),
+                              percentile(0.99), percentile(0.999)};
+  }
+
+private:
+  std::vector<uint64_t> counts_;
+  uint64_t count_ = 0;
+  int64_t sum_ = 0;
+};
+
+// The merged metrics of one host, method and status class. The status
+// class is "2xx" and the like for responses, "failed" for connection
+// failures and "aborted" for transfers the client stopped.
+struct MetricsSeries final {
+  std::string host;
+  std::string method;
+  std::string status_class;
+  uint64_t reused_connections = 0;
+  uint64_t bytes_uploaded = 0;
+  uint64_t bytes_downloaded = 0;
+  std::array<LatencyHistogram, LATENCY_PHASES> latency;
+
+  [[nodiscard]] uint64_t requests() const {
+    return phase(LatencyPhase::Total).count();
+  }
+
+  [[nodiscard]] const LatencyHistogram &phase(LatencyPhase phase) const {
+    return latency[static_cast<size_t>(phase)];
+  }
+};
+
+// Collects latency histograms and counters of every transfer made by the
+// clients it is installed on. Each thread records into a shard of its own,
+// whose counters only that thread writes, so recording takes no lock and
+// no read-modify-write; snapshot() merges the shards. When a thread exits
+// its shard is folded into the registry's retired totals and freed, so
+// memory follows the threads that are alive rather than all that ever
+// recorded.
+struct MetricsRegistry final {
+  MetricsRegistry() : id_(next_id()), state_(std::make_shared<State>()) {}
+
+  MetricsRegistry(const MetricsRegistry &) = delete;
+  MetricsRegistry &operator=(const MetricsRegistry &) = delete;
+
+  // Records a transfer. Results without timing were never sent and are not
+  // recorded.
+  void record(const Host &host, std::string_view method,
+              const HttpResult &result) {
+    if (!result.timing()) {
+      return;
+    }
+
+    std::string key = host.value();
+    key += '\n';
+    key += method;
+    key += '\n';
+    key += status_class(result);
+    Shard &shard = local_shard();
+    auto found = shard.index.find(key);
+    Series *series;
+    if (found != shard.index.end()) {
+      series = found->second;
+    } else {
+      std::lock_guard<std::mutex> lock(shard.mutex);
+      series = &shard.series.emplace_back(key);
+      shard.index.emplace(std::move(key), series);
+    }
+
+    const HttpTiming &timing = *result.timing();
+    bump(series->bytes_uploaded, timing.bytes_uploaded);
+    bump(series->bytes_downloaded, timing.bytes_downloaded);
+    series->record(LatencyPhase::Total, timing.total);
+    if (timing.reused_connection) {
+      bump(series->reused_connections, 1);
+    } else {
+      series->record(LatencyPhase::NameLookup, timing.namelookup);
+      series->record(LatencyPhase::Connect,
+                     timing.connect - timing.namelookup);
+    }
+    if (timing.appconnect.count() > 0) {
+      series->record(LatencyPhase::Tls, timing.appconnect - timing.connect);
+    }
+    if (timing.starttransfer.count() > 0) {
+      series->record(LatencyPhase::FirstByte,
+                     timing.starttransfer - timing.pretransfer);
+      series->record(LatencyPhase::Transfer,
+                     timing.total - timing.starttransfer);
+    }
+  }
+
+  // The merged series, ordered by host, method and status class.
+  [[nodiscard]] std::vector<MetricsSeries> snapshot() const {
+    std::lock_guard<std::mutex> lock(state_->mutex);
+    std::map<std::string, MetricsSeries> merged = state_->retired;
+    for (const std::shared_ptr<Shard> &shard : state_->shards) {
+      merge(*shard, merged);
+    }
+
+    std::vector<MetricsSeries> snapshot;
+    snapshot.reserve(merged.size());
+    for (auto &[key, series] : merged) {
+      snapshot.push_back(std::move(series));
+    }
+    return snapshot;
+  }
+
+private:
+  // One series of one shard. Only the owning thread writes the counters,
+  // with plain loads and stores.
+  struct Series final {
+    explicit Series(std::string key) : key(std::move(key)) {}
+
+    const std::string key;
+    std::atomic<uint64_t> reused_connections{0};
+    std::atomic<uint64_t> bytes_uploaded{0};
+    std::atomic<uint64_t> bytes_downloaded{0};
+    std::array<std::array<std::atomic<uint64_t>, LatencyHistogram::BUCKETS>,
+               LATENCY_PHASES>
+        counts{};
+    std::array<std::atomic<int64_t>, LATENCY_PHASES> sums{};
+
+    void record(LatencyPhase phase, std::chrono::microseconds value) {
+      const auto index = static_cast<size_t>(phase);
+      bump(counts[index][LatencyHistogram::bucket(value)], 1);
+      bump(sums[index], std::max<int64_t>(value.count(), 0));
+    }
+
+    void merge_into(MetricsSeries &result) const {
+      result.reused_connections +=
+          reused_connections.load(std::memory_order_relaxed);
+      result.bytes_uploaded += bytes_uploaded.load(std::memory_order_relaxed);
+      result.bytes_downloaded +=
+          bytes_downloaded.load(std::memory_order_relaxed);
+      for (size_t phase = 0; phase < LATENCY_PHASES; ++phase) {
+        LatencyHistogram &histogram = result.latency[phase];
+        for (size_t i = 0; i < LatencyHistogram::BUCKETS; ++i) {
+          if (uint64_t count =
+                  counts[phase][i].load(std::memory_order_relaxed)) {
+            histogram.add(i, count);
+          }
+        }
+        histogram.add_sum(std::chrono::microseconds{
+            sums[phase].load(std::memory_order_relaxed)});
+      }
+    }
+  };
+
+  // The series one thread recorded. The mutex only guards adding series
+  // against snapshot(); the index is the thread's own.
+  struct Shard final {
+    std::mutex mutex;
+    std::deque<Series> series;
+    std::unordered_map<std::string, Series *> index;
+  };
+
+  // What outlives the registry's threads: the shards of those still running
+  // and the merged series of those that have exited.
+  struct State final {
+    std::mutex mutex;
+    std::vector<std::shared_ptr<Shard>> shards;
+    std::map<std::string, MetricsSeries> retired;
+
+    // Called on the shard's thread as it exits, after its last write.
+    void retire(const std::shared_ptr<Shard> &shard) {
+      std::lock_guard<std::mutex> lock(mutex);
+      merge(*shard, retired);
+      shards.erase(std::find(shards.begin(), shards.end(), shard));
+    }
+  };
+
+  // A thread's shards, one per registry it recorded into, retired when the
+  // thread exits. Registries are referred to weakly, by an id that is never
+  // reused, so either may go first.
+  struct LocalShards final {
+    struct Entry final {
+      std::weak_ptr<State> registry;
+      std::shared_ptr<Shard> shard;
+    };
+
+    std::unordered_map<uint64_t, Entry> entries;
+
+    ~LocalShards() {
+      for (auto &[id, entry] : entries) {
+        if (std::shared_ptr<State> registry = entry.registry.lock()) {
+          registry->retire(entry.shard);
+        }
+      }
+    }
+  };
+
+  uint64_t id_;
+  std::shared_ptr<State> state_;
+
+  static void merge(Shard &shard, std::map<std::string, MetricsSeries> &into) {
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    for (const Series &series : shard.series) {
+      auto [entry, inserted] = into.try_emplace(series.key);
+      MetricsSeries &result = entry->second;
+      if (inserted) {
+        const size_t method = series.key.find('\n');
+        const size_t status = series.key.find('\n', method + 1);
+        result.host = series.key.substr(0, method);
+        result.method = series.key.substr(method + 1, status - method - 1);
+        result.status_class = series.key.substr(status + 1);
+      }
+      series.merge_into(result);
+    }
+  }
+
+  template <class T>
+  static void bump(std::atomic<T> &counter,
+                   typename std::atomic<T>::value_type amount) {
+    counter.store(counter.load(std::memory_order_relaxed) + amount,
+                  std::memory_order_relaxed);
+  }
+
+  static uint64_t next_id() {
+    static std::atomic<uint64_t> id{0};
+    return id.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  static std::string_view status_class(const HttpResult &result) {
+    return result.match(
+        [](const HttpFailure &failure) {
+          return failure.match(
+              [](const HttpConnectionFailure &) {
+                return std::string_view{"failed"};
+              },
+              [](const HttpResponse &response) {
+                return response_class(response);
+              },
+              [](const HttpRequestAborted &) {
+                return std::string_view{"aborted"};
+              });
+        },
+        [](const HttpSuccess &success) {
+          return response_class(success.value());
+        });
+  }
+
+  static std::string_view response_class(const HttpResponse &response) {
+    static constexpr std::string_view CLASSES[] = {"1xx", "2xx", "3xx", "4xx",
+                                                   "5xx"};
+    const int64_t status = response.status.value();
+    return status >= 100 && status < 600 ? CLASSES[status / 100 - 1]
+                                         : std::string_view{"other"};
+  }
+
+  // This thread's shard, registered with the registry on first use, when
+  // the shards of registries that have since been destroyed are dropped.
+  Shard &local_shard() {
+    thread_local LocalShards local;
+    auto found = local.entries.find(id_);
+    if (found != local.entries.end()) {
+      return *found->second.shard;
+    }
+
+    for (auto entry = local.entries.begin(); entry != local.entries.end();) {
+      entry = entry->second.registry.expired() ? local.entries.erase(entry)
+                                               : std::next(entry);
+    }
+    auto shard = std::make_shared<Shard>();
+    {
+      std::lock_guard<std::mutex> lock(state_->mutex);
+      state_->shards.push_back(shard);
+    }
+    local.entries.emplace(id_, LocalShards::Entry{state_, shard});
+    return *shard;
+  }
+};
+
+// Writes the registry in the Prometheus text exposition format (0.0.4),
+// appending to the buffer so that callers can reuse its capacity between
+// scrapes. Latencies are histograms in seconds with the given upper bounds,
+// by default those of the Prometheus client libraries. A bucket counts the
+// values known to be within its bound, so it may miss values up to 1/16
+// below the bound. Only the snapshot locks; recording is never blocked.
+inline static void write_prometheus(
+    const MetricsRegistry &registry, std::string &buffer,
+    const std::vector<std::chrono::microseconds> &buckets = {
+        std::chrono::milliseconds{5}, std::chrono::milliseconds{10},
+        std::chrono::milliseconds{25}, std::chrono::milliseconds{50},
+        std::chrono::milliseconds{100}, std::chrono::milliseconds{250},
+        std::chrono::milliseconds{500}, std::chrono::seconds{1},
+        std::chrono::milliseconds{2500}, std::chrono::seconds{5},
+        std::chrono::seconds{10}}) {
+  static constexpr std::string_view PHASES[LATENCY_PHASES] = {
+      "total", "name_lookup", "connect", "tls", "first_byte", "transfer"};
+  const std::vector<MetricsSeries> snapshot = registry.snapshot();
+
+  auto label = [&buffer](std::string_view name, std::string_view value) {
+    buffer.append(name).append("=\"");
+    for (char c : value) {
+      if (c == '\\' || c == '"') {
+        buffer += '\\';
+        buffer += c;
+      } else if (c == '\n') {
+        buffer.append("\\n");
+      } else {
+        buffer += c;
+      }
+    }
+    buffer += '"';
+  };
+  auto labels = [&](const MetricsSeries &series) {
+    label("host", series.host);
+    buffer += ',';
+    label("method", series.method);
+    buffer += ',';
+    label("status_class", series.status_class);
+  };
+  auto seconds = [&buffer](std::chrono::microseconds value) {
+    const int64_t micros = value.count();
+    std::string fraction = std::to_string(micros % 1000000);
+    fraction.insert(0, 6 - fraction.size(), '0');
+    fraction.erase(fraction.find_last_not_of('0') + 1);
+    buffer.append(std::to_string(micros / 1000000));
+    if (!fraction.empty()) {
+      buffer.append(".").append(fraction);
+    }
+  };
+  auto family = [&buffer](std::string_view name, std::string_view type,
+                          std::string_view help) {
+    buffer.append("# HELP ").append(name).append(" ").append(help);
+    buffer.append("\n# TYPE ").append(name).append(" ").append(type);
+    buffer += '\n';
+  };
+  auto counter = [&](std::string_view name, std::string_view help,
+                     uint64_t (*value)(const MetricsSeries &)) {
+    family(name, "counter", help);
+    for (const MetricsSeries &series : snapshot) {
+      buffer.append(name) += '{';
+      labels(series);
+      buffer.append("} ").append(std::to_string(value(series))) += '\n';
+    }
+  };
+
+  counter("simple_http_requests_total", "Transfers made.",
+          [](const MetricsSeries &series) { return series.requests(); });
+  counter("simple_http_reused_connections_total",
+          "Transfers made over a reused connection.",
+          [](const MetricsSeries &series) {
+            return series.reused_connections;
+          });
+  counter("simple_http_sent_bytes_total", "Request body bytes sent.",
+          [](const MetricsSeries &series) { return series.bytes_uploaded; });
+  counter("simple_http_received_bytes_total", "Response body bytes received.",
+          [](const MetricsSeries &series) {
+            return series.bytes_downloaded;
+          });
+
+  family("simple_http_request_duration_seconds", "histogram",
+         "Time spent in each phase of a transfer.");
+  for (const MetricsSeries &series : snapshot) {
+    for (size_t phase = 0; phase < LATENCY_PHASES; ++phase) {
+      const LatencyHistogram &histogram = series.latency[phase];
+      if (phase != 0 && histogram.count() == 0) {
+        continue;
+      }
+      auto sample = [&](std::string_view suffix) {
+        buffer.append("simple_http_request_duration_seconds")
+            .append(suffix) += '{';
+        labels(series);
+        buffer += ',';
+        label("phase", PHASES[phase]);
+      };
+      for (std::chrono::microseconds bound : buckets) {
+        sample("_bucket");
+        buffer.append(",le=\"");
+        seconds(bound);
+        buffer.append("\"} ")
+            .append(std::to_string(histogram.count_at_most(bound))) += '\n';
+      }
+      sample("_bucket");
+      buffer.append(",le=\"+Inf\"} ")
+          .append(std::to_string(histogram.count())) += '\n';
+      sample("_sum");
+      buffer.append("} ");
+      seconds(histogram.sum());
+      buffer += '\n';
+      sample("_count");
+      buffer.append("} ").append(std::to_string(histogram.count())) += '\n';
+    }
+  }
+}
+
+// Receives a span for every transfer a client makes, so retries and hedges
+// get spans of their own. The context start() returns is sent with the
+// request. Implementations must be safe to call from several threads.
+struct Tracer {
+  virtual ~Tracer() = default;
+
+  // Starts the span of a transfer to the url under the request's context,
+  // which is a child of the request's trace parent or a new root.
+  [[nodiscard]] virtual TraceContext
+  start(const HttpUrl &url, const std::optional<TraceContext> &parent) = 0;
+
+  // Ends the span. The result's timing holds the phases of the transfer.
+  virtual void end(const TraceContext &span, std::string_view method,
+                   const HttpResult &result) = 0;
+};
+
+// A span as recorded by InMemoryTracer.
+struct RecordedSpan final {
+  TraceContext context;
+  // Empty for the root span of a trace.
+  std::string parent_span_id;
+  std::string url;
+  std::string method;
+  std::optional<HttpStatusCode> status;
+  std::optional<HttpTiming> timing;
+};
+
+// Keeps finished spans in memory, for tests.
+struct InMemoryTracer final : Tracer {
+  [[nodiscard]] TraceContext
+  start(const HttpUrl &url, const std::optional<TraceContext> &parent) override {
+    TraceContext span = parent ? parent->child() : TraceContext::root();
+    std::lock_guard<std::mutex> lock(mutex_);
+    open_.insert_or_assign(
+        span.span_id,
+        RecordedSpan{span, parent ? parent->span_id : std::string{},
+                     url.value(), {}, std::nullopt, std::nullopt});
+    return span;
+  }
+
+  void end(const TraceContext &span, std::string_view method,
+           const HttpResult &result) override {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto found = open_.find(span.span_id);
+    if (found == open_.end()) {
+      return;
+    }
+    RecordedSpan recorded = std::move(found->second);
+    open_.erase(found);
+    recorded.method = std::string{method};
+    recorded.timing = result.timing();
+    std::optional<HttpSuccess> success = result.success();
+    std::optional<HttpFailure> failure = result.failure();
+    if (success) {
+      recorded.status = success->status();
+    } else if (const auto *response =
+                   std::get_if<HttpResponse>(&failure->value())) {
+      recorded.status = response->status;
+    }
+    finished_.push_back(std::move(recorded));
+  }
+
+  // The finished spans in the order they ended.
+  [[nodiscard]] std::vector<RecordedSpan> spans() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return finished_;
+  }
+
+  void clear() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    finished_.clear();
+  }
+
+private:
+  mutable std::mutex mutex_;
+  std::unordered_map<std::string, RecordedSpan> open_;
+  std::vector<RecordedSpan> finished_;
+};
+
+struct Client final {
+  Client() : debug_(false), verify_(true) {}
+
+  Client &with_tls_verification(bool verify) {
+    verify_ = verify;
+    return *this;
+  }
+
+  Client &with_debug(bool debug) {
+    debug_ = debug;
+    return *this;
+  }
+
+  // Responses whose body would exceed this many bytes fail with
+  // HttpAbortReason::BodyTooLarge. A known Content-Length is rejected before
+  // any of the body is read.
+  Client &with_max_body_size(size_t bytes) {
+    max_body_size_ = bytes;
+    return *this;
+  }
+
+  // Default timeouts for every request, which RequestOptions can override.
+  Client &with_connect_timeout(std::chrono::milliseconds timeout) {
+    timeouts_.connect = timeout;
+    return *this;
+  }
+
+  Client &with_first_byte_timeout(std::chrono::milliseconds timeout) {
+    timeouts_.first_byte = timeout;
+    return *this;
+  }
+
+  Client &with_idle_timeout(std::chrono::milliseconds timeout) {
+    timeouts_.idle = timeout;
+    return *this;
+  }
+
+  Client &with_total_timeout(std::chrono::milliseconds timeout) {
+    timeouts_.total = timeout;
+    return *this;
+  }
+
+  // Records every transfer into the registry. Clients sharing a registry
+  // add up in its snapshots.
+  Client &with_metrics(std::shared_ptr<MetricsRegistry> metrics) {
+    metrics_ = std::move(metrics);
+    return *this;
+  }
+
+  // Reports a span per transfer to the tracer and sends each span's trace
+  // context in the traceparent and tracestate headers. Without a tracer
+  // none of this costs anything.
+  Client &with_tracer(std::shared_ptr<Tracer> tracer) {
+    tracer_ = std::move(tracer);
+    return *this;
+  }
+
+  // Serves get() through the given cache. Clients sharing a cache share its
+  // entries and statistics.
+  Client &with_cache(std::shared_ptr<HttpCache> cache) {
+    cache_ = std::move(cache);
+    return *this;
+  }
+
+  // Lets get() answer from a cached response inside its
+  // stale-while-revalidate window while the refresher revalidates it.
+  // Without a refresher such responses are revalidated inline.
+  Client &with_background_refresh(
+      std::shared_ptr<BackgroundRefresher> refresher) {
+    refresher_ = std::move(refresher);
+    return *this;
+  }
+
+  // Retries failed requests as the policy allows. Streams are never retried
+  // and POST only when the policy says so.
+  Client &with_retry_policy(RetryPolicy policy) {
+    retry_ = std::move(policy);
+    return *this;
+  }
+
+  // Hedges get() transfers: if the first attempt has not finished after the
+  // policy's delay, an identical request is sent on a new connection. The
+  // first success is returned and the other transfer is aborted in the
+  // background, on a thread the client joins when its last copy is
+  // destroyed.
+  Client &with_hedging(HedgingPolicy policy) {
+    hedge_workers_ = std::make_shared<WorkerPool>(policy.max_threads());
+    hedging_ = std::move(policy);
+    return *this;
+  }
+
+  // Fails requests to hosts whose circuit is open with
+  // HttpAbortReason::CircuitOpen instead of sending them. Every attempt,
+  // including retries and hedges, is admitted and recorded separately.
+  Client &with_circuit_breaker(std::shared_ptr<CircuitBreaker> breaker) {
+    breaker_ = std::move(breaker);
+    return *this;
+  }
+
+  // Transfers reuse connections, DNS results and TLS sessions held by the
+  // pool. Clients given the same pool share its connections.
+  Client &with_connection_pool(std::shared_ptr<ConnectionPool> pool) {
+    pool_ = std::move(pool);
+    return *this;
+  }
+
+  // Requests whose url host is the group's service name are sent to one of
+  // its backends, chosen again for every attempt.
+  Client &with_upstream_group(std::shared_ptr<UpstreamGroup> group) {
+    std::string service = group->service().value();
+    upstreams_.insert_or_assign(std::move(service), std::move(group));
+    return *this;
+  }
+
+  // Holds requests to each host to the limiter's adaptive concurrency
+  // limit. Requests it turns away fail with
+  // HttpAbortReason::ConcurrencyLimited.
+  Client &with_concurrency_limiter(
+      std::shared_ptr<ConcurrencyLimiter> limiter) {
+    limiter_ = std::move(limiter);
+    return *this;
+  }
+
+  // Spaces requests out to the limiter's quotas, waiting or failing with
+  // HttpAbortReason::RateLimited as it is configured.
+  Client &with_rate_limiter(std::shared_ptr<RateLimiter> limiter) {
+    rate_limiter_ = std::move(limiter);
+    return *this;
+  }
+
+  // Concurrent identical get() calls share one transfer, and one cache
+  // revalidation when a cache is also configured. Each caller's success
+  // predicate is applied to the shared response separately. Requests with a
+  // cancellation token, a deadline, a total timeout or a trace parent are
+  // not shared, see RequestCoalescer::shareable().
+  Client &with_request_coalescing(std::shared_ptr<RequestCoalescer> coalescer) {
+    coalescer_ = std::move(coalescer);
+    return *this;
+  }
+
+  [[nodiscard]] HttpResult get(const HttpUrl &url,
+                               const Headers &headers = {}) const {
+    return get(url, StatusCodeSet{OK}, headers);
+  }
+
+  [[nodiscard]] HttpResult
+  get(const HttpUrl &url, const StatusPredicate &successPredicate,
+      const Headers &headers = {}, const RequestOptions &options = {}) const {
+    if (coalescer_ && RequestCoalescer::shareable(options)) {
+      HttpResult shared = coalescer_->run(
+          coalescer_->key("GET", url, headers, options),
+          [&] { return uncoalesced_get(url, ANY_STATUS, headers, options); });
+      std::optional<HttpSuccess> response = shared.success();
+      return response ? classify(response->value(), successPredicate,
+                                 shared.timing())
+                      : shared;
+    }
+
+    return uncoalesced_get(url, successPredicate, headers, options);
+  }
+
+  [[nodiscard]] HttpResult post(const HttpUrl &url, const HttpRequestBody &body,
+                                const Headers &headers = {}) const {
+    return post(url, body, StatusCodeSet{OK}, headers);
+  }
+
+  [[nodiscard]] HttpResult
+  post(const HttpUrl &url, const HttpRequestBody &body,
+       const StatusPredicate &successPredicate,
+       const Headers &headers = {}, const RequestOptions &options = {}) const {
+    CurlSetupCallback setup = [&](CURL *curl) {
+      curl_easy_setopt(curl, CURLOPT_POSTFIELDS, body.value().c_str());
+    };
+
+    return send(false, url, make_header_callback(headers), setup,
+                successPredicate, {}, options);
+  }
+
+  [[nodiscard]] HttpResult put(const HttpUrl &url, const HttpRequestBody &body,
+                               const Headers &headers = {}) const {
+    return put(url, body, StatusCodeSet{OK}, headers);
+  }
+
+  [[nodiscard]] HttpResult
+  put(const HttpUrl &url, const HttpRequestBody &body,
+      const StatusPredicate &successPredicate,
+      const Headers &headers = {}, const RequestOptions &options = {}) const {
+    CurlSetupCallback setup = [&](CURL *curl) {
+      curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, "PUT");
+      curl_easy_setopt(curl, CURLOPT_POSTFIELDS, body.value().c_str());
+    };
+
+    return execute(url, make_header_callback(headers), setup, successPredicate,
+                   {}, options);
+  }
+
+  [[nodiscard]] HttpResult del(const HttpUrl &url,
+                               const Headers &headers = {}) const {
+    return del(url, StatusCodeSet{OK}, headers);
+  }
+
+  [[nodiscard]] HttpResult
+  del(const HttpUrl &url, const StatusPredicate &successPredicate,
+      const Headers &headers = {}, const RequestOptions &options = {}) const {
+    CurlSetupCallback setup = [&](CURL *curl) {
+      curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, "DELETE");
+    };
+
+    return execute(url, make_header_callback(headers), setup, successPredicate,
+                   {}, options);
+  }
+
+  [[nodiscard]] HttpResult head(const HttpUrl &url) const {
+    CurlSetupCallback setup = [&](CURL *curl) {
+      curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
+    };
+
+    return execute(url, NoopCurlHeaderCallback, setup, StatusCodeSet{OK});
+  }
+
+  [[nodiscard]] HttpResult options(const HttpUrl &url) const {
+    CurlSetupCallback setup = [&](CURL *curl) {
+      curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, "OPTIONS");
+    };
+
+    return execute(url, NoopCurlHeaderCallback, setup, StatusCodeSet{OK});
+  }
+
+  [[nodiscard]] HttpResult trace(const HttpUrl &url) const {
+    CurlSetupCallback setup = [&](CURL *curl) {
+      curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, "TRACE");
+    };
+
+    return execute(url, NoopCurlHeaderCallback, setup, StatusCodeSet{OK});
+  }
+
+  // Streams the body of a successful GET to the chunk callback instead of
+  // buffering it. Returning false from the callback ends the transfer.
+  [[nodiscard]] HttpResult
+  stream(const HttpUrl &url, const HttpChunkCallback &chunk_callback,
+         const StatusPredicate &successPredicate,
+         const Headers &headers = {},
+         const RequestOptions &options = {}) const {
+    return execute(url, make_header_callback(headers), NoopCurlSetupCallback,
+                   successPredicate, chunk_callback, options);
+  }
+
+  // Streams a line-delimited body such as NDJSON, invoking the callback once
+  // per line as soon as the chunk completing it arrives.
+  [[nodiscard]] HttpResult
+  lines(const HttpUrl &url, const LineCallback &callback,
+        const StatusPredicate &successPredicate,
+        const Headers &headers = {},
+        const RequestOptions &options = {}) const {
+    LineSplitter splitter;
+    bool stopped = false;
+    HttpResult result = stream(
+        url,
+        [&](std::string_view chunk) {
+          stopped = !splitter.feed(chunk, callback);
+          return !stopped;
+        },
+        successPredicate, headers, options);
+
+    if (!stopped && result.success().has_value()) {
+      (void)splitter.finish(callback);
+    }
+
+    return result;
+  }
+
+  // Consumes a text/event-stream, reconnecting with Last-Event-ID whenever
+  // the stream ends. Reconnection stops when the callback returns false,
+  // the server answers with anything but 200 (204 being the conventional
+  // way to end a stream) or max_reconnects is reached. The result of the
+  // final connection is returned.
+  [[nodiscard]] HttpResult
+  events(const HttpUrl &url, const ServerSentEventCallback &callback,
+         const Headers &headers = {},
+         uint64_t max_reconnects = std::numeric_limits<uint64_t>::max()) const {
+    ServerSentEventParser parser;
+    bool stopped = false;
+    HttpChunkCallback chunk_callback = [&](std::string_view chunk) {
+      stopped = !parser.feed(chunk, callback);
+      return !stopped;
+    };
+
+    for (uint64_t reconnects = 0;; ++reconnects) {
+      Headers request_headers = headers;
+      request_headers.insert_or_assign("Accept", "text/event-stream");
+      if (!parser.last_event_id().empty()) {
+        request_headers.insert_or_assign("Last-Event-ID",
+                                         parser.last_event_id());
+      }
+
+      HttpResult result =
+          execute(url, make_header_callback(request_headers),
+                  NoopCurlSetupCallback, StatusCodeSet{OK}, chunk_callback);
+      const bool rejected =
+          result.failure().has_value() &&
+          std::holds_alternative<HttpResponse>(result.failure()->value());
+      if (stopped || rejected || reconnects == max_reconnects) {
+        return result;
+      }
+
+      parser.reset();
+      std::this_thread::sleep_for(
+          parser.retry().value_or(DEFAULT_EVENT_STREAM_RETRY));
+    }
+  }
+
+#if defined(CURLWS_TEXT)
+  // Performs the WebSocket upgrade for a ws:// or wss:// url.
+  [[nodiscard]] std::variant<HttpConnectionFailure, WebSocket>
+  websocket(const HttpUrl &url, const Headers &headers = {}) const {
+    CURL *curl = curl_easy_init();
+    WebSocket websocket{curl};
+    curl_slist *slist = make_header_callback(headers)(nullptr);
+
+    curl_easy_setopt(curl, CURLOPT_URL, url.value().c_str());
+    curl_easy_setopt(curl, CURLOPT_CONNECT_ONLY, 2L);
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, slist);
+    curl_easy_setopt(curl, CURLOPT_VERBOSE, debug_ ? 1L : 0L);
+    if (url.protocol().value() == "wss") {
+      curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, verify_ ? 1L : 0L);
+    }
+
+    CURLcode res = curl_easy_perform(curl);
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, nullptr);
+    curl_slist_free_all(slist);
+    if (res != CURLE_OK) {
+      return HttpConnectionFailure::from(curl, res);
+    }
+
+    return websocket;
+  }
+#endif
+
+  [[nodiscard]] HttpResult
+  execute(const HttpUrl &url, const CurlHeaderCallback &curl_header_callback,
+          const CurlSetupCallback &curl_setup_callback,
+          const StatusPredicate &successPredicate,
+          const HttpChunkCallback &chunk_callback = {},
+          const RequestOptions &options = {}) const {
+    return send(true, url, curl_header_callback, curl_setup_callback,
+                successPredicate, chunk_callback, options);
+  }
+
+private:
+  inline static const std::chrono::milliseconds DEFAULT_EVENT_STREAM_RETRY{
+      3000};
+
+  inline static const StatusCodeSet ANY_STATUS = StatusCodeSet::range(0, 1023);
+
+  // The errors stale-if-error applies to besides connection failures
+  // (RFC 5861 section 4).
+  inline static const StatusCodeSet STALE_IF_ERROR_STATUS{500, 502, 503, 504};
+
+  bool debug_;
+  bool verify_;
+  std::optional<size_t> max_body_size_;
+  Timeouts timeouts_;
+  std::shared_ptr<HttpCache> cache_;
+  std::shared_ptr<RequestCoalescer> coalescer_;
+  std::shared_ptr<BackgroundRefresher> refresher_;
+  std::optional<RetryPolicy> retry_;
+  std::optional<HedgingPolicy> hedging_;
+  std::shared_ptr<WorkerPool> hedge_workers_;
+  std::shared_ptr<CircuitBreaker> breaker_;
+  std::shared_ptr<ConnectionPool> pool_;
+  std::shared_ptr<ConcurrencyLimiter> limiter_;
+  std::shared_ptr<RateLimiter> rate_limiter_;
+  std::shared_ptr<MetricsRegistry> metrics_;
+  std::shared_ptr<Tracer> tracer_;
+  std::unordered_map<std::string, std::shared_ptr<UpstreamGroup>> upstreams_;
+
+  static HttpResult
+  classify(const HttpResponse &response,
+           const StatusPredicate &successPredicate,
+           const std::optional<HttpTiming> &timing = std::nullopt) {
+    return successPredicate(response.status)
+               ? HttpResult{HttpSuccess{response}, timing}
+               : HttpResult{HttpFailure{response}, timing};
+  }
+
+  // The options with the total timeout turned into a deadline, so that the
+  // transfers and retries of one request share a single budget.
+  [[nodiscard]] RequestOptions bounded(const RequestOptions &options) const {
+    const std::optional<std::chrono::milliseconds> &total =
+        options.timeouts_.total ? options.timeouts_.total : timeouts_.total;
+    if (!total) {
+      return options;
+    }
+
+    RequestOptions result = options;
+    const auto deadline = std::chrono::steady_clock::now() + *total;
+    result.deadline_ = options.deadline_
+                           ? std::min(*options.deadline_, deadline)
+                           : deadline;
+    return result;
+  }
+
+  // The options with the request's trace context, made once so that the
+  // spans of its retries and hedges all belong to the same trace.
+  [[nodiscard]] RequestOptions traced(RequestOptions options) const {
+    if (tracer_ && !options.trace_request_) {
+      options.trace_request_ = options.trace_parent_
+                                   ? options.trace_parent_->child()
+                                   : TraceContext::root();
+    }
+    return options;
+  }
+
+  [[nodiscard]] HttpResult
+  send(bool idempotent, const HttpUrl &url,
+       const CurlHeaderCallback &curl_header_callback,
+       const CurlSetupCallback &curl_setup_callback,
+       const StatusPredicate &successPredicate,
+       const HttpChunkCallback &chunk_callback,
+       const RequestOptions &request_options) const {
+    const RequestOptions options = traced(bounded(request_options));
+    auto concurrency_limited = [&](const HttpUrl &target, const Host &host) {
+      if (!limiter_) {
+        return transfer(target, curl_header_callback, curl_setup_callback,
+                        successPredicate, chunk_callback, options);
+      }
+
+      if (!limiter_->acquire(host, options.deadline_, options.cancellation_)) {
+        return limit_failure(HttpAbortReason::ConcurrencyLimited,
+                             "Concurrency limit reached for " + host.value(),
+                             options);
+      }
+      const auto started = std::chrono::steady_clock::now();
+      HttpResult result = transfer(target, curl_header_callback,
+                                   curl_setup_callback, successPredicate,
+                                   chunk_callback, options);
+      limiter_->release(host,
+                        std::chrono::duration_cast<std::chrono::microseconds>(
+                            std::chrono::steady_clock::now() - started),
+                        result);
+      return result;
+    };
+
+    auto breaker_guarded = [&](const HttpUrl &target, const Host &host) {
+      if (!breaker_) {
+        return concurrency_limited(target, host);
+      }
+
+      const CircuitBreaker::Permit permit = breaker_->admit(host);
+      if (permit == CircuitBreaker::Permit::Rejected) {
+        return HttpResult{HttpFailure{HttpRequestAborted{
+            HttpAbortReason::CircuitOpen, "Circuit open for " + host.value()}}};
+      }
+      HttpResult result = concurrency_limited(target, host);
+      breaker_->record(host, permit, result);
+      return result;
+    };
+
+    auto rate_limited = [&](const HttpUrl &target) {
+      if (!rate_limiter_ && !breaker_ && !limiter_) {
+        return transfer(target, curl_header_callback, curl_setup_callback,
+                        successPredicate, chunk_callback, options);
+      }
+
+      const Host host = target.host();
+      if (!rate_limiter_) {
+        return breaker_guarded(target, host);
+      }
+
+      if (!rate_limiter_->acquire(host, options.deadline_,
+                                  options.cancellation_)) {
+        return limit_failure(HttpAbortReason::RateLimited,
+                             "Rate limit exceeded for " + host.value(),
+                             options);
+      }
+      HttpResult result = breaker_guarded(target, host);
+      rate_limiter_->observe(host, result);
+      return result;
+    };
+
+    auto upstream = upstreams_.empty() ? upstreams_.end()
+                                       : upstreams_.find(url.host().value());
+    auto attempt = [&] {
+      const std::optional<size_t> chosen =
+          upstream == upstreams_.end() ? std::nullopt
+                                       : upstream->second->choose();
+      if (!chosen) {
+        return rate_limited(url);
+      }
+
+      UpstreamGroup &group = *upstream->second;
+      const size_t backend = *chosen;
+      group.start(backend);
+      const auto started = std::chrono::steady_clock::now();
+      HttpResult result = rate_limited(retarget(url, group.host(backend)));
+      std::optional<HttpFailure> failure = result.failure();
+      group.finish(backend,
+                   std::chrono::duration_cast<std::chrono::microseconds>(
+                       std::chrono::steady_clock::now() - started),
+                   failure && !std::holds_alternative<HttpResponse>(
+                                  failure->value()));
+      return result;
+    };
+    if (retry_ && !chunk_callback && retry_->retries(idempotent)) {
+      return retry_->run(attempt, options.deadline_, options.cancellation_);
+    }
+    return attempt();
+  }
+
+  [[nodiscard]] HttpResult
+  transfer(const HttpUrl &url, const CurlHeaderCallback &curl_header_callback,
+           const CurlSetupCallback &curl_setup_callback,
+           const StatusPredicate &successPredicate,
+           const HttpChunkCallback &chunk_callback,
+           const RequestOptions &options) const {
+    // Declared first so the share handle is returned only after the easy
+    // handle using it has been cleaned up.
+    std::shared_ptr<CURLSH> share = pool_ ? pool_->acquire() : nullptr;
+    CurlWrapper curlWrapper{successPredicate};
+
+    curlWrapper.execute_header_callback(curl_header_callback);
+    curlWrapper.add_option(CURLOPT_URL, url.value().c_str());
+    curlWrapper.add_option(CURLOPT_VERBOSE, debug_ ? 1L : 0L);
+
+    if (url.protocol().value() == "https") {
+      verify_ ? curlWrapper.add_option(CURLOPT_SSL_VERIFYPEER, 1L)
+              : curlWrapper.add_option(CURLOPT_SSL_VERIFYPEER, 0L);
+    }
+
+    curlWrapper.execute_setup_callback(curl_setup_callback);
+
+    std::optional<size_t> max_body_size =
+        options.max_body_size() ? options.max_body_size() : max_body_size_;
+    if (max_body_size && !chunk_callback) {
+      curlWrapper.add_option(CURLOPT_MAXFILESIZE_LARGE,
+                             static_cast<curl_off_t>(*max_body_size));
+    }
+
+    if (share) {
+      curlWrapper.add_option(CURLOPT_SHARE, share.get());
+    }
+
+    if (options.cancellation_ && options.cancellation_->cancelled()) {
+      return HttpResult{HttpFailure{HttpRequestAborted{
+          HttpAbortReason::Cancelled, "Request cancelled"}}};
+    }
+
+    const Timeouts timeouts = options.timeouts_.or_else(timeouts_);
+    if (timeouts.connect) {
+      curlWrapper.add_option(CURLOPT_CONNECTTIMEOUT_MS,
+                             static_cast<long>(timeouts.connect->count()));
+    }
+    if (options.deadline_) {
+      const auto remaining =
+          std::chrono::ceil<std::chrono::milliseconds>(
+              *options.deadline_ - std::chrono::steady_clock::now());
+      if (remaining.count() <= 0) {
+        return HttpResult{HttpFailure{HttpConnectionFailure{
+            CURLE_OPERATION_TIMEDOUT, HttpConnectionPhase::Setup}}};
+      }
+      curlWrapper.add_option(CURLOPT_TIMEOUT_MS,
+                             static_cast<long>(remaining.count()));
+    }
+
+    Progress progress{options.cancellation_
+                          ? &options.cancellation_->state_->cancelled
+                          : nullptr,
+                      options.superseded_.get(), timeouts.first_byte,
+                      timeouts.idle};
+    const bool watched = progress.cancelled || progress.superseded ||
+                         progress.first_byte || progress.idle;
+    if (watched) {
+      curlWrapper.add_option(CURLOPT_NOPROGRESS, 0L);
+      curlWrapper.add_option(CURLOPT_XFERINFOFUNCTION, progress_callback);
+      curlWrapper.add_option(CURLOPT_XFERINFODATA, &progress);
+    }
+
+    std::optional<TraceContext> span;
+    if (tracer_) {
+      span = tracer_->start(url, options.trace_request_);
+      curlWrapper.append_header("traceparent: " + span->traceparent());
+      if (!span->trace_state.empty()) {
+        curlWrapper.append_header("tracestate: " + span->trace_state);
+      }
+    }
+
+    HttpResult result = curlWrapper.execute(chunk_callback, max_body_size,
+                                            watched ? &progress : nullptr);
+    if (metrics_) {
+      metrics_->record(url.host(), curlWrapper.method(), result);
+    }
+    if (span) {
+      tracer_->end(*span, curlWrapper.method(), result);
+    }
+    return result;
+  }
+
+  // A request a limiter turned away, or gave up waiting for because it was
+  // cancelled.
+  static HttpResult limit_failure(HttpAbortReason reason, std::string message,
+                                  const RequestOptions &options) {
+    if (options.cancellation_ && options.cancellation_->cancelled()) {
+      return HttpResult{HttpFailure{HttpRequestAborted{
+          HttpAbortReason::Cancelled, "Request cancelled"}}};
+    }
+    return HttpResult{
+        HttpFailure{HttpRequestAborted{reason, std::move(message)}}};
+  }
+
+  // The url with its authority replaced by the given host.
+  static HttpUrl retarget(const HttpUrl &url, const Host &host) {
+    std::string value = url.value();
+    size_t start = value.find("://");
+    start = start == std::string::npos ? 0 : start + 3;
+    const size_t end = value.find_first_of("/?#", start);
+    value.replace(start, end == std::string::npos ? end : end - start,
+                  host.value());
+    return HttpUrl{std::move(value)};
+  }
+
+  // A GET without a body, hedged when the client has a hedging policy.
+  [[nodiscard]] HttpResult fetch(const HttpUrl &url, const Headers &headers,
+                                 const StatusPredicate &successPredicate,
+                                 const RequestOptions &request_options) const {
+    const RequestOptions options = traced(bounded(request_options));
+    if (!hedging_) {
+      return send(true, url, make_header_callback(headers),
+                  NoopCurlSetupCallback, successPredicate, {}, options);
+    }
+
+    const std::string target = url.value();
+    const std::string endpoint = target.substr(0, target.find('?'));
+    auto hedged = std::make_shared<Hedged>();
+    RequestOptions leg_options = options;
+    leg_options.superseded_ = hedged->superseded;
+    // Legs hold no reference to the pool, so it is never destroyed, and
+    // joined, from one of its own threads.
+    Client leg_client = *this;
+    leg_client.hedge_workers_.reset();
+
+    auto launch = [&](size_t leg) {
+      return hedge_workers_->try_run([client = leg_client, target, headers,
+                                      successPredicate, leg_options, hedged,
+                                      leg] {
+        const auto started = std::chrono::steady_clock::now();
+        HttpResult result = client.send(
+            true, HttpUrl{target}, make_header_callback(headers),
+            NoopCurlSetupCallback, successPredicate, {}, leg_options);
+        std::lock_guard<std::mutex> lock(hedged->mutex);
+        hedged->results[leg] = std::move(result);
+        hedged->latencies[leg] =
+            std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - started);
+        hedged->done.notify_all();
+      });
+    };
+
+    std::unique_lock<std::mutex> lock(hedged->mutex);
+    if (!launch(0)) {
+      lock.unlock();
+      hedging_->record_request(false);
+      return send(true, url, make_header_callback(headers),
+                  NoopCurlSetupCallback, successPredicate, {}, options);
+    }
+    const bool hedge =
+        !hedged->done.wait_for(lock, hedging_->delay(endpoint),
+                               [&] { return hedged->results[0].has_value(); }) &&
+        launch(1);
+    hedging_->record_request(hedge);
+    if (hedge) {
+      hedged->done.wait(lock, [&] {
+        return (hedged->results[0] && hedged->results[0]->success()) ||
+               (hedged->results[1] && hedged->results[1]->success()) ||
+               (hedged->results[0] && hedged->results[1]);
+      });
+    } else {
+      hedged->done.wait(lock, [&] { return hedged->results[0].has_value(); });
+    }
+
+    const bool hedge_won =
+        hedged->results[1] && hedged->results[1]->success() &&
+        !(hedged->results[0] && hedged->results[0]->success());
+    const size_t winner = hedge_won ? 1 : 0;
+    hedged->superseded->store(true, std::memory_order_relaxed);
+    hedging_->observe(endpoint, hedged->latencies[winner], hedge_won);
+    return *hedged->results[winner];
+  }
+
+  [[nodiscard]] HttpResult
+  uncoalesced_get(const HttpUrl &url, const StatusPredicate &successPredicate,
+                  const Headers &headers, const RequestOptions &options) const {
+    if (cache_) {
+      return cached_get(url, successPredicate, headers, options);
+    }
+
+    return fetch(url, headers, successPredicate, options);
+  }
+
+  [[nodiscard]] HttpResult cached_get(const HttpUrl &url,
+                                      const StatusPredicate &successPredicate,
+                                      const Headers &headers,
+                                      const RequestOptions &options) const {
+    const CacheControl request_directives =
+        CacheControl::parse(header_value(headers, "Cache-Control").value_or(""));
+    if (request_directives.no_store) {
+      return fetch(url, headers, successPredicate, options);
+    }
+
+    std::optional<CacheEntry> entry = cache_->lookup(url.value(), headers);
+    const auto now = std::chrono::system_clock::now();
+    if (entry && !request_directives.no_cache) {
+      if (entry->fresh(now)) {
+        cache_->record_hit();
+        return classify(entry->response, successPredicate);
+      }
+
+      if (refresher_ &&
+          entry->usable_stale(now, options.stale_while_revalidate().value_or(
+                                       entry->stale_while_revalidate))) {
+        cache_->record_stale();
+        schedule_refresh(url, headers, *entry, options);
+        return classify(entry->response, successPredicate);
+      }
+    }
+
+    HttpResult result = revalidate(url, headers, entry, options);
+    std::optional<HttpSuccess> response = result.success();
+    if (entry && (!response || STALE_IF_ERROR_STATUS(response->status())) &&
+        entry->usable_stale(now, options.stale_if_error().value_or(
+                                     entry->stale_if_error))) {
+      cache_->record_stale();
+      return classify(entry->response, successPredicate);
+    }
+
+    return response ? classify(response->value(), successPredicate,
+                               result.timing())
+                    : result;
+  }
+
+  // Fetches the url, conditionally when a stored entry has validators, and
+  // updates the cache. Succeeds with whatever response should be served.
+  [[nodiscard]] HttpResult revalidate(const HttpUrl &url,
+                                      const Headers &headers,
+                                      const std::optional<CacheEntry> &entry,
+                                      const RequestOptions &options) const {
+    const std::string key = url.value();
+    Headers conditional = headers;
+    if (entry) {
+      const Headers &stored = entry->response.headers.value();
+      if (std::optional<std::string> etag = header_value(stored, "ETag")) {
+        conditional.insert_or_assign("If-None-Match", *etag);
+      }
+      if (std::optional<std::string> last_modified =
+              header_value(stored, "Last-Modified")) {
+        conditional.insert_or_assign("If-Modified-Since", *last_modified);
+      }
+    }
+
+    HttpResult result = fetch(url, conditional, ANY_STATUS, options);
+    std::optional<HttpSuccess> response = result.success();
+    if (!response) {
+      return result;
+    }
+
+    if (entry && response->status() == NOT_MODIFIED) {
+      cache_->record_revalidation();
+      return HttpResult{
+          HttpSuccess{
+              cache_->refresh(key, headers, *entry, response->value()).response},
+          result.timing()};
+    }
+
+    cache_->record_miss();
+    (void)cache_->store(key, headers, response->value());
+    return result;
+  }
+
+  // Revalidates on the refresher through a copy of this client, which must
+  // not own the refresher itself or the worker could end up joining itself.
+  void schedule_refresh(const HttpUrl &url, const Headers &headers,
+                        const CacheEntry &entry,
+                        const RequestOptions &options) const {
+    std::map<std::string, std::string> sorted;
+    for (const auto &[name, value] : headers) {
+      sorted.emplace(lowercase(name), value);
+    }
+    std::string key = url.value();
+    for (const auto &[name, value] : sorted) {
+      key += '\n' + name + ':' + value;
+    }
+
+    // The refresh outlives the request that triggered it.
+    RequestOptions refresh_options = options;
+    refresh_options.cancellation_.reset();
+    refresh_options.deadline_.reset();
+    Client client = *this;
+    client.refresher_ = nullptr;
+    refresher_->schedule(
+        key, [client, target = url.value(), headers, entry,
+              options = std::move(refresh_options)] {
+          (void)client.revalidate(HttpUrl{target}, headers, entry, options);
+        });
+  }
+
+  struct BodyWriter final {
+    CURL *curl;
+    const StatusPredicate &success_predicate;
+    const HttpChunkCallback &chunk_callback;
+    std::optional<size_t> max_body_size;
+    std::string buffer;
+    std::optional<bool> streaming;
+    bool stopped = false;
+    bool too_large = false;
+  };
+
+  // The two legs of a hedged request. The caller and both transfers share
+  // it, so whichever finishes last frees it.
+  struct Hedged final {
+    std::mutex mutex;
+    std::condition_variable done;
+    std::optional<HttpResult> results[2];
+    std::chrono::microseconds latencies[2]{};
+    std::shared_ptr<std::atomic<bool>> superseded =
+        std::make_shared<std::atomic<bool>>(false);
+  };
+
+  // What the progress callback watches during a transfer.
+  struct Progress final {
+    Progress(const std::atomic<bool> *cancelled,
+             const std::atomic<bool> *superseded,
+             std::optional<std::chrono::milliseconds> first_byte,
+             std::optional<std::chrono::milliseconds> idle)
+        : cancelled(cancelled), superseded(superseded), first_byte(first_byte),
+          idle(idle),
+          last_activity(std::chrono::steady_clock::now()) {}
+
+    CURL *curl = nullptr;
+    const std::atomic<bool> *cancelled;
+    const std::atomic<bool> *superseded;
+    const std::optional<std::chrono::milliseconds> first_byte;
+    const std::optional<std::chrono::milliseconds> idle;
+    std::chrono::steady_clock::time_point last_activity;
+    curl_off_t transferred = 0;
+    bool receiving = false;
+    bool timed_out = false;
+  };
+
+  // Aborts the transfer once it is cancelled, a hedge has won, or the first
+  // byte or idle timeout passes.
+  static int progress_callback(void *data, curl_off_t, curl_off_t downloaded,
+                               curl_off_t, curl_off_t uploaded) {
+    auto *progress = static_cast<Progress *>(data);
+    if ((progress->cancelled &&
+         progress->cancelled->load(std::memory_order_relaxed)) ||
+        (progress->superseded &&
+         progress->superseded->load(std::memory_order_relaxed))) {
+      return 1;
+    }
+    if (!progress->first_byte && !progress->idle) {
+      return 0;
+    }
+
+    const auto now = std::chrono::steady_clock::now();
+    if (!progress->receiving) {
+      curl_off_t first_byte = 0;
+      curl_easy_getinfo(progress->curl, CURLINFO_STARTTRANSFER_TIME_T,
+                        &first_byte);
+      if (first_byte > 0) {
+        progress->receiving = true;
+        progress->last_activity = now;
+      }
+    }
+    if (downloaded + uploaded != progress->transferred) {
+      progress->transferred = downloaded + uploaded;
+      progress->last_activity = now;
+    }
+
+    const std::optional<std::chrono::milliseconds> &limit =
+        progress->receiving ? progress->idle : progress->first_byte;
+    if (limit && now - progress->last_activity > *limit) {
+      progress->timed_out = true;
+      return 1;
+    }
+    return 0;
+  }
+
+  static size_t header_callback(void *contents, size_t size, size_t nmemb,
+                                void *userp) {
+    ((std::string *)userp)->append((char *)contents, size * nmemb); // NOLINT
+    return size * nmemb;
+  }
+
+  // Streams the body to the chunk callback once the status is known to be
+  // successful. Anything else is buffered, up to the body size limit, so
+  // failures keep their body.
+  static size_t write_callback(void *contents, size_t size, size_t nmemb,
+                               void *userp) {
+    auto *writer = static_cast<BodyWriter *>(userp);
+    const size_t length = size * nmemb;
+    if (writer->chunk_callback) {
+      if (!writer->streaming.has_value()) {
+        int64_t status_code = 0;
+        curl_easy_getinfo(writer->curl, CURLINFO_RESPONSE_CODE, &status_code);
+        writer->streaming =
+            writer->success_predicate(HttpStatusCode{status_code});
+      }
+
+      if (*writer->streaming) {
+        writer->stopped = !writer->chunk_callback(
+            std::string_view{static_cast<char *>(contents), length});
+        return writer->stopped ? 0 : length;
+      }
+    }
+
+    if (writer->max_body_size &&
+        writer->buffer.size() + length > *writer->max_body_size) {
+      writer->too_large = true;
+      return 0;
+    }
+
+    writer->buffer.append(static_cast<char *>(contents), length);
+    return length;
+  }
+
+  static CurlHeaderCallback make_header_callback(const Headers &headers) {
+    return headers.empty()
+               ? NoopCurlHeaderCallback
+               : [&headers](curl_slist *chunk) {
+                   for (const auto &[key, value] : headers) {
+                     chunk =
+                         curl_slist_append(chunk, (key + ": " + value).c_str());
+                   }
+
+                   return chunk;
+                 };
+  }
+
+  struct CurlWrapper final {
+    explicit CurlWrapper(const StatusPredicate &success_predicate)
+        : curl_(curl_easy_init()), slist_(nullptr),
+          success_predicate_(success_predicate) {}
+
+    ~CurlWrapper() {
+      curl_easy_cleanup(curl_);
+      curl_slist_free_all(slist_);
+    }
+
+    template <class A> void add_option(const CURLoption option, A value) {
+      curl_easy_setopt(curl_, option, value);
+    }
+
+    void execute_header_callback(const CurlHeaderCallback &header_callback) {
+      slist_ = header_callback(slist_);
+    }
+
+    void append_header(const std::string &header) {
+      slist_ = curl_slist_append(slist_, header.c_str());
+    }
+
+    void execute_setup_callback(const CurlSetupCallback &setup_callback) {
+      setup_callback(curl_);
+    }
+
+    // The method of the last request sent, or empty before libcurl 7.72.
+    [[nodiscard]] std::string method() const {
+#if LIBCURL_VERSION_NUM >= 0x074800
+      char *method = nullptr;
+      curl_easy_getinfo(curl_, CURLINFO_EFFECTIVE_METHOD, &method);
+      if (method != nullptr) {
+        return method;
+      }
+#endif
+      return {};
+    }
+
+    [[nodiscard]] HttpResult
+    execute(const HttpChunkCallback &chunk_callback,
+            const std::optional<size_t> &max_body_size,
+            Progress *progress = nullptr) {
+      BodyWriter writer{curl_, success_predicate_, chunk_callback,
+                        max_body_size};
       std::string header_buffer;
+      if (progress != nullptr) {
+        progress->curl = curl_;
+      }
 
       curl_easy_setopt(curl_, CURLOPT_WRITEFUNCTION, write_callback);
-      curl_easy_setopt(curl_, CURLOPT_WRITEDATA, &body_buffer);
+      curl_easy_setopt(curl_, CURLOPT_WRITEDATA, &writer);
       curl_easy_setopt(curl_, CURLOPT_HTTPHEADER, slist_);
+      curl_easy_setopt(curl_, CURLOPT_HEADERFUNCTION, header_callback);
       curl_easy_setopt(curl_, CURLOPT_HEADERDATA, &header_buffer);
 
       CURLcode res = curl_easy_perform(curl_);
-      if (res != CURLE_OK) {
+      const HttpTiming timing = HttpTiming::from(curl_);
+      if (writer.too_large || res == CURLE_FILESIZE_EXCEEDED) {
         return HttpResult{
-            HttpFailure{HttpConnectionFailure{curl_easy_strerror(res)}}};
+            HttpFailure{HttpRequestAborted{
+                HttpAbortReason::BodyTooLarge,
+                "Response body exceeds limit of " +
+                    std::to_string(max_body_size.value_or(0)) + " bytes"}},
+            timing};
+      }
+      if (res == CURLE_ABORTED_BY_CALLBACK && progress != nullptr) {
+        if (!progress->timed_out) {
+          return HttpResult{HttpFailure{HttpRequestAborted{
+                                HttpAbortReason::Cancelled, "Request cancelled"}},
+                            timing};
+        }
+        res = CURLE_OPERATION_TIMEDOUT;
+      }
+      if (res != CURLE_OK && !(res == CURLE_WRITE_ERROR && writer.stopped)) {
+        return HttpResult{HttpFailure{HttpConnectionFailure::from(curl_, res)},
+                          timing};
       }
 
       int64_t status_code = 0;
       curl_easy_getinfo(curl_, CURLINFO_RESPONSE_CODE, &status_code);
 
-      HttpStatusCode status{status_code};
-      HttpResponse httpResponse =
-          HttpResponse{status, HttpResponseHeaders{header_buffer},
-                       HttpResponseBody{body_buffer}};
+      HttpResponse httpResponse = HttpResponse{
+          HttpStatusCode{status_code}, HttpResponseHeaders{header_buffer},
+          HttpResponseBody{std::move(writer.buffer)}};
 
-      return success_predicate_(status) ? HttpResult{HttpSuccess{httpResponse}}
-                                        : HttpResult{HttpFailure{httpResponse}};
+      return classify(httpResponse, success_predicate_, timing);
     }
 
   private:
     CURL *curl_;
     curl_slist *slist_;
-    Predicate<HttpStatusCode> success_predicate_;
+    const StatusPredicate &success_predicate_;
   };
 };
 } // namespace SimpleHttp
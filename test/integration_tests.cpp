@@ -1,6 +1,7 @@
 #define CATCH_CONFIG_MAIN
 
 #include "catch.hpp"
+#include <future>
 #include "json.hpp"
 #include "../simple_http.hpp"
 
@@ -84,6 +85,37 @@ static void CHECK_SUCCESS_HEADERS(const HttpResult &result,
   );
 }
 
+static void CHECK_ABORTED(const HttpResult &result, const HttpAbortReason &expected) {
+  result.template match<void>(
+      [&expected](const HttpFailure &failure){
+        failure.template match<void>(
+            [](const HttpConnectionFailure &c) {
+              FAIL(c.value());
+            },
+            [](const HttpResponse &s){
+              FAIL(s);
+            },
+            [&expected](const HttpRequestAborted &a) {
+              CHECK(a.reason() == expected);
+            }
+        );
+      },
+      [](const HttpSuccess &success){
+        FAIL(success.status().to_string() + " : " + success.body().value());
+      }
+  );
+}
+
+static bool CURL_SUPPORTS(const std::string &protocol) {
+  const curl_version_info_data *info = curl_version_info(CURLVERSION_NOW);
+  for (const char *const *supported = info->protocols; *supported != nullptr; ++supported) {
+    if (protocol == *supported) {
+      return true;
+    }
+  }
+  return false;
+}
+
 static void CHECK_CONNECTION_FAILURE(const HttpResult &result, const HttpConnectionFailure &expected) {
   result.template match<void>(
       [&expected](const HttpFailure &failure){
@@ -193,6 +225,21 @@ TEST_CASE("Integration Tests")
     CHECK_CONNECTION_FAILURE(client.get(httpUrl), HttpConnectionFailure{"Unsupported protocol"});
   }
 
+  SECTION("Connection failures carry the CURLcode and phase")
+  {
+    HttpFailure unsupported = *client.get(url.with_protocol(Protcol{"zxcv"})).failure();
+    const auto &setup = std::get<HttpConnectionFailure>(unsupported.value());
+    CHECK(setup.code() == CURLE_UNSUPPORTED_PROTOCOL);
+    CHECK(setup.phase() == HttpConnectionPhase::Setup);
+
+    HttpFailure refused = *client.get(HttpUrl{"http://127.0.0.1:1/get"}).failure();
+    const auto &connect = std::get<HttpConnectionFailure>(refused.value());
+    CHECK(connect.code() == CURLE_COULDNT_CONNECT);
+    CHECK(connect.phase() == HttpConnectionPhase::Connect);
+    CHECK(connect.value() == curl_easy_strerror(CURLE_COULDNT_CONNECT));
+    CHECK(connect.elapsed().count() >= 0);
+  }
+
   SECTION("POST request that expects a 204 NO_CONTENT response")
   {
     HttpUrl httpUrl = url.with_path_segments(PathSegments{{PathSegment{"empty_post_response"}}});
@@ -246,4 +293,655 @@ TEST_CASE("Integration Tests")
 
     CHECK(wrapped == "ok");
   }
-}
\ No newline at end of file
+
+  SECTION("Server-sent events reconnect with Last-Event-ID")
+  {
+    HttpUrl httpUrl = url.with_path_segments(PathSegments{{PathSegment{"events"}}});
+    std::vector<std::string> received;
+    HttpResult result = client.events(httpUrl, [&received](const ServerSentEvent &event) {
+      received.push_back(std::string{event.type} + ":" + std::string{event.id} + ":" + std::string{event.data});
+      return true;
+    });
+
+    CHECK(received == std::vector<std::string>{"message:1:one", "update:2:two\nlines", "message:3:three"});
+    REQUIRE(result.failure().has_value());
+    CHECK(std::get<HttpResponse>(result.failure()->value()).status == NO_CONTENT);
+  }
+
+  SECTION("Server-sent events stop when the callback returns false")
+  {
+    HttpUrl httpUrl = url.with_path_segments(PathSegments{{PathSegment{"events"}}});
+    std::vector<std::string> received;
+    HttpResult result = client.events(httpUrl, [&received](const ServerSentEvent &event) {
+      received.emplace_back(event.data);
+      return false;
+    });
+
+    CHECK(received == std::vector<std::string>{"one"});
+    CHECK_SUCCESS_STATUS(result, OK);
+  }
+
+  SECTION("Line-delimited JSON is parsed per line while streaming")
+  {
+    HttpUrl httpUrl = url.with_path_segments(PathSegments{{PathSegment{"ndjson"}}});
+    std::vector<int> ids;
+    HttpResult result = client.lines(httpUrl, [&ids](std::string_view line) {
+      ids.push_back(nlohmann::json::parse(line)["id"].get<int>());
+      return true;
+    }, eq(OK));
+
+    CHECK(ids == std::vector<int>{1, 2, 3});
+    CHECK_SUCCESS_BODY(result, HttpResponseBody{});
+  }
+
+  SECTION("JSON is parsed incrementally from streamed chunks")
+  {
+    HttpUrl httpUrl = url.with_path_segments(PathSegments{{PathSegment{"json_array"}}});
+    nlohmann::json parsed;
+    nlohmann::detail::json_sax_dom_parser<nlohmann::json> handler{parsed};
+    JsonSaxParser<decltype(handler)> parser{handler};
+    HttpResult result = client.stream(httpUrl, [&parser](std::string_view chunk) {
+      return parser.feed(chunk);
+    }, eq(OK));
+
+    CHECK_SUCCESS_STATUS(result, OK);
+    CHECK(parser.finish());
+    CHECK(parsed == nlohmann::json::parse(R"([{"id": 1, "tags": ["a", "b"]}, {"id": 2, "tags": []}, {"id": 3, "tags": ["c"]}])"));
+  }
+
+  SECTION("Body over the client limit is rejected from Content-Length")
+  {
+    HttpUrl httpUrl = url.with_path_segments(PathSegments{{PathSegment{"large"}}});
+    Client limited = Client{}.with_max_body_size(100);
+
+    CHECK_ABORTED(limited.get(httpUrl), HttpAbortReason::BodyTooLarge);
+  }
+
+  SECTION("Body over the client limit is aborted mid-stream")
+  {
+    HttpUrl httpUrl = url.with_path_segments(PathSegments{{PathSegment{"large_stream"}}});
+    Client limited = Client{}.with_max_body_size(250);
+
+    CHECK_ABORTED(limited.get(httpUrl), HttpAbortReason::BodyTooLarge);
+  }
+
+  SECTION("Per-request body limit overrides the client limit")
+  {
+    HttpUrl httpUrl = url.with_path_segments(PathSegments{{PathSegment{"large_stream"}}});
+    Client limited = Client{}.with_max_body_size(250);
+
+    CHECK_SUCCESS_BODY(limited.get(httpUrl, eq(OK), {}, RequestOptions{}.with_max_body_size(1000)),
+                       HttpResponseBody{std::string(1000, 'x')});
+    CHECK_ABORTED(client.get(httpUrl, eq(OK), {}, RequestOptions{}.with_max_body_size(999)),
+                  HttpAbortReason::BodyTooLarge);
+  }
+}
+
+TEST_CASE("Client cache")
+{
+  auto cache = std::make_shared<HttpCache>(std::make_shared<MemoryCache>(1 << 20));
+  Client client = Client{}.with_cache(cache);
+  HttpUrl url = HttpUrl()
+      .with_protocol(Protcol{"http"})
+      .with_host(Host{"localhost:5000"});
+
+  SECTION("Fresh responses are served from the cache")
+  {
+    HttpUrl httpUrl = url.with_path_segments(PathSegments{{PathSegment{"cached"}}});
+    HttpResult first = client.get(httpUrl);
+    HttpResult second = client.get(httpUrl);
+
+    CHECK(first == second);
+    CHECK(first.timing().has_value());
+    CHECK(!second.timing().has_value());
+    CHECK(cache->statistics().misses == 1);
+    CHECK(cache->statistics().hits == 1);
+  }
+
+  SECTION("no-store responses are never cached")
+  {
+    HttpUrl httpUrl = url.with_path_segments(PathSegments{{PathSegment{"uncached"}}});
+
+    CHECK(client.get(httpUrl) != client.get(httpUrl));
+    CHECK(cache->statistics().hits == 0);
+  }
+
+  SECTION("Request no-cache forces revalidation")
+  {
+    HttpUrl httpUrl = url.with_path_segments(PathSegments{{PathSegment{"cached"}}});
+    HttpResult first = client.get(httpUrl);
+
+    CHECK(first != client.get(httpUrl, {{"Cache-Control", "no-cache"}}));
+    CHECK(cache->statistics().hits == 0);
+  }
+
+  SECTION("Stale entries are revalidated with If-None-Match")
+  {
+    HttpUrl httpUrl = url.with_path_segments(PathSegments{{PathSegment{"etag"}}});
+    HttpResult first = client.get(httpUrl);
+    HttpResult second = client.get(httpUrl);
+
+    CHECK_SUCCESS_STATUS(second, OK);
+    CHECK(first.success()->body() == second.success()->body());
+    CHECK(cache->statistics().revalidations == 1);
+    CHECK(cache->statistics().hits == 0);
+  }
+
+  SECTION("Variants are selected by the Vary request headers")
+  {
+    HttpUrl httpUrl = url.with_path_segments(PathSegments{{PathSegment{"vary"}}});
+    HttpResult english = client.get(httpUrl, {{"Accept-Language", "en"}});
+    HttpResult german = client.get(httpUrl, {{"Accept-Language", "de"}});
+
+    CHECK(english != german);
+    CHECK(client.get(httpUrl, {{"Accept-Language", "en"}}) == english);
+    CHECK(client.get(httpUrl, {{"accept-language", "de"}}) == german);
+    CHECK(cache->statistics().hits == 2);
+  }
+
+  SECTION("Stale responses are served while revalidating in the background")
+  {
+    auto refresher = std::make_shared<BackgroundRefresher>();
+    client.with_background_refresh(refresher);
+    HttpUrl httpUrl = url.with_path_segments(PathSegments{{PathSegment{"swr"}}});
+    HttpResult first = client.get(httpUrl);
+
+    CHECK(client.get(httpUrl) == first);
+    refresher->wait_idle();
+    HttpResult refreshed = client.get(httpUrl);
+    CHECK_SUCCESS_STATUS(refreshed, OK);
+    CHECK(refreshed != first);
+    CHECK(cache->statistics().stale == 2);
+    CHECK(refresher->statistics().completed >= 1);
+  }
+
+  SECTION("stale-if-error can be forced per request")
+  {
+    HttpUrl httpUrl = url.with_path_segments(PathSegments{{PathSegment{"flaky"}}});
+    HttpResult first = client.get(httpUrl);
+
+    CHECK(client.get(httpUrl, StatusCodeSet{OK}, {{"X-Fail", "1"}}).failure().has_value());
+    CHECK(client.get(httpUrl, StatusCodeSet{OK}, {{"X-Fail", "1"}},
+                     RequestOptions{}.with_stale_if_error(std::chrono::seconds{60})) == first);
+    CHECK(cache->statistics().stale == 1);
+  }
+
+  SECTION("stale-if-error is forced per request while an identical request is in flight")
+  {
+    auto coalescer = std::make_shared<RequestCoalescer>();
+    client.with_request_coalescing(coalescer);
+    HttpUrl httpUrl = url.with_path_segments(PathSegments{{PathSegment{"flaky"}}});
+    const Headers failing = {{"X-Fail", "1"}, {"X-Slow", "1"}};
+    HttpResult first = client.get(httpUrl);
+
+    std::future<HttpResult> in_flight =
+        std::async(std::launch::async, [&] { return client.get(httpUrl, StatusCodeSet{OK}, failing); });
+    while (coalescer->statistics().transfers < 2) {
+      std::this_thread::yield();
+    }
+    HttpResult stale = client.get(httpUrl, StatusCodeSet{OK}, failing,
+                                  RequestOptions{}.with_stale_if_error(std::chrono::seconds{60}));
+
+    CHECK(stale == first);
+    CHECK(in_flight.get().failure().has_value());
+    CHECK(coalescer->statistics().coalesced == 0);
+  }
+}
+
+TEST_CASE("Request coalescing")
+{
+  auto coalescer = std::make_shared<RequestCoalescer>();
+  Client client = Client{}.with_request_coalescing(coalescer);
+  HttpUrl url = HttpUrl()
+      .with_protocol(Protcol{"http"})
+      .with_host(Host{"localhost:5000"})
+      .with_path_segments(PathSegments{{PathSegment{"slow"}}});
+
+  SECTION("Concurrent identical requests share a transfer")
+  {
+    std::vector<std::future<HttpResult>> results;
+    for (int i = 0; i < 4; ++i) {
+      results.push_back(std::async(std::launch::async, [&] { return client.get(url); }));
+    }
+    HttpResult rejected = client.get(url, StatusCodeSet{CREATED});
+
+    for (auto &result : results) {
+      CHECK_SUCCESS_STATUS(result.get(), OK);
+    }
+    CHECK(rejected.failure().has_value());
+    CHECK(coalescer->statistics().transfers + coalescer->statistics().coalesced == 5);
+    CHECK(coalescer->statistics().coalesced > 0);
+  }
+
+  SECTION("Requests with a deadline do not wait on a shared transfer")
+  {
+    std::future<HttpResult> in_flight = std::async(std::launch::async, [&] { return client.get(url); });
+    while (coalescer->statistics().transfers == 0) {
+      std::this_thread::yield();
+    }
+
+    const auto started = std::chrono::steady_clock::now();
+    HttpResult result = client.get(url, StatusCodeSet{OK}, {},
+                                   RequestOptions{}.with_total_timeout(std::chrono::milliseconds{100}));
+
+    std::optional<HttpFailure> failure = result.failure();
+    REQUIRE(failure.has_value());
+    REQUIRE(std::holds_alternative<HttpConnectionFailure>(failure->value()));
+    CHECK(std::get<HttpConnectionFailure>(failure->value()).code() == CURLE_OPERATION_TIMEDOUT);
+    CHECK(std::chrono::steady_clock::now() - started < std::chrono::milliseconds{400});
+    CHECK_SUCCESS_STATUS(in_flight.get(), OK);
+    CHECK(coalescer->statistics().coalesced == 0);
+  }
+}
+
+TEST_CASE("Retries")
+{
+  RetryPolicy policy = RetryPolicy{}.with_backoff(std::chrono::milliseconds{1}, std::chrono::milliseconds{10});
+  Client client = Client{}.with_retry_policy(policy);
+  HttpUrl url = HttpUrl()
+      .with_protocol(Protcol{"http"})
+      .with_host(Host{"localhost:5000"});
+
+  SECTION("Idempotent requests are retried")
+  {
+    const std::string key = std::to_string(std::chrono::steady_clock::now().time_since_epoch().count());
+    HttpResult result = client.get(url.with_path_segments(PathSegments{{PathSegment{"retry"}, PathSegment{key}}}));
+
+    CHECK_SUCCESS_BODY(result, HttpResponseBody{"3"});
+    CHECK(policy.statistics().retries == 2);
+  }
+
+  SECTION("Connection failures are retried")
+  {
+    HttpResult result = client.get(HttpUrl{"http://localhost:5999/get"});
+
+    CHECK(result.failure().has_value());
+    CHECK(policy.statistics().retries == 2);
+  }
+
+  SECTION("POST is not retried by default")
+  {
+    (void)client.post(HttpUrl{"http://localhost:5999/post"}, HttpRequestBody{""});
+
+    CHECK(policy.statistics().retries == 0);
+  }
+}
+
+static void CHECK_TIMED_OUT(const HttpResult &result) {
+  std::optional<HttpFailure> failure = result.failure();
+  REQUIRE(failure.has_value());
+  REQUIRE(std::holds_alternative<HttpConnectionFailure>(failure->value()));
+  CHECK(std::get<HttpConnectionFailure>(failure->value()).code() == CURLE_OPERATION_TIMEDOUT);
+}
+
+TEST_CASE("Client timeouts")
+{
+  HttpUrl url = HttpUrl()
+      .with_protocol(Protcol{"http"})
+      .with_host(Host{"localhost:5000"});
+  const auto started = std::chrono::steady_clock::now();
+
+  SECTION("First byte timeout")
+  {
+    Client client = Client{}.with_first_byte_timeout(std::chrono::milliseconds{100});
+
+    CHECK_TIMED_OUT(client.get(url.with_path_segments(PathSegments{{PathSegment{"slow"}}})));
+    CHECK(std::chrono::steady_clock::now() - started < std::chrono::milliseconds{450});
+  }
+
+  SECTION("Per-request timeouts override the client's")
+  {
+    Client client = Client{}.with_first_byte_timeout(std::chrono::milliseconds{100});
+    RequestOptions options = RequestOptions{}.with_first_byte_timeout(std::chrono::seconds{2});
+
+    CHECK_SUCCESS_STATUS(client.get(url.with_path_segments(PathSegments{{PathSegment{"slow"}}}), StatusCodeSet{OK}, {}, options), OK);
+  }
+
+  SECTION("Idle timeout")
+  {
+    Client client = Client{}.with_idle_timeout(std::chrono::milliseconds{100});
+
+    CHECK_TIMED_OUT(client.get(url.with_path_segments(PathSegments{{PathSegment{"stall"}}})));
+    CHECK(std::chrono::steady_clock::now() - started < std::chrono::milliseconds{900});
+  }
+
+  SECTION("Total timeout")
+  {
+    Client client = Client{}.with_total_timeout(std::chrono::milliseconds{100});
+
+    CHECK_TIMED_OUT(client.get(url.with_path_segments(PathSegments{{PathSegment{"slow"}}})));
+  }
+
+  SECTION("Passed deadlines fail without a transfer")
+  {
+    RequestOptions options = RequestOptions{}.with_deadline(started);
+
+    HttpResult result = Client{}.get(url.with_path_segments(PathSegments{{PathSegment{"get"}}}), StatusCodeSet{OK}, {}, options);
+
+    CHECK_TIMED_OUT(result);
+    CHECK(std::get<HttpConnectionFailure>(result.failure()->value()).phase() == HttpConnectionPhase::Setup);
+  }
+
+  SECTION("Retries stop at the deadline")
+  {
+    RetryPolicy policy = RetryPolicy{}.with_backoff(std::chrono::milliseconds{500}, std::chrono::seconds{1});
+    Client client = Client{}.with_retry_policy(policy).with_total_timeout(std::chrono::milliseconds{300});
+
+    CHECK_CONNECTION_FAILURE(client.get(HttpUrl{"http://localhost:5999/get"}), HttpConnectionFailure{"Couldn't connect to server"});
+    CHECK(policy.statistics().retries == 0);
+    CHECK(std::chrono::steady_clock::now() - started < std::chrono::milliseconds{300});
+  }
+}
+
+TEST_CASE("Timing")
+{
+  Client client;
+  HttpUrl url{"http://localhost:5000/get_hello"};
+
+  HttpResult first = client.get(url);
+  REQUIRE(first.timing().has_value());
+  const HttpTiming &timing = *first.timing();
+  CHECK(timing.namelookup <= timing.connect);
+  CHECK(timing.connect <= timing.pretransfer);
+  CHECK(timing.pretransfer <= timing.starttransfer);
+  CHECK(timing.starttransfer <= timing.total);
+  CHECK(timing.total > std::chrono::microseconds{0});
+  CHECK(timing.bytes_downloaded == first.success()->body().value().size());
+  CHECK(!timing.reused_connection);
+
+  HttpResult failed = client.get(HttpUrl{"http://localhost:5999/get"});
+  REQUIRE(failed.timing().has_value());
+  CHECK(failed.timing()->bytes_downloaded == 0);
+  CHECK(!failed.timing()->reused_connection);
+}
+
+TEST_CASE("Metrics")
+{
+  auto metrics = std::make_shared<MetricsRegistry>();
+  Client client = Client{}.with_metrics(metrics);
+
+  CHECK_SUCCESS_STATUS(client.get(HttpUrl{"http://localhost:5000/get"}), OK);
+  CHECK_SUCCESS_STATUS(client.get(HttpUrl{"http://localhost:5000/get"}), OK);
+  (void)client.get(HttpUrl{"http://localhost:5999/get"});
+
+  const std::vector<MetricsSeries> snapshot = metrics->snapshot();
+  REQUIRE(snapshot.size() == 2);
+  CHECK(snapshot[0].host == "localhost:5000");
+  CHECK(snapshot[0].method == "GET");
+  CHECK(snapshot[0].status_class == "2xx");
+  CHECK(snapshot[0].requests() == 2);
+  CHECK(snapshot[0].phase(LatencyPhase::Total).percentiles().p99 > std::chrono::microseconds{0});
+  CHECK(snapshot[1].host == "localhost:5999");
+  CHECK(snapshot[1].status_class == "failed");
+  CHECK(snapshot[1].reused_connections == 0);
+}
+
+TEST_CASE("Tracing")
+{
+  auto tracer = std::make_shared<InMemoryTracer>();
+  Client client = Client{}.with_tracer(tracer);
+  HttpUrl url{"http://localhost:5000/traceparent"};
+
+  SECTION("Spans are propagated")
+  {
+    TraceContext parent = TraceContext::root();
+    parent.trace_state = "vendor=1";
+
+    HttpResult result = client.get(url, StatusCodeSet{OK}, {}, RequestOptions{}.with_trace_parent(parent));
+
+    const std::vector<RecordedSpan> spans = tracer->spans();
+    REQUIRE(spans.size() == 1);
+    CHECK_SUCCESS_BODY(result, HttpResponseBody{spans[0].context.traceparent() + ";vendor=1"});
+    CHECK(spans[0].context.trace_id == parent.trace_id);
+    CHECK(!spans[0].parent_span_id.empty());
+    CHECK(spans[0].parent_span_id != parent.span_id);
+    CHECK(spans[0].url == url.value());
+    CHECK(spans[0].method == "GET");
+    CHECK(spans[0].status == OK);
+    CHECK(spans[0].timing.has_value());
+  }
+
+  SECTION("Every attempt has a span")
+  {
+    Client retrying = client.with_retry_policy(
+        RetryPolicy{}.with_backoff(std::chrono::milliseconds{1}, std::chrono::milliseconds{1}));
+
+    (void)retrying.get(HttpUrl{"http://localhost:5999/get"});
+
+    const std::vector<RecordedSpan> spans = tracer->spans();
+    REQUIRE(spans.size() == 3);
+    CHECK(!spans[0].parent_span_id.empty());
+    for (const RecordedSpan &span : spans) {
+      CHECK(span.context.trace_id == spans[0].context.trace_id);
+      CHECK(span.parent_span_id == spans[0].parent_span_id);
+    }
+    CHECK(spans[0].context.span_id != spans[1].context.span_id);
+    CHECK(!spans[0].status.has_value());
+  }
+
+  SECTION("Hedges are in the trace of their request")
+  {
+    Client hedging = client.with_hedging(HedgingPolicy{}.with_delay(std::chrono::milliseconds{100}));
+    const std::string key = std::to_string(std::chrono::steady_clock::now().time_since_epoch().count());
+
+    (void)hedging.get(HttpUrl{"http://localhost:5000/hedge/" + key});
+    std::this_thread::sleep_for(std::chrono::milliseconds{600});
+
+    const std::vector<RecordedSpan> spans = tracer->spans();
+    REQUIRE(spans.size() == 2);
+    CHECK(spans[0].context.trace_id == spans[1].context.trace_id);
+    CHECK(spans[0].parent_span_id == spans[1].parent_span_id);
+  }
+}
+
+TEST_CASE("Cancellation")
+{
+  CancellationToken token;
+  RequestOptions options = RequestOptions{}.with_cancellation(token);
+  const auto started = std::chrono::steady_clock::now();
+  auto cancel_later = [&] {
+    return std::async(std::launch::async, [token] {
+      std::this_thread::sleep_for(std::chrono::milliseconds{100});
+      token.cancel();
+    });
+  };
+
+  SECTION("Cancelled requests are not sent")
+  {
+    token.cancel();
+
+    CHECK_ABORTED(Client{}.get(HttpUrl{"http://localhost:5000/get"}, StatusCodeSet{OK}, {}, options),
+                  HttpAbortReason::Cancelled);
+  }
+
+  SECTION("Transfers in progress are aborted")
+  {
+    auto cancelling = cancel_later();
+
+    CHECK_ABORTED(Client{}.get(HttpUrl{"http://localhost:5000/slow"}, StatusCodeSet{OK}, {}, options),
+                  HttpAbortReason::Cancelled);
+    CHECK(std::chrono::steady_clock::now() - started < std::chrono::milliseconds{450});
+  }
+
+  SECTION("Waits between retries are interrupted")
+  {
+    Client client = Client{}.with_retry_policy(
+        RetryPolicy{}.with_backoff(std::chrono::seconds{2}, std::chrono::seconds{2}));
+    auto cancelling = cancel_later();
+
+    CHECK_ABORTED(client.get(HttpUrl{"http://localhost:5999/get"}, StatusCodeSet{OK}, {}, options),
+                  HttpAbortReason::Cancelled);
+    CHECK(std::chrono::steady_clock::now() - started < std::chrono::seconds{1});
+  }
+}
+
+TEST_CASE("Hedging")
+{
+  HedgingPolicy policy = HedgingPolicy{}.with_delay(std::chrono::milliseconds{100});
+  Client client = Client{}.with_hedging(policy);
+  HttpUrl url = HttpUrl()
+      .with_protocol(Protcol{"http"})
+      .with_host(Host{"localhost:5000"});
+
+  SECTION("A slow first attempt is overtaken by the hedge")
+  {
+    const std::string key = std::to_string(std::chrono::steady_clock::now().time_since_epoch().count());
+    const auto started = std::chrono::steady_clock::now();
+    HttpResult result = client.get(url.with_path_segments(PathSegments{{PathSegment{"hedge"}, PathSegment{key}}}));
+
+    CHECK_SUCCESS_BODY(result, HttpResponseBody{"fast"});
+    CHECK(std::chrono::steady_clock::now() - started < std::chrono::seconds{1});
+    CHECK(policy.statistics().hedges == 1);
+    CHECK(policy.statistics().hedge_wins == 1);
+  }
+
+  SECTION("Fast responses are not hedged")
+  {
+    CHECK_SUCCESS_STATUS(client.get(url.with_path_segments(PathSegments{{PathSegment{"get"}}})), OK);
+    CHECK(policy.statistics().requests == 1);
+    CHECK(policy.statistics().hedges == 0);
+  }
+
+  SECTION("No hedge is sent while every hedging thread is busy")
+  {
+    HedgingPolicy bounded = HedgingPolicy{}.with_delay(std::chrono::milliseconds{100}).with_max_threads(1);
+    Client boundedClient = Client{}.with_hedging(bounded);
+    const std::string key = std::to_string(std::chrono::steady_clock::now().time_since_epoch().count());
+    HttpResult result = boundedClient.get(url.with_path_segments(PathSegments{{PathSegment{"hedge"}, PathSegment{key}}}));
+
+    CHECK_SUCCESS_BODY(result, HttpResponseBody{"slow"});
+    CHECK(bounded.statistics().requests == 1);
+    CHECK(bounded.statistics().hedges == 0);
+  }
+}
+
+TEST_CASE("Circuit breaker")
+{
+  auto breaker = std::make_shared<CircuitBreaker>();
+  breaker->with_minimum_requests(2).with_open_duration(std::chrono::seconds{60});
+  Client client = Client{}.with_circuit_breaker(breaker);
+  HttpUrl down{"http://localhost:5999/get"};
+
+  CHECK_CONNECTION_FAILURE(client.get(down), HttpConnectionFailure{"Couldn't connect to server"});
+  CHECK_CONNECTION_FAILURE(client.get(down), HttpConnectionFailure{"Couldn't connect to server"});
+  CHECK(breaker->state(Host{"localhost:5999"}) == CircuitState::Open);
+  CHECK_ABORTED(client.get(down), HttpAbortReason::CircuitOpen);
+  CHECK_SUCCESS_STATUS(client.get(HttpUrl{"http://localhost:5000/get"}), OK);
+}
+
+TEST_CASE("Upstream groups")
+{
+  auto group = std::make_shared<UpstreamGroup>(
+      Host{"service"}, std::vector<Host>{Host{"localhost:5000"}, Host{"127.0.0.1:5000"}});
+  auto pool = std::make_shared<ConnectionPool>();
+  Client client = Client{}
+      .with_upstream_group(group)
+      .with_connection_pool(pool);
+
+  for (int i = 0; i < 10; ++i) {
+    CHECK_SUCCESS_BODY(client.get(HttpUrl{"http://service/get"}), HttpResponseBody{"{\"get\": \"ok\"}"});
+  }
+  std::vector<UpstreamStatistics> statistics = group->statistics();
+  CHECK(statistics[0].requests + statistics[1].requests == 10);
+  CHECK(statistics[0].outstanding + statistics[1].outstanding == 0);
+  CHECK(pool->idle() == 1);
+}
+
+TEST_CASE("Concurrency limiting")
+{
+  auto limiter = std::make_shared<ConcurrencyLimiter>(LimitAlgorithm::Aimd);
+  limiter->with_limits(1, 1, 1);
+  Client client = Client{}.with_concurrency_limiter(limiter);
+  HttpUrl url{"http://localhost:5000/slow"};
+
+  std::future<HttpResult> first = std::async(std::launch::async, [&] { return client.get(url); });
+  while (limiter->in_flight(Host{"localhost:5000"}) == 0) {
+    std::this_thread::yield();
+  }
+
+  CHECK_ABORTED(client.get(url), HttpAbortReason::ConcurrencyLimited);
+
+  limiter->with_queue_timeout(std::chrono::seconds{5});
+  const auto started = std::chrono::steady_clock::now();
+  CHECK_ABORTED(client.get(url, eq(OK), {}, RequestOptions{}.with_total_timeout(std::chrono::milliseconds{50})),
+                HttpAbortReason::ConcurrencyLimited);
+  CHECK(std::chrono::steady_clock::now() - started < std::chrono::milliseconds{400});
+
+  CancellationToken token;
+  token.cancel();
+  CHECK_ABORTED(client.get(url, eq(OK), {}, RequestOptions{}.with_cancellation(token)), HttpAbortReason::Cancelled);
+
+  CHECK_SUCCESS_STATUS(first.get(), OK);
+  CHECK(limiter->in_flight(Host{"localhost:5000"}) == 0);
+}
+
+TEST_CASE("Rate limiting")
+{
+  auto limiter = std::make_shared<RateLimiter>();
+  limiter->with_host_rate(1000, 10);
+  Client client = Client{}.with_rate_limiter(limiter);
+
+  CHECK(client.get(HttpUrl{"http://localhost:5000/too_many"}).failure().has_value());
+  CHECK_ABORTED(client.get(HttpUrl{"http://localhost:5000/get"}), HttpAbortReason::RateLimited);
+}
+
+TEST_CASE("WebSocket")
+{
+  Client client;
+  HttpUrl url = HttpUrl()
+      .with_protocol(Protcol{"ws"})
+      .with_host(Host{"localhost:5001"});
+
+  if (!CURL_SUPPORTS("ws")) {
+    WARN("libcurl was built without WebSocket support");
+  } else {
+    SECTION("Echo")
+    {
+      auto connected = client.websocket(url);
+      REQUIRE(std::holds_alternative<WebSocket>(connected));
+      WebSocket &socket = std::get<WebSocket>(connected);
+      CHECK(socket.socket() != CURL_SOCKET_BAD);
+
+      char buffer[64];
+      CHECK(!socket.send_text("hello").has_value());
+      auto received = socket.receive(buffer, sizeof(buffer));
+      REQUIRE(std::holds_alternative<WebSocketFrame>(received));
+      CHECK(std::get<WebSocketFrame>(received).text());
+      CHECK(std::string_view{buffer, std::get<WebSocketFrame>(received).length} == "hello");
+
+      CHECK(!socket.send_binary(std::string_view{"\0\1\2", 3}).has_value());
+      received = socket.receive(buffer, 2);
+      REQUIRE(std::holds_alternative<WebSocketFrame>(received));
+      CHECK(std::get<WebSocketFrame>(received).binary());
+      CHECK(std::get<WebSocketFrame>(received).bytes_left == 1);
+      received = socket.receive(buffer + 2, sizeof(buffer) - 2);
+      REQUIRE(std::holds_alternative<WebSocketFrame>(received));
+      CHECK(std::get<WebSocketFrame>(received).bytes_left == 0);
+      CHECK(std::string_view{buffer, 3} == std::string_view{"\0\1\2", 3});
+
+      CHECK(!socket.ping("client").has_value());
+      received = socket.receive(buffer, sizeof(buffer));
+      REQUIRE(std::holds_alternative<WebSocketFrame>(received));
+      CHECK(std::get<WebSocketFrame>(received).pong());
+      CHECK(std::string_view{buffer, std::get<WebSocketFrame>(received).length} == "client");
+
+      CHECK(!socket.send_text("ping-me").has_value());
+      // Depending on the libcurl version the server's ping is surfaced before the
+      // automatic pong is answered.
+      do {
+        received = socket.receive(buffer, sizeof(buffer));
+        REQUIRE(std::holds_alternative<WebSocketFrame>(received));
+      } while (std::get<WebSocketFrame>(received).ping());
+      CHECK(std::string_view{buffer, std::get<WebSocketFrame>(received).length} == "pong:abc");
+
+      CHECK(!socket.close().has_value());
+    }
+
+    SECTION("Connection failure")
+    {
+      HttpUrl httpUrl = url.with_host(Host{"localhost:1"});
+
+      CHECK(std::holds_alternative<HttpConnectionFailure>(client.websocket(httpUrl)));
+    }
+  }
+}
@@ -1,9 +1,13 @@
 from flask import Flask
 from flask import request
 from flask import Response
+import itertools
 import json
+import time
 
 app = Flask(__name__)
+counter = itertools.count()
+attempts = {}
 
 @app.route('/get')
 def get():
@@ -42,5 +46,113 @@ def delete():
 def trace():
     return Response(request.data, status=200, mimetype='message/http')
 
+@app.route('/events')
+def events():
+    last_event_id = request.headers.get('Last-Event-ID')
+    if last_event_id is None:
+        def stream():
+            yield 'retry: 10\n\n: comment\nid: 1\nda'
+            yield 'ta: one\n\nevent: update\nid: 2\ndata: two\n'
+            yield 'data: lines\n\n'
+        return Response(stream(), mimetype='text/event-stream')
+    if last_event_id == '2':
+        return Response('id: 3\r\ndata: three\r\n\r\n', mimetype='text/event-stream')
+    return '', 204
+
+@app.route('/ndjson')
+def ndjson():
+    def stream():
+        yield '{"id": 1, "name": "one"}\n{"id": 2,'
+        yield ' "name": "two"}\r\n'
+        yield '{"id": 3, "name": "three"}'
+    return Response(stream(), mimetype='application/x-ndjson')
+
+@app.route('/json_array')
+def json_array():
+    def stream():
+        yield '[{"id": 1, "tags": ["a", "b"]}, {"id"'
+        yield ': 2, "tags": []}, {"id": 3, "tags": ["c"]}]'
+    return Response(stream(), mimetype='application/json')
+
+@app.route('/large')
+def large():
+    return 'x' * 1000
+
+@app.route('/large_stream')
+def large_stream():
+    def stream():
+        for _ in range(10):
+            yield 'x' * 100
+    return Response(stream())
+
+@app.route('/cached')
+def cached():
+    return Response(str(next(counter)), headers={'Cache-Control': 'max-age=60'})
+
+@app.route('/uncached')
+def uncached():
+    return Response(str(next(counter)), headers={'Cache-Control': 'no-store'})
+
+@app.route('/etag')
+def etag():
+    headers = {'ETag': '"v1"', 'Cache-Control': 'no-cache'}
+    if request.headers.get('If-None-Match') == '"v1"':
+        return Response(status=304, headers=headers)
+    return Response('etag body ' + str(next(counter)), headers=headers)
+
+@app.route('/vary')
+def vary():
+    return Response(request.headers.get('Accept-Language', '') + ':' + str(next(counter)),
+                    headers={'Cache-Control': 'max-age=60', 'Vary': 'Accept-Language'})
+
+@app.route('/slow')
+def slow():
+    time.sleep(0.5)
+    return Response(str(next(counter)))
+
+@app.route('/traceparent')
+def traceparent():
+    return Response(request.headers.get('traceparent', '') + ';' + request.headers.get('tracestate', ''))
+
+@app.route('/stall')
+def stall():
+    def stream():
+        yield 'x'
+        time.sleep(1)
+        yield 'y'
+    return Response(stream())
+
+@app.route('/swr')
+def swr():
+    return Response(str(next(counter)),
+                    headers={'Cache-Control': 'max-age=0, stale-while-revalidate=60'})
+
+@app.route('/flaky')
+def flaky():
+    if request.headers.get('X-Slow'):
+        time.sleep(0.5)
+    if request.headers.get('X-Fail'):
+        return Response(status=503)
+    return Response(str(next(counter)), headers={'Cache-Control': 'max-age=0'})
+
+@app.route('/retry/<key>')
+def retry(key):
+    attempts[key] = attempts.get(key, 0) + 1
+    if attempts[key] <= 2:
+        return Response(status=503, headers={'Retry-After': '0'})
+    return Response(str(attempts[key]))
+
+@app.route('/hedge/<key>')
+def hedge(key):
+    attempts[key] = attempts.get(key, 0) + 1
+    if attempts[key] == 1:
+        time.sleep(2)
+        return Response('slow')
+    return Response('fast')
+
+@app.route('/too_many')
+def too_many():
+    return Response(status=429, headers={'Retry-After': '60'})
+
 if __name__ == '__main__':
     app.run()
\ No newline at end of file
@@ -0,0 +1,94 @@
+import base64
+import hashlib
+import socketserver
+import struct
+
+GUID = '258EAFA5-E914-47DA-95CA-C5AB0DC85B11'
+
+TEXT = 0x1
+BINARY = 0x2
+CLOSE = 0x8
+PING = 0x9
+PONG = 0xA
+
+
+def read_exactly(stream, length):
+    data = b''
+    while len(data) < length:
+        chunk = stream.read(length - len(data))
+        if not chunk:
+            raise ConnectionError('connection closed')
+        data += chunk
+    return data
+
+
+def read_frame(stream):
+    first, second = read_exactly(stream, 2)
+    opcode = first & 0x0F
+    length = second & 0x7F
+    if length == 126:
+        length = struct.unpack('!H', read_exactly(stream, 2))[0]
+    elif length == 127:
+        length = struct.unpack('!Q', read_exactly(stream, 8))[0]
+    mask = read_exactly(stream, 4) if second & 0x80 else b'\0\0\0\0'
+    payload = bytes(b ^ mask[i % 4] for i, b in enumerate(read_exactly(stream, length)))
+    return opcode, payload
+
+
+def write_frame(stream, opcode, payload):
+    header = bytes([0x80 | opcode])
+    if len(payload) < 126:
+        header += bytes([len(payload)])
+    elif len(payload) < 65536:
+        header += bytes([126]) + struct.pack('!H', len(payload))
+    else:
+        header += bytes([127]) + struct.pack('!Q', len(payload))
+    stream.write(header + payload)
+    stream.flush()
+
+
+class EchoHandler(socketserver.StreamRequestHandler):
+    def handle(self):
+        headers = {}
+        self.rfile.readline()
+        while True:
+            line = self.rfile.readline().decode().strip()
+            if not line:
+                break
+            key, _, value = line.partition(':')
+            headers[key.strip().lower()] = value.strip()
+
+        accept = base64.b64encode(
+            hashlib.sha1((headers['sec-websocket-key'] + GUID).encode()).digest()).decode()
+        self.wfile.write(('HTTP/1.1 101 Switching Protocols\r\n'
+                          'Upgrade: websocket\r\n'
+                          'Connection: Upgrade\r\n'
+                          'Sec-WebSocket-Accept: ' + accept + '\r\n\r\n').encode())
+        self.wfile.flush()
+
+        try:
+            while True:
+                opcode, payload = read_frame(self.rfile)
+                if opcode == CLOSE:
+                    write_frame(self.wfile, CLOSE, payload)
+                    return
+                if opcode == PING:
+                    write_frame(self.wfile, PONG, payload)
+                elif opcode == PONG:
+                    write_frame(self.wfile, TEXT, b'pong:' + payload)
+                elif payload == b'ping-me':
+                    write_frame(self.wfile, PING, b'abc')
+                else:
+                    write_frame(self.wfile, opcode, payload)
+        except ConnectionError:
+            pass
+
+
+class Server(socketserver.ThreadingTCPServer):
+    allow_reuse_address = True
+    daemon_threads = True
+
+
+if __name__ == '__main__':
+    with Server(('localhost', 5001), EchoHandler) as server:
+        server.serve_forever()
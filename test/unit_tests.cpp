@@ -1,4 +1,9 @@
 #include "catch.hpp"
+#include <filesystem>
+#include <fstream>
+#include <future>
+#include <regex>
+#include "json.hpp"
 #include "../simple_http.hpp"
 
 TEST_CASE("Predicates")
@@ -51,9 +56,7 @@ TEST_CASE("Predicates")
     CHECK(successful(SimpleHttp::IM_USED));
     CHECK(successful(SimpleHttp::NO_CONTENT));
     CHECK(!successful(SimpleHttp::INTERNAL_SERVER_ERROR));
-
-    //TODO: this exposes the issue with not using an explicit set
-    CHECK(successful(SimpleHttp::HttpStatusCode{209}));
+    CHECK(!successful(SimpleHttp::HttpStatusCode{209}));
   }
 
   SECTION("redirect")
@@ -87,6 +90,62 @@ TEST_CASE("Predicates")
   }
 }
 
+TEST_CASE("StatusCodeSet")
+{
+  SECTION("Membership is known at compile time")
+  {
+    static_assert(SimpleHttp::successful().contains(204));
+    static_assert(!SimpleHttp::successful().contains(209));
+    static_assert(SimpleHttp::redirect().contains(308));
+    static_assert(!SimpleHttp::redirect().contains(306));
+    static_assert(!SimpleHttp::server_error().contains(509));
+  }
+
+  SECTION("Composition")
+  {
+    constexpr SimpleHttp::StatusCodeSet retryable =
+        SimpleHttp::StatusCodeSet{408, 429} | SimpleHttp::server_error();
+    constexpr SimpleHttp::StatusCodeSet retryable_server = retryable & SimpleHttp::server_error();
+
+    CHECK(retryable(SimpleHttp::TOO_MANY_REQUESTS));
+    CHECK(retryable(SimpleHttp::BAD_GATEWAY));
+    CHECK(!retryable(SimpleHttp::NOT_FOUND));
+    CHECK(!retryable_server(SimpleHttp::REQUEST_TIMEOUT));
+    CHECK(retryable_server(SimpleHttp::SERVICE_UNAVAILABLE));
+  }
+
+  SECTION("Out of range codes are never members")
+  {
+    SimpleHttp::StatusCodeSet codes = SimpleHttp::StatusCodeSet::range(-5, 2000);
+
+    CHECK(!codes(SimpleHttp::HttpStatusCode{-1}));
+    CHECK(!codes(SimpleHttp::HttpStatusCode{1024}));
+    CHECK(codes(SimpleHttp::HttpStatusCode{1023}));
+  }
+
+  SECTION("Named codes")
+  {
+    SimpleHttp::StatusCodeSet codes{SimpleHttp::OK, SimpleHttp::NO_CONTENT};
+
+    CHECK(codes(SimpleHttp::NO_CONTENT));
+    CHECK(!codes(SimpleHttp::CREATED));
+  }
+
+  SECTION("StatusPredicate accepts sets and arbitrary predicates")
+  {
+    SimpleHttp::StatusPredicate set = SimpleHttp::successful();
+    SimpleHttp::StatusPredicate function = SimpleHttp::eq(SimpleHttp::CREATED);
+    SimpleHttp::StatusPredicate lambda = [](const SimpleHttp::HttpStatusCode &code) {
+      return code.value() % 2 == 1;
+    };
+
+    CHECK(set(SimpleHttp::ACCEPTED));
+    CHECK(function(SimpleHttp::CREATED));
+    CHECK(!function(SimpleHttp::OK));
+    CHECK(lambda(SimpleHttp::CREATED));
+  }
+}
+
 TEST_CASE("Trimming") {
   SECTION("Left Trim")
   {
@@ -180,6 +239,14 @@ TEST_CASE("HttpUrl") {
   {
     CHECK(SimpleHttp::HttpUrl{"http://example.com"}.value() == "http://example.com");
   }
+
+  SECTION("host")
+  {
+    CHECK(SimpleHttp::HttpUrl{"http://user:pw@example.com:8080/a?b=c"}.host() == SimpleHttp::Host{"example.com:8080"});
+    CHECK(SimpleHttp::HttpUrl{"https://example.com?x"}.host() == SimpleHttp::Host{"example.com"});
+    CHECK(SimpleHttp::HttpUrl{}.with_host(SimpleHttp::Host{"localhost:5000"}).host() ==
+          SimpleHttp::Host{"localhost:5000"});
+  }
 }
 
 TEST_CASE("QueryParameters")
@@ -220,6 +287,8 @@ TEST_CASE("HttpResult")
         SimpleHttp::HttpResponseHeaders{SimpleHttp::Headers{}},
         SimpleHttp::HttpResponseBody{}}};
   SimpleHttp::HttpFailure connectionFailure{SimpleHttp::HttpConnectionFailure{"failure"}};
+  SimpleHttp::HttpFailure abortedFailure{
+      SimpleHttp::HttpRequestAborted{SimpleHttp::HttpAbortReason::BodyTooLarge, "too large"}};
 
   SECTION("Failure")
   {
@@ -235,6 +304,89 @@ TEST_CASE("HttpResult")
     );
   }
 
+  SECTION("Aborted")
+  {
+    CHECK(abortedFailure != connectionFailure);
+    CHECK(abortedFailure.template match<std::string>(
+        [](const SimpleHttp::HttpConnectionFailure &cf) { return "connection: " + cf.value(); },
+        [](const SimpleHttp::HttpResponse &) { return std::string{"response"}; }
+    ) == "connection: too large");
+    CHECK(abortedFailure.template match<bool>(
+        [](const SimpleHttp::HttpConnectionFailure &) { return false; },
+        [](const SimpleHttp::HttpResponse &) { return false; },
+        [](const SimpleHttp::HttpRequestAborted &a) {
+          return a.reason() == SimpleHttp::HttpAbortReason::BodyTooLarge;
+        }
+    ));
+  }
+
+  SECTION("Structured connection failure")
+  {
+    SimpleHttp::HttpConnectionFailure failure{CURLE_OPERATION_TIMEDOUT,
+                                              SimpleHttp::HttpConnectionPhase::Connect,
+                                              std::chrono::milliseconds{250}, "10.0.0.1:443"};
+    std::ostringstream printed;
+    printed << failure;
+
+    CHECK(printed.str() == curl_easy_strerror(CURLE_OPERATION_TIMEDOUT));
+    CHECK(failure == SimpleHttp::HttpConnectionFailure{curl_easy_strerror(CURLE_OPERATION_TIMEDOUT)});
+    CHECK(failure.code() == CURLE_OPERATION_TIMEDOUT);
+    CHECK(failure.phase() == SimpleHttp::HttpConnectionPhase::Connect);
+    CHECK(failure.elapsed() == std::chrono::milliseconds{250});
+    CHECK(failure.remote_address() == "10.0.0.1:443");
+    CHECK(SimpleHttp::HttpConnectionFailure{"failure"}.code() == CURLE_OK);
+  }
+
+  SECTION("Deduced match")
+  {
+    SimpleHttp::HttpResult result{success};
+    auto status = result.match(
+        [](const SimpleHttp::HttpFailure &) { return int64_t{0}; },
+        [](const SimpleHttp::HttpSuccess &s) { return s.status().value(); });
+    static_assert(std::is_same_v<decltype(status), int64_t>);
+    CHECK(status == 200);
+
+    auto describe = [](const SimpleHttp::HttpFailure &f) {
+      return f.match(
+          [](const SimpleHttp::HttpConnectionFailure &cf) { return "connection: " + cf.value(); },
+          [](const SimpleHttp::HttpResponse &r) { return "response: " + r.status.to_string(); });
+    };
+    CHECK(describe(connectionFailure) == "connection: failure");
+    CHECK(describe(semanticFailure) == "response: 400");
+    CHECK(describe(abortedFailure) == "connection: too large");
+    CHECK(abortedFailure.match(
+        [](const SimpleHttp::HttpConnectionFailure &) { return 1; },
+        [](const SimpleHttp::HttpResponse &) { return 2; },
+        [](const SimpleHttp::HttpRequestAborted &) { return 3; }) == 3);
+  }
+
+  SECTION("Copies share the response body")
+  {
+    SimpleHttp::HttpResult result{SimpleHttp::HttpSuccess{
+      SimpleHttp::HttpResponse{
+        SimpleHttp::OK,
+        SimpleHttp::HttpResponseHeaders{SimpleHttp::Headers{}},
+        SimpleHttp::HttpResponseBody{std::string(1024, 'x')}}}};
+    SimpleHttp::HttpResult copy = result;
+
+    CHECK(copy == result);
+    CHECK(copy.success()->body().value().data() == result.success()->body().value().data());
+    CHECK(SimpleHttp::HttpResponseBody{"same"} == SimpleHttp::HttpResponseBody{"same"});
+    CHECK(SimpleHttp::HttpResponseBody{} == SimpleHttp::HttpResponseBody{""});
+    CHECK(SimpleHttp::HttpResponseBody{"a"} != SimpleHttp::HttpResponseBody{"b"});
+  }
+
+  SECTION("Timing is not compared")
+  {
+    SimpleHttp::HttpTiming timing;
+    timing.total = std::chrono::milliseconds{5};
+    SimpleHttp::HttpResult timed{success, timing};
+
+    CHECK(timed == SimpleHttp::HttpResult{success});
+    CHECK(timed.timing()->total == std::chrono::milliseconds{5});
+    CHECK(!SimpleHttp::HttpResult{success}.timing().has_value());
+  }
+
   SECTION("Success")
   {
     SimpleHttp::HttpResult result{success};
@@ -255,4 +407,1200 @@ TEST_CASE("HttpResult")
         }
     );
   }
-}
\ No newline at end of file
+}
+
+TEST_CASE("ServerSentEventParser")
+{
+  std::vector<std::string> events;
+  SimpleHttp::ServerSentEventCallback collect = [&events](const SimpleHttp::ServerSentEvent &event) {
+    events.push_back(std::string{event.type} + "|" + std::string{event.id} + "|" + std::string{event.data});
+    return true;
+  };
+
+  SECTION("Frames split across chunks")
+  {
+    SimpleHttp::ServerSentEventParser parser;
+    CHECK(parser.feed("id: 7\nda", collect));
+    CHECK(parser.feed("ta: first\ndata:second\n", collect));
+    CHECK(events.empty());
+    CHECK(parser.feed("\n", collect));
+
+    CHECK(events == std::vector<std::string>{"message|7|first\nsecond"});
+    CHECK(parser.last_event_id() == "7");
+  }
+
+  SECTION("CRLF and CR line endings")
+  {
+    SimpleHttp::ServerSentEventParser parser;
+    CHECK(parser.feed("event: a\r", collect));
+    CHECK(parser.feed("\ndata: 1\r\r\n", collect));
+    CHECK(parser.feed("data: 2\r\r", collect));
+
+    CHECK(events == std::vector<std::string>{"a||1", "message||2"});
+  }
+
+  SECTION("Comments, unknown fields and empty data are ignored")
+  {
+    SimpleHttp::ServerSentEventParser parser;
+    CHECK(parser.feed(": keepalive\nfoo: bar\nevent: ignored\n\ndata\n\n", collect));
+
+    CHECK(events == std::vector<std::string>{"message||"});
+  }
+
+  SECTION("Retry")
+  {
+    SimpleHttp::ServerSentEventParser parser;
+    CHECK(parser.feed("retry: 250\nretry: soon\n", collect));
+    CHECK(parser.feed("retry: 99999999999999999999999999\nretry: -5\n", collect));
+
+    CHECK(parser.retry() == std::chrono::milliseconds{250});
+  }
+
+  SECTION("Callback stops parsing")
+  {
+    SimpleHttp::ServerSentEventParser parser;
+    int calls = 0;
+    CHECK(!parser.feed("data: 1\n\ndata: 2\n\n", [&calls](const SimpleHttp::ServerSentEvent &) {
+      ++calls;
+      return false;
+    }));
+
+    CHECK(calls == 1);
+  }
+}
+
+TEST_CASE("LineSplitter")
+{
+  std::vector<std::string> lines;
+  SimpleHttp::LineCallback collect = [&lines](std::string_view line) {
+    lines.emplace_back(line);
+    return true;
+  };
+
+  SECTION("Lines split across chunks")
+  {
+    SimpleHttp::LineSplitter splitter;
+    CHECK(splitter.feed("one\ntw", collect));
+    CHECK(splitter.feed("", collect));
+    CHECK(splitter.feed("o\r\n\nthr", collect));
+    CHECK(splitter.feed("ee", collect));
+    CHECK(lines == std::vector<std::string>{"one", "two", ""});
+
+    CHECK(splitter.finish(collect));
+    CHECK(lines == std::vector<std::string>{"one", "two", "", "three"});
+  }
+
+  SECTION("Finish without a partial line")
+  {
+    SimpleHttp::LineSplitter splitter;
+    CHECK(splitter.feed("one\n", collect));
+    CHECK(splitter.finish(collect));
+    CHECK(lines == std::vector<std::string>{"one"});
+  }
+
+  SECTION("Callback stops splitting")
+  {
+    SimpleHttp::LineSplitter splitter;
+    CHECK(!splitter.feed("one\ntwo\n", [&lines](std::string_view line) {
+      lines.emplace_back(line);
+      return false;
+    }));
+    CHECK(lines == std::vector<std::string>{"one"});
+  }
+}
+
+TEST_CASE("JsonSaxParser")
+{
+  const std::string document = R"({"name": "caf\u00e9 \ud83d\ude00", "values": [1, -2, 18446744073709551615, 2.5e3, true, false, null], "nested": {"empty": {}, "list": []}, "escaped": "a\"\\\/\b\f\n\r\t"})";
+
+  SECTION("Produces the same DOM as nlohmann::json::parse when fed one byte at a time")
+  {
+    nlohmann::json parsed;
+    nlohmann::detail::json_sax_dom_parser<nlohmann::json> handler{parsed};
+    SimpleHttp::JsonSaxParser<decltype(handler)> parser{handler};
+    for (char c : document) {
+      REQUIRE(parser.feed(std::string_view{&c, 1}));
+    }
+
+    CHECK(parser.finish());
+    CHECK(parsed == nlohmann::json::parse(document));
+  }
+
+  SECTION("Top level scalars")
+  {
+    nlohmann::json parsed;
+    nlohmann::detail::json_sax_dom_parser<nlohmann::json> handler{parsed};
+    SimpleHttp::JsonSaxParser<decltype(handler)> parser{handler};
+
+    CHECK(parser.feed(" -12"));
+    CHECK(parser.feed("5 "));
+    CHECK(parser.finish());
+    CHECK(parsed == -125);
+  }
+
+  SECTION("Syntax errors")
+  {
+    for (const std::string invalid : {"[1,]", "{\"a\" 1}", "01", "[1] 2", "\"\\ud800\"", "tru", "{\"a\":1"}) {
+      nlohmann::json parsed;
+      nlohmann::detail::json_sax_dom_parser<nlohmann::json> handler{parsed};
+      SimpleHttp::JsonSaxParser<decltype(handler)> parser{handler};
+
+      CHECK_FALSE((parser.feed(invalid) && parser.finish()));
+      CHECK(parser.error().has_value());
+    }
+  }
+
+  SECTION("Handler stops parsing")
+  {
+    struct CountingHandler {
+      int values = 0;
+      bool null() { return ++values < 2; }
+      bool boolean(bool) { return ++values < 2; }
+      bool number_integer(int64_t) { return ++values < 2; }
+      bool number_unsigned(uint64_t) { return ++values < 2; }
+      bool number_float(double, const std::string &) { return ++values < 2; }
+      bool string(std::string &) { return ++values < 2; }
+      bool start_object(std::size_t) { return true; }
+      bool key(std::string &) { return true; }
+      bool end_object() { return true; }
+      bool start_array(std::size_t) { return true; }
+      bool end_array() { return true; }
+    } handler;
+    SimpleHttp::JsonSaxParser<CountingHandler> parser{handler};
+
+    CHECK(!parser.feed("[1, 2, 3]"));
+    CHECK(handler.values == 2);
+    CHECK(!parser.error().has_value());
+  }
+}
+
+#if defined(__unix__) || defined(__APPLE__)
+// A directory under /tmp that is removed with everything in it, even when an
+// assertion ends the test early.
+struct TemporaryDirectory final {
+  TemporaryDirectory() {
+    char path_template[] = "/tmp/simple_http_cache_XXXXXX";
+    path = mkdtemp(path_template);
+  }
+  ~TemporaryDirectory() { std::filesystem::remove_all(path); }
+
+  std::string path;
+};
+#endif
+
+TEST_CASE("Cache")
+{
+  auto entry = [](const std::string &body, SimpleHttp::Headers headers = {}) {
+    return SimpleHttp::CacheEntry{
+      SimpleHttp::HttpResponse{SimpleHttp::OK, SimpleHttp::HttpResponseHeaders{std::move(headers)},
+                               SimpleHttp::HttpResponseBody{body}},
+      std::chrono::system_clock::now(), std::chrono::seconds{60}, std::chrono::seconds{0}, {}};
+  };
+
+  SECTION("CacheControl")
+  {
+    SimpleHttp::CacheControl directives = SimpleHttp::CacheControl::parse("public, Max-Age=\"30\", no-cache");
+
+    CHECK(directives.max_age == std::chrono::seconds{30});
+    CHECK(directives.no_cache);
+    CHECK(!directives.no_store);
+    CHECK(!SimpleHttp::CacheControl::parse("max-age=soon").max_age.has_value());
+
+    directives = SimpleHttp::CacheControl::parse("max-age=1, stale-while-revalidate=30, stale-if-error=600");
+    CHECK(directives.stale_while_revalidate == std::chrono::seconds{30});
+    CHECK(directives.stale_if_error == std::chrono::seconds{600});
+  }
+
+  SECTION("Freshness")
+  {
+    SimpleHttp::CacheEntry fresh = entry("body");
+    const auto now = fresh.response_time;
+
+    CHECK(fresh.fresh(now + std::chrono::seconds{59}));
+    CHECK(!fresh.fresh(now + std::chrono::seconds{60}));
+    fresh.initial_age = std::chrono::seconds{50};
+    CHECK(!fresh.fresh(now + std::chrono::seconds{10}));
+    CHECK(fresh.usable_stale(now + std::chrono::seconds{10}, std::chrono::seconds{30}));
+    CHECK(!fresh.usable_stale(now + std::chrono::seconds{40}, std::chrono::seconds{30}));
+  }
+
+  SECTION("MemoryCache evicts least recently used entries")
+  {
+    SimpleHttp::MemoryCache cache{30, 1};
+    cache.store("a", entry("0123456789"));
+    cache.store("b", entry("0123456789"));
+    CHECK(cache.lookup("a").has_value());
+    cache.store("c", entry("0123456789"));
+
+    CHECK(cache.lookup("a").has_value());
+    CHECK(!cache.lookup("b").has_value());
+    CHECK(cache.lookup("c").has_value());
+    CHECK(cache.size_bytes() <= 30);
+  }
+
+  SECTION("MemoryCache skips entries larger than a shard")
+  {
+    SimpleHttp::MemoryCache cache{10, 1};
+    cache.store("a", entry("0123456789"));
+
+    CHECK(!cache.lookup("a").has_value());
+    CHECK(cache.size_bytes() == 0);
+  }
+
+  SECTION("HttpCache only stores cacheable responses")
+  {
+    SimpleHttp::HttpCache cache{std::make_shared<SimpleHttp::MemoryCache>(1024)};
+    auto response = [](SimpleHttp::HttpStatusCode status, SimpleHttp::Headers headers) {
+      return SimpleHttp::HttpResponse{status, SimpleHttp::HttpResponseHeaders{std::move(headers)},
+                                      SimpleHttp::HttpResponseBody{"body"}};
+    };
+
+    CHECK(cache.store("u1", {}, response(SimpleHttp::OK, {{"cache-control", "max-age=10"}})).has_value());
+    CHECK(cache.store("u2", {}, response(SimpleHttp::OK, {{"ETag", "\"x\""}}))->freshness_lifetime.count() == 0);
+    CHECK(!cache.store("u3", {}, response(SimpleHttp::OK, {})).has_value());
+    CHECK(!cache.store("u4", {}, response(SimpleHttp::OK, {{"Cache-Control", "max-age=10, no-store"}})).has_value());
+    CHECK(!cache.store("u5", {}, response(SimpleHttp::CREATED, {{"Cache-Control", "max-age=10"}})).has_value());
+    CHECK(!cache.store("u6", {}, response(SimpleHttp::OK, {{"Cache-Control", "max-age=10"}, {"Vary", "*"}})).has_value());
+    CHECK(!cache.store("u7", {{"Cache-Control", "no-store"}}, response(SimpleHttp::OK, {{"Cache-Control", "max-age=10"}})).has_value());
+
+    CHECK(cache.lookup("u1", {}).has_value());
+    CHECK(!cache.lookup("u3", {}).has_value());
+
+    std::optional<SimpleHttp::CacheEntry> stale = cache.store(
+        "u8", {}, response(SimpleHttp::OK, {{"Cache-Control", "max-age=1, stale-while-revalidate=5, stale-if-error=9"}}));
+    CHECK(stale->stale_while_revalidate == std::chrono::seconds{5});
+    CHECK(stale->stale_if_error == std::chrono::seconds{9});
+    CHECK(cache.store("u9", {}, response(SimpleHttp::OK, {{"Cache-Control", "no-cache, stale-if-error=9"},
+                                                            {"ETag", "\"x\""}}))->stale_if_error.count() == 0);
+  }
+
+  SECTION("TieredCache promotes back store hits")
+  {
+    auto front = std::make_shared<SimpleHttp::MemoryCache>(1024);
+    auto back = std::make_shared<SimpleHttp::MemoryCache>(1024);
+    SimpleHttp::TieredCache cache{front, back};
+    back->store("a", entry("body"));
+
+    CHECK(!front->lookup("a").has_value());
+    CHECK(cache.lookup("a")->response.body == SimpleHttp::HttpResponseBody{"body"});
+    CHECK(front->lookup("a").has_value());
+    cache.remove("a");
+    CHECK(!back->lookup("a").has_value());
+  }
+
+#if defined(__unix__) || defined(__APPLE__)
+  TemporaryDirectory temporary;
+  const std::string &directory = temporary.path;
+
+  SECTION("DiskCache persists entries and borrows bodies from the mapping")
+  {
+    {
+      SimpleHttp::DiskCache cache{directory, 1 << 20};
+      REQUIRE(cache.available());
+      cache.store("a", entry(std::string(4096, 'x'), {{"ETag", "\"v1\""}}));
+      SimpleHttp::CacheEntry first = entry("first");
+      first.stale_if_error = std::chrono::seconds{5};
+      cache.store("b", first);
+      cache.store("b", entry("second"));
+      cache.remove("a");
+      cache.store("a", entry(std::string(4096, 'x'), {{"ETag", "\"v1\""}}));
+    }
+
+    SimpleHttp::DiskCache cache{directory, 1 << 20};
+    std::optional<SimpleHttp::CacheEntry> a = cache.lookup("a");
+    REQUIRE(a.has_value());
+    CHECK(a->response.body.borrowed());
+    CHECK(a->response.body.view() == std::string(4096, 'x'));
+    CHECK(a->response.headers.value().at("ETag") == "\"v1\"");
+    CHECK(a->freshness_lifetime == std::chrono::seconds{60});
+    CHECK(a->fresh(std::chrono::system_clock::now()));
+    CHECK(cache.lookup("b")->response.body.value() == "second");
+    CHECK(cache.lookup("b")->stale_if_error.count() == 0);
+    CHECK(!cache.lookup("c").has_value());
+  }
+
+  SECTION("DiskCache evicts the oldest segment")
+  {
+    SimpleHttp::DiskCache cache{directory, 8 * 1024};
+    cache.store("old", entry(std::string(900, 'o')));
+    std::optional<SimpleHttp::CacheEntry> held = cache.lookup("old");
+    for (int i = 0; i < 20; ++i) {
+      cache.store(std::to_string(i), entry(std::string(900, 'n')));
+    }
+
+    CHECK(!cache.lookup("old").has_value());
+    CHECK(cache.lookup("19").has_value());
+    CHECK(cache.size_bytes() <= 8 * 1024);
+    REQUIRE(held.has_value());
+    CHECK(held->response.body.view() == std::string(900, 'o'));
+  }
+
+  SECTION("DiskCache treats a corrupt record as a miss")
+  {
+    {
+      SimpleHttp::DiskCache cache{directory, 1 << 20};
+      cache.store("a", entry("body"));
+    }
+    {
+      std::fstream segment(directory + "/segment-0", std::ios::in | std::ios::out | std::ios::binary);
+      segment.seekp(48);
+      segment.put('!');
+    }
+
+    SimpleHttp::DiskCache cache{directory, 1 << 20};
+    CHECK(!cache.lookup("a").has_value());
+  }
+
+  SECTION("DiskCache treats a corrupt body as a miss")
+  {
+    {
+      SimpleHttp::DiskCache cache{directory, 1 << 20};
+      cache.store("a", entry("body"));
+    }
+    {
+      std::fstream segment(directory + "/segment-0", std::ios::in | std::ios::out | std::ios::binary);
+      segment.seekp(-1, std::ios::end);
+      segment.put('!');
+    }
+
+    SimpleHttp::DiskCache cache{directory, 1 << 20};
+    CHECK(!cache.lookup("a").has_value());
+  }
+
+  SECTION("DiskCache deletes the segments of a reset index")
+  {
+    {
+      SimpleHttp::DiskCache cache{directory, 8 * 1024};
+      for (int i = 0; i < 4; ++i) {
+        cache.store(std::to_string(i), entry(std::string(900, 'n')));
+      }
+    }
+    REQUIRE(std::filesystem::exists(directory + "/segment-3"));
+
+    SimpleHttp::DiskCache cache{directory, 8 * 1024, 128};
+    CHECK(!cache.lookup("0").has_value());
+    CHECK(cache.size_bytes() == 0);
+    CHECK(!std::filesystem::exists(directory + "/segment-3"));
+    CHECK(std::filesystem::file_size(directory + "/segment-0") == 0);
+  }
+#endif
+}
+
+TEST_CASE("RequestCoalescer")
+{
+  SimpleHttp::RequestCoalescer coalescer{{"Accept"}};
+  SimpleHttp::HttpUrl url = SimpleHttp::HttpUrl{}
+      .with_protocol(SimpleHttp::Protcol{"http"})
+      .with_host(SimpleHttp::Host{"example.com"});
+
+  SECTION("Keys")
+  {
+    SimpleHttp::RequestOptions options;
+
+    CHECK(coalescer.key("GET", url, {{"accept", "a"}, {"X-Trace", "1"}}, options) ==
+          coalescer.key("GET", url, {{"Accept", "a"}, {"X-Trace", "2"}}, options));
+    CHECK(coalescer.key("GET", url, {{"Accept", "a"}}, options) !=
+          coalescer.key("GET", url, {{"Accept", "b"}}, options));
+    CHECK(coalescer.key("GET", url, {}, options) != coalescer.key("HEAD", url, {}, options));
+    CHECK(coalescer.key("GET", url, {}, options) !=
+          coalescer.key("GET", url, {}, SimpleHttp::RequestOptions{}.with_max_body_size(10)));
+  }
+
+  SECTION("Keys always include credentials")
+  {
+    SimpleHttp::RequestOptions options;
+
+    CHECK(coalescer.key("GET", url, {{"Authorization", "Bearer a"}}, options) !=
+          coalescer.key("GET", url, {{"Authorization", "Bearer b"}}, options));
+    CHECK(coalescer.key("GET", url, {{"Proxy-Authorization", "Basic a"}}, options) !=
+          coalescer.key("GET", url, {}, options));
+    CHECK(coalescer.key("GET", url, {{"Cookie", "session=a"}}, options) !=
+          coalescer.key("GET", url, {{"cookie", "session=b"}}, options));
+    CHECK(coalescer.key("GET", url, {{"Cookie", "session=a"}}, options) ==
+          coalescer.key("GET", url, {{"cookie", "session=a"}}, options));
+  }
+
+  SECTION("Keys include the stale policies and timeouts")
+  {
+    SimpleHttp::RequestOptions options;
+
+    CHECK(coalescer.key("GET", url, {}, options) !=
+          coalescer.key("GET", url, {}, SimpleHttp::RequestOptions{}.with_stale_if_error(std::chrono::seconds{60})));
+    CHECK(coalescer.key("GET", url, {}, options) !=
+          coalescer.key("GET", url, {}, SimpleHttp::RequestOptions{}.with_stale_while_revalidate(std::chrono::seconds{60})));
+    CHECK(coalescer.key("GET", url, {}, options) !=
+          coalescer.key("GET", url, {}, SimpleHttp::RequestOptions{}.with_first_byte_timeout(std::chrono::seconds{1})));
+  }
+
+  SECTION("Requests with their own limits or trace parent are not shared")
+  {
+    CHECK(SimpleHttp::RequestCoalescer::shareable(SimpleHttp::RequestOptions{}.with_max_body_size(10)));
+    CHECK(!SimpleHttp::RequestCoalescer::shareable(SimpleHttp::RequestOptions{}.with_cancellation({})));
+    CHECK(!SimpleHttp::RequestCoalescer::shareable(
+        SimpleHttp::RequestOptions{}.with_deadline(std::chrono::steady_clock::now())));
+    CHECK(!SimpleHttp::RequestCoalescer::shareable(
+        SimpleHttp::RequestOptions{}.with_total_timeout(std::chrono::seconds{1})));
+    CHECK(!SimpleHttp::RequestCoalescer::shareable(
+        SimpleHttp::RequestOptions{}.with_trace_parent(SimpleHttp::TraceContext::root())));
+  }
+
+  SECTION("Concurrent callers share one transfer")
+  {
+    const uint64_t waiters = 7;
+    std::atomic<int> transfers{0};
+    auto transfer = [&] {
+      transfers++;
+      for (int i = 0; i < 500 && coalescer.statistics().coalesced < waiters; ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds{10});
+      }
+      return SimpleHttp::HttpResult{SimpleHttp::HttpSuccess{SimpleHttp::HttpResponse{
+          SimpleHttp::OK, SimpleHttp::HttpResponseHeaders{""}, SimpleHttp::HttpResponseBody{"shared"}}}};
+    };
+
+    std::vector<std::future<SimpleHttp::HttpResult>> results;
+    results.push_back(std::async(std::launch::async, [&] { return coalescer.run("k", transfer); }));
+    while (coalescer.statistics().transfers == 0) {
+      std::this_thread::yield();
+    }
+    for (uint64_t i = 0; i < waiters; ++i) {
+      results.push_back(std::async(std::launch::async, [&] { return coalescer.run("k", transfer); }));
+    }
+
+    for (auto &result : results) {
+      CHECK(result.get().success()->body() == SimpleHttp::HttpResponseBody{"shared"});
+    }
+    CHECK(transfers == 1);
+    CHECK(coalescer.statistics().transfers == 1);
+    CHECK(coalescer.statistics().coalesced == waiters);
+
+    (void)coalescer.run("k", transfer);
+    CHECK(transfers == 2);
+  }
+}
+
+TEST_CASE("BackgroundRefresher")
+{
+  SimpleHttp::BackgroundRefresher refresher;
+  std::promise<void> release;
+  std::shared_future<void> released = release.get_future().share();
+  std::atomic<int> runs{0};
+
+  CHECK(refresher.schedule("a", [&] { released.wait(); runs++; }));
+  CHECK(!refresher.schedule("a", [&] { runs++; }));
+  CHECK(refresher.schedule("b", [&] { runs++; }));
+  release.set_value();
+  refresher.wait_idle();
+
+  CHECK(runs == 2);
+  CHECK(refresher.statistics().scheduled == 2);
+  CHECK(refresher.statistics().deduplicated == 1);
+  CHECK(refresher.statistics().completed == 2);
+  CHECK(refresher.schedule("a", [&] { runs++; }));
+  refresher.wait_idle();
+  CHECK(runs == 3);
+
+  CHECK(refresher.schedule("c", [] { throw std::runtime_error("refresh failed"); }));
+  refresher.wait_idle();
+  CHECK(refresher.statistics().completed == 4);
+  CHECK(refresher.schedule("c", [&] { runs++; }));
+  refresher.wait_idle();
+  CHECK(runs == 4);
+}
+
+TEST_CASE("RetryPolicy")
+{
+  auto response = [](SimpleHttp::HttpStatusCode status, SimpleHttp::Headers headers = {}) {
+    return SimpleHttp::HttpResult{SimpleHttp::HttpFailure{SimpleHttp::HttpResponse{
+        status, SimpleHttp::HttpResponseHeaders{std::move(headers)}, SimpleHttp::HttpResponseBody{}}}};
+  };
+  const SimpleHttp::HttpResult ok{SimpleHttp::HttpSuccess{SimpleHttp::HttpResponse{
+      SimpleHttp::OK, SimpleHttp::HttpResponseHeaders{""}, SimpleHttp::HttpResponseBody{}}}};
+  std::vector<SimpleHttp::HttpResult> results;
+  auto attempt = [&] {
+    SimpleHttp::HttpResult result = results.front();
+    results.erase(results.begin());
+    return result;
+  };
+  SimpleHttp::RetryPolicy policy = SimpleHttp::RetryPolicy{}
+      .with_backoff(std::chrono::milliseconds{1}, std::chrono::milliseconds{2});
+
+  SECTION("Retryable failures are retried until success")
+  {
+    std::vector<uint32_t> attempts;
+    policy.with_attempt_callback([&](const SimpleHttp::RetryAttempt &a) {
+      attempts.push_back(a.attempt);
+      CHECK(a.delay.has_value() == (a.attempt < 3));
+    });
+    results = {response(SimpleHttp::SERVICE_UNAVAILABLE),
+               SimpleHttp::HttpResult{SimpleHttp::HttpFailure{SimpleHttp::HttpConnectionFailure{
+                   CURLE_COULDNT_CONNECT, SimpleHttp::HttpConnectionPhase::Connect}}},
+               ok};
+
+    CHECK(policy.run(attempt) == ok);
+    CHECK(attempts == std::vector<uint32_t>{1, 2, 3});
+    CHECK(policy.statistics().requests == 1);
+    CHECK(policy.statistics().retries == 2);
+  }
+
+  SECTION("Other failures and exhausted attempts are returned")
+  {
+    results = {response(SimpleHttp::NOT_FOUND)};
+    CHECK(policy.run(attempt) == response(SimpleHttp::NOT_FOUND));
+
+    results = {SimpleHttp::HttpResult{SimpleHttp::HttpFailure{SimpleHttp::HttpConnectionFailure{
+        CURLE_URL_MALFORMAT, SimpleHttp::HttpConnectionPhase::Setup}}}};
+    CHECK(policy.run(attempt).failure().has_value());
+
+    policy.with_max_attempts(2);
+    results = {response(SimpleHttp::BAD_GATEWAY), response(SimpleHttp::GATEWAY_TIMEOUT), ok};
+    CHECK(policy.run(attempt) == response(SimpleHttp::GATEWAY_TIMEOUT));
+    CHECK(policy.statistics().retries == 1);
+  }
+
+  SECTION("Retries are capped by the budget")
+  {
+    policy.with_budget(0.5, 1);
+    results = {response(SimpleHttp::SERVICE_UNAVAILABLE), response(SimpleHttp::SERVICE_UNAVAILABLE), ok};
+
+    CHECK(policy.run(attempt) == response(SimpleHttp::SERVICE_UNAVAILABLE));
+    CHECK(policy.statistics().retries == 1);
+    CHECK(policy.statistics().budget_exhausted == 1);
+
+    results = {response(SimpleHttp::SERVICE_UNAVAILABLE), ok};
+    CHECK(policy.run(attempt) == response(SimpleHttp::SERVICE_UNAVAILABLE));
+    results = {response(SimpleHttp::SERVICE_UNAVAILABLE), ok};
+    CHECK(policy.run(attempt) == ok);
+    CHECK(policy.statistics().budget_exhausted == 2);
+  }
+
+  SECTION("Retry-After")
+  {
+    std::optional<std::chrono::milliseconds> delay;
+    policy.with_max_retry_after(std::chrono::seconds{1})
+        .with_attempt_callback([&](const SimpleHttp::RetryAttempt &a) {
+          if (a.attempt == 1) {
+            delay = a.delay;
+          }
+        });
+
+    results = {response(SimpleHttp::TOO_MANY_REQUESTS, {{"Retry-After", "1"}}), ok};
+    CHECK(policy.run(attempt) == ok);
+    CHECK(delay == std::chrono::milliseconds{1000});
+
+    results = {response(SimpleHttp::TOO_MANY_REQUESTS, {{"Retry-After", "120"}}), ok};
+    CHECK(policy.run(attempt).failure().has_value());
+  }
+
+  SECTION("Waits past the deadline are not made")
+  {
+    policy.with_backoff(std::chrono::milliseconds{200}, std::chrono::milliseconds{400});
+    results = {response(SimpleHttp::SERVICE_UNAVAILABLE), ok};
+
+    CHECK(policy.run(attempt, std::chrono::steady_clock::now() + std::chrono::milliseconds{100}) ==
+          response(SimpleHttp::SERVICE_UNAVAILABLE));
+    CHECK(policy.statistics().retries == 0);
+    CHECK(policy.statistics().budget_exhausted == 0);
+  }
+}
+
+TEST_CASE("CancellationToken")
+{
+  SimpleHttp::CancellationToken token;
+  const SimpleHttp::CancellationToken copy = token;
+
+  CHECK(!copy.cancelled());
+  CHECK(!copy.wait_for(std::chrono::milliseconds{1}));
+
+  auto cancelling = std::async(std::launch::async, [token] {
+    std::this_thread::sleep_for(std::chrono::milliseconds{20});
+    token.cancel();
+  });
+  const auto started = std::chrono::steady_clock::now();
+  CHECK(copy.wait_for(std::chrono::seconds{5}));
+  CHECK(std::chrono::steady_clock::now() - started < std::chrono::seconds{1});
+  CHECK(copy.cancelled());
+}
+
+TEST_CASE("Timeouts")
+{
+  SimpleHttp::Timeouts client;
+  client.connect = std::chrono::milliseconds{100};
+  client.total = std::chrono::milliseconds{1000};
+  SimpleHttp::Timeouts request;
+  request.total = std::chrono::milliseconds{50};
+  request.idle = std::chrono::milliseconds{20};
+
+  const SimpleHttp::Timeouts merged = request.or_else(client);
+  CHECK(merged.connect == std::chrono::milliseconds{100});
+  CHECK(!merged.first_byte.has_value());
+  CHECK(merged.idle == std::chrono::milliseconds{20});
+  CHECK(merged.total == std::chrono::milliseconds{50});
+}
+
+TEST_CASE("LatencyHistogram")
+{
+  using SimpleHttp::LatencyHistogram;
+  using std::chrono::microseconds;
+
+  SECTION("Buckets are linear within each power of two")
+  {
+    bool contiguous = true;
+    for (size_t bucket = 0; bucket + 1 < LatencyHistogram::BUCKETS; ++bucket) {
+      contiguous = contiguous &&
+                   LatencyHistogram::bucket(LatencyHistogram::lower_bound(bucket)) == bucket &&
+                   LatencyHistogram::bucket(LatencyHistogram::upper_bound(bucket)) == bucket &&
+                   LatencyHistogram::upper_bound(bucket) + microseconds{1} == LatencyHistogram::lower_bound(bucket + 1);
+    }
+    CHECK(contiguous);
+    CHECK(LatencyHistogram::upper_bound(31) == microseconds{31});
+    CHECK(LatencyHistogram::lower_bound(32) == microseconds{32});
+    CHECK(LatencyHistogram::upper_bound(32) == microseconds{33});
+    CHECK(LatencyHistogram::bucket(microseconds{-5}) == 0);
+    CHECK(LatencyHistogram::bucket(std::chrono::hours{1000}) == LatencyHistogram::BUCKETS - 1);
+  }
+
+  SECTION("Percentiles are within the bucket precision")
+  {
+    LatencyHistogram histogram;
+    for (int64_t i = 1; i <= 10000; ++i) {
+      histogram.record(microseconds{i * 100});
+    }
+
+    const SimpleHttp::LatencyPercentiles percentiles = histogram.percentiles();
+    CHECK(histogram.count() == 10000);
+    CHECK(histogram.sum() == microseconds{5000500000});
+    CHECK(std::abs(percentiles.p50.count() - 500000) <= 500000 / 16);
+    CHECK(std::abs(percentiles.p90.count() - 900000) <= 900000 / 16);
+    CHECK(std::abs(percentiles.p99.count() - 990000) <= 990000 / 16);
+    CHECK(std::abs(percentiles.p999.count() - 999000) <= 999000 / 16);
+    CHECK(histogram.count_at_most(LatencyHistogram::upper_bound(LatencyHistogram::bucket(microseconds{1000}))) >= 10);
+    CHECK(LatencyHistogram{}.percentile(0.99) == microseconds{0});
+  }
+
+  SECTION("Merging adds counts")
+  {
+    LatencyHistogram a;
+    LatencyHistogram b;
+    a.record(microseconds{10});
+    b.record(microseconds{10}, 2);
+    a.merge(b);
+
+    CHECK(a.count() == 3);
+    CHECK(a.count(LatencyHistogram::bucket(microseconds{10})) == 3);
+    CHECK(a.sum() == microseconds{30});
+  }
+}
+
+TEST_CASE("MetricsRegistry")
+{
+  auto result = [](int64_t status, bool reused) {
+    SimpleHttp::HttpTiming timing;
+    timing.namelookup = std::chrono::microseconds{100};
+    timing.connect = std::chrono::microseconds{300};
+    timing.pretransfer = std::chrono::microseconds{300};
+    timing.starttransfer = std::chrono::microseconds{1300};
+    timing.total = std::chrono::microseconds{1500};
+    timing.bytes_downloaded = 10;
+    timing.reused_connection = reused;
+    SimpleHttp::HttpResponse response{SimpleHttp::HttpStatusCode{status},
+                                      SimpleHttp::HttpResponseHeaders{""},
+                                      SimpleHttp::HttpResponseBody{}};
+    return status < 400 ? SimpleHttp::HttpResult{SimpleHttp::HttpSuccess{response}, timing}
+                        : SimpleHttp::HttpResult{SimpleHttp::HttpFailure{response}, timing};
+  };
+  SimpleHttp::MetricsRegistry registry;
+  const SimpleHttp::Host host{"example.com"};
+
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; ++t) {
+    threads.emplace_back([&] {
+      for (int i = 0; i < 100; ++i) {
+        registry.record(host, "GET", result(200, i % 2 == 0));
+      }
+      registry.record(host, "POST", result(503, false));
+    });
+  }
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+  registry.record(host, "GET", SimpleHttp::HttpResult{SimpleHttp::HttpFailure{
+      SimpleHttp::HttpRequestAborted{SimpleHttp::HttpAbortReason::CircuitOpen, "open"}}});
+
+  const std::vector<SimpleHttp::MetricsSeries> snapshot = registry.snapshot();
+  REQUIRE(snapshot.size() == 2);
+  const SimpleHttp::MetricsSeries &ok = snapshot[0];
+  CHECK(ok.host == "example.com");
+  CHECK(ok.method == "GET");
+  CHECK(ok.status_class == "2xx");
+  CHECK(ok.requests() == 400);
+  CHECK(ok.reused_connections == 200);
+  CHECK(ok.bytes_downloaded == 4000);
+  CHECK(ok.phase(SimpleHttp::LatencyPhase::Connect).count() == 200);
+  CHECK(ok.phase(SimpleHttp::LatencyPhase::Tls).count() == 0);
+  CHECK(ok.phase(SimpleHttp::LatencyPhase::FirstByte).percentile(0.5) ==
+        SimpleHttp::LatencyHistogram::upper_bound(
+            SimpleHttp::LatencyHistogram::bucket(std::chrono::microseconds{1000})));
+  CHECK(ok.phase(SimpleHttp::LatencyPhase::Total).sum() == std::chrono::microseconds{600000});
+  CHECK(snapshot[1].method == "POST");
+  CHECK(snapshot[1].status_class == "5xx");
+  CHECK(snapshot[1].requests() == 4);
+
+  registry.record(host, "GET", result(200, false));
+  std::thread([&] { registry.record(host, "GET", result(200, false)); }).join();
+  CHECK(registry.snapshot()[0].requests() == 402);
+
+  auto outlived = std::make_unique<SimpleHttp::MetricsRegistry>();
+  std::promise<void> recorded;
+  std::promise<void> destroyed;
+  std::thread outliving([&] {
+    outlived->record(host, "GET", result(200, false));
+    recorded.set_value();
+    destroyed.get_future().wait();
+  });
+  recorded.get_future().wait();
+  outlived.reset();
+  destroyed.set_value();
+  outliving.join();
+}
+
+TEST_CASE("Prometheus exposition")
+{
+  SimpleHttp::MetricsRegistry registry;
+  SimpleHttp::HttpTiming timing;
+  timing.total = std::chrono::milliseconds{7};
+  timing.bytes_downloaded = 42;
+  timing.reused_connection = true;
+  registry.record(SimpleHttp::Host{"api\"host"}, "GET",
+                  SimpleHttp::HttpResult{SimpleHttp::HttpSuccess{SimpleHttp::HttpResponse{
+                      SimpleHttp::OK, SimpleHttp::HttpResponseHeaders{""}, SimpleHttp::HttpResponseBody{}}},
+                                         timing});
+
+  std::string buffer = "# existing\n";
+  SimpleHttp::write_prometheus(registry, buffer);
+
+  const std::string labels = "host=\"api\\\"host\",method=\"GET\",status_class=\"2xx\"";
+  const std::string histogram = "simple_http_request_duration_seconds_bucket{" + labels + ",phase=\"total\",le=";
+  CHECK(buffer.rfind("# existing\n", 0) == 0);
+  CHECK(buffer.find("# TYPE simple_http_requests_total counter\n") != std::string::npos);
+  CHECK(buffer.find("simple_http_requests_total{" + labels + "} 1\n") != std::string::npos);
+  CHECK(buffer.find("simple_http_reused_connections_total{" + labels + "} 1\n") != std::string::npos);
+  CHECK(buffer.find("simple_http_received_bytes_total{" + labels + "} 42\n") != std::string::npos);
+  CHECK(buffer.find("# TYPE simple_http_request_duration_seconds histogram\n") != std::string::npos);
+  CHECK(buffer.find(histogram + "\"0.005\"} 0\n") != std::string::npos);
+  CHECK(buffer.find(histogram + "\"0.01\"} 1\n") != std::string::npos);
+  CHECK(buffer.find(histogram + "\"+Inf\"} 1\n") != std::string::npos);
+  CHECK(buffer.find("simple_http_request_duration_seconds_sum{" + labels + ",phase=\"total\"} 0.007\n") !=
+        std::string::npos);
+  CHECK(buffer.find("phase=\"connect\"") == std::string::npos);
+
+  const std::regex sample{R"(([a-z_]+)\{([a-z_]+="([^"\\]|\\.)*",?)+\} [0-9]+(\.[0-9]+)?)"};
+  const std::regex comment{R"(# (HELP|TYPE) [a-z_]+ .+)"};
+  std::istringstream lines{buffer.substr(buffer.find('\n') + 1)};
+  for (std::string line; std::getline(lines, line);) {
+    INFO(line);
+    CHECK((std::regex_match(line, sample) || std::regex_match(line, comment)));
+  }
+}
+
+TEST_CASE("TraceContext")
+{
+  SECTION("Parsing")
+  {
+    std::optional<SimpleHttp::TraceContext> context = SimpleHttp::TraceContext::parse(
+        "00-0af7651916cd43dd8448eb211c80319c-b7ad6b7169203331-01", "vendor=1");
+    REQUIRE(context.has_value());
+    CHECK(context->trace_id == "0af7651916cd43dd8448eb211c80319c");
+    CHECK(context->span_id == "b7ad6b7169203331");
+    CHECK(context->sampled);
+    CHECK(context->trace_state == "vendor=1");
+    CHECK(context->traceparent() == "00-0af7651916cd43dd8448eb211c80319c-b7ad6b7169203331-01");
+
+    CHECK(!SimpleHttp::TraceContext::parse("00-0af7651916cd43dd8448eb211c80319c-b7ad6b7169203331-00")->sampled);
+    CHECK(SimpleHttp::TraceContext::parse("01-0af7651916cd43dd8448eb211c80319c-b7ad6b7169203331-01-extra"));
+    CHECK(!SimpleHttp::TraceContext::parse("00-0af7651916cd43dd8448eb211c80319c-b7ad6b7169203331-01-extra"));
+    CHECK(!SimpleHttp::TraceContext::parse("ff-0af7651916cd43dd8448eb211c80319c-b7ad6b7169203331-01"));
+    CHECK(!SimpleHttp::TraceContext::parse("00-00000000000000000000000000000000-b7ad6b7169203331-01"));
+    CHECK(!SimpleHttp::TraceContext::parse("00-0AF7651916CD43DD8448EB211C80319C-b7ad6b7169203331-01"));
+    CHECK(!SimpleHttp::TraceContext::parse("00-0af7651916cd43dd8448eb211c80319c-b7ad6b716920333-01"));
+  }
+
+  SECTION("New spans")
+  {
+    const SimpleHttp::TraceContext root = SimpleHttp::TraceContext::root();
+    const SimpleHttp::TraceContext child = root.child();
+
+    CHECK(SimpleHttp::TraceContext::parse(root.traceparent()).has_value());
+    CHECK(root.trace_id.size() == 32);
+    CHECK(child.trace_id == root.trace_id);
+    CHECK(child.span_id.size() == 16);
+    CHECK(child.span_id != root.span_id);
+  }
+}
+
+TEST_CASE("HedgingPolicy")
+{
+  SimpleHttp::HedgingPolicy policy = SimpleHttp::HedgingPolicy{}
+      .with_delay(std::chrono::milliseconds{40})
+      .with_quantile_delay(0.95, 100);
+
+  CHECK(policy.delay("http://a/x") == std::chrono::milliseconds{40});
+  for (int i = 20; i >= 1; --i) {
+    policy.observe("http://a/x", std::chrono::milliseconds{i}, i == 1);
+  }
+
+  CHECK(policy.delay("http://a/x") == std::chrono::milliseconds{19});
+  CHECK(policy.delay("http://a/y") == std::chrono::milliseconds{40});
+  CHECK(policy.statistics().hedge_wins == 1);
+}
+
+TEST_CASE("WorkerPool")
+{
+  std::atomic<int> finished{0};
+  {
+    SimpleHttp::WorkerPool pool{1};
+    std::promise<void> release;
+    std::shared_future<void> released = release.get_future().share();
+
+    CHECK(pool.try_run([&] { released.wait(); finished++; }));
+    CHECK(!pool.try_run([&] { finished++; }));
+    release.set_value();
+    while (!pool.try_run([&] { std::this_thread::sleep_for(std::chrono::milliseconds{50}); finished++; })) {
+      std::this_thread::yield();
+    }
+  }
+
+  CHECK(finished == 2);
+}
+
+TEST_CASE("CircuitBreaker")
+{
+  using Permit = SimpleHttp::CircuitBreaker::Permit;
+  const SimpleHttp::Host host{"example.com"};
+  const SimpleHttp::HttpResult ok{SimpleHttp::HttpSuccess{SimpleHttp::HttpResponse{
+      SimpleHttp::OK, SimpleHttp::HttpResponseHeaders{""}, SimpleHttp::HttpResponseBody{}}}};
+  const SimpleHttp::HttpResult unavailable{SimpleHttp::HttpFailure{SimpleHttp::HttpResponse{
+      SimpleHttp::SERVICE_UNAVAILABLE, SimpleHttp::HttpResponseHeaders{""}, SimpleHttp::HttpResponseBody{}}}};
+  const SimpleHttp::HttpResult refused{SimpleHttp::HttpFailure{SimpleHttp::HttpConnectionFailure{
+      CURLE_COULDNT_CONNECT, SimpleHttp::HttpConnectionPhase::Connect}}};
+
+  std::vector<std::pair<SimpleHttp::CircuitState, SimpleHttp::CircuitState>> transitions;
+  SimpleHttp::CircuitBreaker breaker{16};
+  breaker.with_minimum_requests(4)
+      .with_failure_rate_threshold(0.5)
+      .with_open_duration(std::chrono::milliseconds{20})
+      .with_half_open_probes(2)
+      .with_transition_callback([&](const SimpleHttp::Host &h, SimpleHttp::CircuitState from,
+                                    SimpleHttp::CircuitState to) {
+        CHECK(h == SimpleHttp::Host{"example.com"});
+        transitions.emplace_back(from, to);
+      });
+
+  auto request = [&](const SimpleHttp::HttpResult &result) {
+    Permit permit = breaker.admit(host);
+    breaker.record(host, permit, result);
+    return permit;
+  };
+
+  request(ok);
+  request(ok);
+  request(unavailable);
+  CHECK(breaker.state(host) == SimpleHttp::CircuitState::Closed);
+  request(refused);
+  CHECK(breaker.state(host) == SimpleHttp::CircuitState::Open);
+  CHECK(breaker.admit(host) == Permit::Rejected);
+  CHECK(breaker.state(SimpleHttp::Host{"other.com"}) == SimpleHttp::CircuitState::Closed);
+
+  SECTION("Half-open probes close the circuit when they succeed")
+  {
+    std::this_thread::sleep_for(std::chrono::milliseconds{30});
+    Permit first = breaker.admit(host);
+    Permit second = breaker.admit(host);
+    CHECK(first == Permit::Probe);
+    CHECK(second == Permit::Probe);
+    CHECK(breaker.admit(host) == Permit::Rejected);
+    breaker.record(host, first, ok);
+    breaker.record(host, second, ok);
+
+    CHECK(breaker.state(host) == SimpleHttp::CircuitState::Closed);
+    CHECK(request(unavailable) == Permit::Allowed);
+    CHECK(breaker.state(host) == SimpleHttp::CircuitState::Closed);
+    CHECK(transitions.size() == 3);
+    CHECK(transitions.back().second == SimpleHttp::CircuitState::Closed);
+  }
+
+  SECTION("Aborted requests are not counted and free their probe slot")
+  {
+    const SimpleHttp::HttpResult cancelled{SimpleHttp::HttpFailure{SimpleHttp::HttpConnectionFailure{
+        CURLE_ABORTED_BY_CALLBACK, SimpleHttp::HttpConnectionPhase::Transfer}}};
+    const SimpleHttp::HttpResult too_large{SimpleHttp::HttpFailure{
+        SimpleHttp::HttpRequestAborted{SimpleHttp::HttpAbortReason::BodyTooLarge, "too large"}}};
+    std::this_thread::sleep_for(std::chrono::milliseconds{30});
+    CHECK(request(cancelled) == Permit::Probe);
+    CHECK(request(too_large) == Permit::Probe);
+
+    CHECK(breaker.state(host) == SimpleHttp::CircuitState::HalfOpen);
+    CHECK(request(ok) == Permit::Probe);
+    CHECK(request(ok) == Permit::Probe);
+    CHECK(breaker.state(host) == SimpleHttp::CircuitState::Closed);
+  }
+
+  SECTION("A failed probe reopens the circuit")
+  {
+    std::this_thread::sleep_for(std::chrono::milliseconds{30});
+    CHECK(request(refused) == Permit::Probe);
+
+    CHECK(breaker.state(host) == SimpleHttp::CircuitState::Open);
+    CHECK(breaker.admit(host) == Permit::Rejected);
+    CHECK(transitions.size() == 3);
+  }
+
+  SECTION("Probes aborted after the circuit reopened leave the new probes alone")
+  {
+    const SimpleHttp::HttpResult cancelled{SimpleHttp::HttpFailure{SimpleHttp::HttpConnectionFailure{
+        CURLE_ABORTED_BY_CALLBACK, SimpleHttp::HttpConnectionPhase::Transfer}}};
+    std::this_thread::sleep_for(std::chrono::milliseconds{30});
+    Permit failing = breaker.admit(host);
+    Permit stale = breaker.admit(host);
+    breaker.record(host, failing, refused);
+    std::this_thread::sleep_for(std::chrono::milliseconds{30});
+    Permit probe = breaker.admit(host);
+    breaker.record(host, stale, cancelled);
+    breaker.record(host, probe, cancelled);
+
+    CHECK(breaker.admit(host) == Permit::Probe);
+    CHECK(breaker.admit(host) == Permit::Probe);
+    CHECK(breaker.admit(host) == Permit::Rejected);
+  }
+}
+
+TEST_CASE("ConnectionPool")
+{
+  SimpleHttp::ConnectionPool pool;
+  CURLSH *first = nullptr;
+  {
+    std::shared_ptr<CURLSH> a = pool.acquire();
+    std::shared_ptr<CURLSH> b = pool.acquire();
+    CHECK(a != b);
+    CHECK(pool.idle() == 0);
+    first = a.get();
+    b.reset();
+    CHECK(pool.idle() == 1);
+  }
+
+  CHECK(pool.idle() == 2);
+  CHECK(pool.acquire().get() == first);
+}
+
+TEST_CASE("UpstreamGroup")
+{
+  const std::vector<SimpleHttp::Host> hosts{SimpleHttp::Host{"a:80"}, SimpleHttp::Host{"b:80"}};
+
+  SECTION("Least outstanding")
+  {
+    SimpleHttp::UpstreamGroup group{SimpleHttp::Host{"service"}, hosts};
+    group.start(0);
+    for (int i = 0; i < 20; ++i) {
+      CHECK(group.choose() == 1);
+    }
+    group.finish(0, std::chrono::microseconds{100}, false);
+    CHECK(group.statistics()[0].outstanding == 0);
+    CHECK(group.statistics()[0].requests == 1);
+  }
+
+  SECTION("Peak EWMA")
+  {
+    SimpleHttp::UpstreamGroup group{SimpleHttp::Host{"service"}, hosts, SimpleHttp::LoadBalancing::PeakEwma};
+    group.with_ewma_weight(0.5);
+    group.start(0);
+    group.finish(0, std::chrono::microseconds{1000}, false);
+    group.start(0);
+    group.finish(0, std::chrono::microseconds{3000}, false);
+    CHECK(group.statistics()[0].latency == std::chrono::microseconds{3000});
+    group.start(0);
+    group.finish(0, std::chrono::microseconds{1000}, false);
+    group.start(1);
+    group.finish(1, std::chrono::microseconds{10}, true);
+
+    CHECK(group.statistics()[0].latency == std::chrono::microseconds{2000});
+    CHECK(group.statistics()[1].latency == std::chrono::seconds{1});
+    CHECK(group.choose() == 0);
+  }
+
+  SECTION("Round robin")
+  {
+    SimpleHttp::UpstreamGroup group{SimpleHttp::Host{"service"}, hosts, SimpleHttp::LoadBalancing::RoundRobin};
+    CHECK(group.choose() != group.choose());
+  }
+
+  SECTION("An empty group has no backend to choose")
+  {
+    SimpleHttp::UpstreamGroup group{SimpleHttp::Host{"service"}, {}};
+    CHECK(!group.choose().has_value());
+  }
+}
+
+TEST_CASE("ConcurrencyLimiter")
+{
+  const SimpleHttp::Host host{"example.com"};
+  const SimpleHttp::HttpResult ok{SimpleHttp::HttpSuccess{SimpleHttp::HttpResponse{
+      SimpleHttp::OK, SimpleHttp::HttpResponseHeaders{""}, SimpleHttp::HttpResponseBody{}}}};
+  const SimpleHttp::HttpResult unavailable{SimpleHttp::HttpFailure{SimpleHttp::HttpResponse{
+      SimpleHttp::SERVICE_UNAVAILABLE, SimpleHttp::HttpResponseHeaders{""}, SimpleHttp::HttpResponseBody{}}}};
+  const std::chrono::microseconds rtt{1000};
+
+  SECTION("Requests over the limit are rejected or queued")
+  {
+    SimpleHttp::ConcurrencyLimiter limiter{SimpleHttp::LimitAlgorithm::Aimd};
+    limiter.with_limits(1, 1, 1);
+    REQUIRE(limiter.acquire(host));
+    CHECK(!limiter.acquire(host));
+    CHECK(limiter.acquire(SimpleHttp::Host{"other.com"}));
+
+    limiter.with_queue_timeout(std::chrono::seconds{5});
+    std::future<bool> queued = std::async(std::launch::async, [&] { return limiter.acquire(host); });
+    CHECK(queued.wait_for(std::chrono::milliseconds{20}) == std::future_status::timeout);
+    limiter.release(host, rtt, ok);
+    CHECK(queued.get());
+    CHECK(limiter.in_flight(host) == 1);
+  }
+
+  SECTION("The queue wait ends at the deadline or on cancellation")
+  {
+    SimpleHttp::ConcurrencyLimiter limiter{SimpleHttp::LimitAlgorithm::Aimd};
+    limiter.with_limits(1, 1, 1).with_queue_timeout(std::chrono::seconds{5});
+    REQUIRE(limiter.acquire(host));
+
+    auto started = std::chrono::steady_clock::now();
+    CHECK(!limiter.acquire(host, started + std::chrono::milliseconds{20}));
+    CHECK(std::chrono::steady_clock::now() - started < std::chrono::seconds{1});
+
+    SimpleHttp::CancellationToken token;
+    std::future<bool> queued = std::async(std::launch::async, [&] { return limiter.acquire(host, std::nullopt, token); });
+    CHECK(queued.wait_for(std::chrono::milliseconds{20}) == std::future_status::timeout);
+    started = std::chrono::steady_clock::now();
+    token.cancel();
+    CHECK(!queued.get());
+    CHECK(std::chrono::steady_clock::now() - started < std::chrono::seconds{1});
+    CHECK(limiter.in_flight(host) == 1);
+  }
+
+  SECTION("AIMD grows additively and backs off multiplicatively")
+  {
+    SimpleHttp::ConcurrencyLimiter limiter{SimpleHttp::LimitAlgorithm::Aimd};
+    limiter.with_limits(10, 1, 100).with_backoff_ratio(0.5);
+    for (int i = 0; i < 5; ++i) {
+      REQUIRE(limiter.acquire(host));
+    }
+    limiter.release(host, rtt, ok);
+    CHECK(limiter.limit(host) == 11);
+    limiter.release(host, rtt, unavailable);
+    CHECK(limiter.limit(host) == 5);
+    limiter.release(host, std::chrono::seconds{10}, ok);
+    CHECK(limiter.limit(host) == 2);
+  }
+
+  SECTION("Gradient shrinks when latency rises above its average")
+  {
+    SimpleHttp::ConcurrencyLimiter limiter{SimpleHttp::LimitAlgorithm::Gradient};
+    limiter.with_limits(20, 1, 100);
+    for (int i = 0; i < 50; ++i) {
+      REQUIRE(limiter.acquire(host));
+      limiter.release(host, rtt, ok);
+    }
+    const uint32_t steady = limiter.limit(host);
+    CHECK(steady == 20);
+
+    for (int i = 0; i < 10; ++i) {
+      REQUIRE(limiter.acquire(host));
+      limiter.release(host, rtt * 10, ok);
+    }
+    const uint32_t shrunk = limiter.limit(host);
+    CHECK(shrunk < steady);
+
+    for (uint32_t i = 0; i < shrunk; ++i) {
+      REQUIRE(limiter.acquire(host));
+    }
+    for (uint32_t i = 0; i < shrunk; ++i) {
+      limiter.release(host, rtt, ok);
+    }
+    CHECK(limiter.limit(host) > shrunk);
+  }
+}
+
+TEST_CASE("RateLimiter")
+{
+  const std::chrono::nanoseconds none{0};
+
+  SECTION("TokenBucket")
+  {
+    SimpleHttp::TokenBucket bucket{10, 2};
+    CHECK(bucket.reserve(none) == none);
+    CHECK(bucket.reserve(none) == none);
+    CHECK(!bucket.reserve(none).has_value());
+
+    const std::chrono::nanoseconds interval = std::chrono::milliseconds{100};
+    std::optional<std::chrono::nanoseconds> first = bucket.reserve(std::chrono::seconds{1});
+    std::optional<std::chrono::nanoseconds> second = bucket.reserve(std::chrono::seconds{1});
+    REQUIRE(first.has_value());
+    REQUIRE(second.has_value());
+    CHECK(*first <= interval);
+    CHECK(*second > *first);
+    CHECK(*second - *first <= interval);
+
+    bucket.refund();
+    std::optional<std::chrono::nanoseconds> again = bucket.reserve(std::chrono::seconds{1});
+    REQUIRE(again.has_value());
+    CHECK(*again <= *second);
+  }
+
+  SECTION("Per host and global quotas")
+  {
+    SimpleHttp::RateLimiter limiter;
+    limiter.with_host_rate(SimpleHttp::Host{"a"}, 1, 1).with_global_rate(1, 3);
+
+    CHECK(limiter.acquire(SimpleHttp::Host{"a"}));
+    CHECK(!limiter.acquire(SimpleHttp::Host{"a"}));
+    CHECK(limiter.acquire(SimpleHttp::Host{"b"}));
+    CHECK(limiter.acquire(SimpleHttp::Host{"c"}));
+    CHECK(!limiter.acquire(SimpleHttp::Host{"d"}));
+  }
+
+  SECTION("429 with Retry-After pauses the host")
+  {
+    SimpleHttp::RateLimiter limiter;
+    limiter.with_host_rate(1000, 10);
+    const SimpleHttp::Host host{"a"};
+    REQUIRE(limiter.acquire(host));
+    limiter.observe(host, SimpleHttp::HttpResult{SimpleHttp::HttpFailure{SimpleHttp::HttpResponse{
+        SimpleHttp::TOO_MANY_REQUESTS, SimpleHttp::HttpResponseHeaders{{{"Retry-After", "60"}}},
+        SimpleHttp::HttpResponseBody{}}}});
+
+    CHECK(!limiter.acquire(host));
+    CHECK(limiter.acquire(SimpleHttp::Host{"b"}));
+  }
+
+  SECTION("The wait for a token ends at the deadline or on cancellation")
+  {
+    SimpleHttp::RateLimiter limiter;
+    limiter.with_host_rate(1, 1).with_max_wait(std::chrono::seconds{5});
+    const SimpleHttp::Host host{"a"};
+    REQUIRE(limiter.acquire(host));
+
+    auto started = std::chrono::steady_clock::now();
+    CHECK(!limiter.acquire(host, started + std::chrono::milliseconds{20}));
+    CHECK(std::chrono::steady_clock::now() - started < std::chrono::milliseconds{500});
+
+    SimpleHttp::CancellationToken token;
+    std::future<bool> waiting = std::async(std::launch::async, [&] { return limiter.acquire(host, std::nullopt, token); });
+    CHECK(waiting.wait_for(std::chrono::milliseconds{20}) == std::future_status::timeout);
+    started = std::chrono::steady_clock::now();
+    token.cancel();
+    CHECK(!waiting.get());
+    CHECK(std::chrono::steady_clock::now() - started < std::chrono::milliseconds{500});
+
+    // The cancelled request's token was given back, so the next one is due
+    // within a second rather than two.
+    started = std::chrono::steady_clock::now();
+    CHECK(limiter.acquire(host, started + std::chrono::milliseconds{1500}));
+  }
+}